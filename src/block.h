@@ -72,6 +72,16 @@ int block_init();
  **/
 int block_halt();
 
+/**
+ * \brief Make sure every completed write has reached the medium.
+ * 
+ * Drivers with a write cache (including the host's page cache for an image file) flush it,
+ * drivers that write straight through just return 0.  Called when a volume is unmounted.
+ * 
+ * \return 0 on success, other values indicate an error.
+ **/
+int block_sync();
+
 /**
  * \brief Read the specified block number into memory at the given address.
  * 
@@ -84,6 +94,20 @@ int block_halt();
  **/
 int block_read(blockno_t block, void *buf);
 
+/**
+ * \brief Read several consecutive blocks in one request.
+ * 
+ * Reads count contiguous blocks starting at the given block number into memory.  Drivers should
+ * use the device's multi-block transfer where it has one (e.g. CMD18 on an SD card) so the
+ * command overhead is paid once for the whole run.
+ * 
+ * \param block is the number of the first block to read.
+ * \param count is the number of blocks to read.
+ * \param buf is a pointer to count * #BLOCK_SIZE bytes already allocated in memory
+ * \return 0 on success, anything else may indicate an error.
+ **/
+int block_read_multi(blockno_t block, blockno_t count, void *buf);
+
 /**
  * \brief Write a block from memory to the volume at the specified block address.
  * 
@@ -96,6 +120,122 @@ int block_read(blockno_t block, void *buf);
  **/
 int block_write(blockno_t block, void *buf);
 
+/**
+ * \brief Make count consecutive blocks read back as zeros.
+ *
+ * Lets the filesystem clear new blocks without sending the data, drivers use whatever the device
+ * has for this (e.g. an erase on an SD card, memset() on a RAM disk) and write zeroed blocks
+ * where it has nothing.  Writes to the blocks queued with block_submit() must have completed
+ * before this is called.
+ *
+ * \param block is the number of the first block to clear.
+ * \param count is the number of blocks to clear.
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_write_zeroes(blockno_t block, blockno_t count);
+
+/**
+ * \brief Tell the device that count consecutive blocks no longer hold anything of use.
+ *
+ * Called for blocks the filesystem has freed so a flash device can drop them rather than keep
+ * copying them about during garbage collection.  What the blocks read back as afterwards is
+ * undefined, the filesystem clears blocks again before using them.  A driver with no way to do
+ * this (or for which a range is too short to be worth it) just returns 0.  Writes to the blocks
+ * queued with block_submit() must have completed before this is called.
+ *
+ * \param block is the number of the first block.
+ * \param count is the number of blocks.
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_discard(blockno_t block, blockno_t count);
+
+/**
+ * \brief Opcodes for block_request.op
+ **/
+#define BLOCK_OP_READ   0
+#define BLOCK_OP_WRITE  1
+
+struct block_request;
+
+/**
+ * \typedef typedef void (*block_callback_t)(struct block_request *req)
+ *
+ * Completion callback for an asynchronous request.  It runs in whichever context completes the
+ * request: inside block_submit() for a synchronous driver, inside block_poll() or block_wait()
+ * (or an interrupt handler if the driver says so) for a driver with a real queue.
+ **/
+typedef void (*block_callback_t)(struct block_request *req);
+
+/**
+ * \brief Descriptor for one asynchronous transfer.
+ *
+ * The caller fills in op, block, count, buf and optionally callback and priv, then passes the
+ * descriptor to block_submit().  The descriptor and the buffer belong to the driver until done
+ * is set, they must not be reused or freed before then.
+ **/
+struct block_request {
+  uint8_t op;                   /**< #BLOCK_OP_READ or #BLOCK_OP_WRITE */
+  volatile uint8_t done;        /**< set by the driver once the request has completed */
+  int result;                   /**< 0 on success, driver error code otherwise, valid once done */
+  blockno_t block;              /**< first block of the transfer */
+  blockno_t count;              /**< number of consecutive blocks */
+  void *buf;                    /**< count * #BLOCK_SIZE bytes of data */
+  block_callback_t callback;    /**< called on completion, may be NULL */
+  void *priv;                   /**< for use by the caller */
+  struct block_request *next;   /**< for use by the driver's queue */
+};
+
+/**
+ * \brief Queue a request.
+ * 
+ * Drivers built with BLOCK_DRIVER_ASYNC defined provide a real submission queue and return as soon
+ * as the request is queued.  Every other driver gets a synchronous shim (``block_async.c``) built
+ * on block_read_multi() and block_write() which carries out the transfer before returning, so a
+ * caller written for the asynchronous interface works unchanged with either.
+ * 
+ * \param req is the request to queue, see struct block_request.
+ * \return 0 if the request was accepted, -1 if the queue is full (call block_poll() and retry).
+ **/
+int block_submit(struct block_request *req);
+
+/**
+ * \brief Make progress on queued requests without waiting.
+ * 
+ * Completes whatever requests the device has finished and runs their callbacks.
+ * 
+ * \return the number of requests completed by this call.
+ **/
+int block_poll();
+
+/**
+ * \brief Wait for a request to complete.
+ * 
+ * \param req is a request previously accepted by block_submit().
+ * \return the result of the request, 0 on success.
+ **/
+int block_wait(struct block_request *req);
+
+/**
+ * \brief Get the number of requests the driver can have in flight at once.
+ * 
+ * \return the queue depth, 1 for a synchronous driver.
+ **/
+int block_get_queue_depth();
+
+/**
+ * \brief Get the address of blocks that the driver keeps in memory.
+ * 
+ * Lets the filesystem hand out data without copying it when the medium is memory resident,
+ * e.g. a RAM disk or a mapped image.  Drivers that have to transfer the data (like an SD card)
+ * return NULL.  The data may only be read through the pointer, it stays valid until the next
+ * write to those blocks or block_halt().
+ * 
+ * \param block is the first block.
+ * \param count is the number of consecutive blocks that must be addressable.
+ * \return a pointer to count * #BLOCK_SIZE bytes or NULL.
+ **/
+const void *block_get_ptr(blockno_t block, blockno_t count);
+
 /**
  * \brief Get the size of the volume which contains the filesystem in blocks.
  * 
@@ -107,6 +247,17 @@ int block_write(blockno_t block, void *buf);
  **/
 blockno_t block_get_volume_size();
 
+/**
+ * \brief Get the size of the device's allocation unit in blocks.
+ * 
+ * Flash cards are fastest when each allocation (erase) unit is written from start to end in one
+ * go, e.g. 4MB on most SDHC cards.  The filesystem uses this to start large files at the
+ * beginning of an empty unit.  Units are counted from block 0 of the device.
+ * 
+ * \return the allocation unit in blocks, 0 if the driver doesn't know.
+ **/
+blockno_t block_get_au_size();
+
 /**
  * \brief Returns the compiled value of #BLOCK_SIZE
  * 
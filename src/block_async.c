@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2012-2014, Nathan Dumont
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of 
+ *    conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of 
+ *    conditions and the following disclaimer in the documentation and/or other materials 
+ *    provided with the distribution.
+ * 3. Neither the name of the author nor the names of any contributors may be used to endorse or
+ *    promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * This file is part of the Embext EXT2 compatible filesystem driver.
+ */
+
+/*
+ * Synchronous implementation of the asynchronous request interface in block.h for block drivers
+ * that only provide the blocking calls (e.g. block_sd.c).  Each request is carried out and
+ * completed inside block_submit(), so there is never anything left for block_poll() to do.
+ * Drivers with a real request queue define BLOCK_DRIVER_ASYNC and provide these calls themselves.
+ */
+
+#include <stdint.h>
+#include "block.h"
+
+#ifndef BLOCK_DRIVER_ASYNC
+
+int block_submit(struct block_request *req) {
+  blockno_t i;
+  uint8_t *buf = (uint8_t *)req->buf;
+  
+  req->done = 0;
+  if(req->op == BLOCK_OP_READ) {
+    req->result = block_read_multi(req->block, req->count, buf);
+  } else {
+    req->result = 0;
+    for(i=0;(i<req->count) && (req->result == 0);i++) {
+      req->result = block_write(req->block + i, &buf[i * BLOCK_SIZE]);
+    }
+  }
+  req->done = 1;
+  if(req->callback) {
+    req->callback(req);
+  }
+  return 0;
+}
+
+int block_poll() {
+  return 0;
+}
+
+int block_wait(struct block_request *req) {
+  return req->result;
+}
+
+int block_get_queue_depth() {
+  return 1;
+}
+
+#endif /* ifndef BLOCK_DRIVER_ASYNC */
@@ -0,0 +1,581 @@
+/*
+ * Copyright (c) 2012-2014, Nathan Dumont
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of
+ *    conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of
+ *    conditions and the following disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ * 3. Neither the name of the author nor the names of any contributors may be used to endorse or
+ *    promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * This file is part of the Embext EXT2 compatible filesystem driver.
+ */
+
+/*
+ * Block driver for a Linux host working directly on an image file or a block device, e.g. for a
+ * gateway that serves an SD card image.  Unlike block_pc.c nothing is loaded into memory, every
+ * transfer goes to the file with pread()/pwrite() and block_sync() makes the writes durable
+ * with fdatasync().
+ *
+ * Built with BLOCK_DRIVER_ASYNC defined the driver provides the asynchronous request interface
+ * itself.  Requests are put on an io_uring submission queue and handed to the kernel in one
+ * batch by the next block_poll() or block_wait(), up to #BLOCK_FILE_QUEUE_DEPTH at a time.  If
+ * the kernel doesn't offer io_uring (or the driver is built with BLOCK_FILE_NO_IO_URING) the
+ * requests are carried out with pread()/pwrite() as they are submitted.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE             // fallocate()
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#undef BLOCK_SIZE       // the kernel's idea of a block, not ours
+#endif
+#if defined(BLOCK_DRIVER_ASYNC) && defined(__linux__) && !defined(BLOCK_FILE_NO_IO_URING)
+#define BLOCK_FILE_IO_URING 1
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "../block.h"
+#include "block_file.h"
+
+#ifndef BLOCK_FILE_QUEUE_DEPTH
+#define BLOCK_FILE_QUEUE_DEPTH 32
+#endif
+
+static const char *image_name = NULL;
+static int block_fd = -1;
+static uint64_t block_fs_size = 0;
+static int block_ro = 0;
+static int block_error = 0;
+static int block_is_device = 0;
+static blockno_t block_au_size = 0;
+
+#ifdef BLOCK_FILE_IO_URING
+static struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned pending;             // queued but not yet handed to the kernel
+  unsigned in_flight;           // queued and not yet completed
+} ring = { .fd = -1 };
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int block_file_ring_setup();
+static void block_file_ring_teardown();
+static void block_file_drain();
+#endif
+
+void block_file_set_image_name(const char * const filename) {
+  image_name = filename;
+}
+
+void block_file_set_ro() {
+  block_ro = -1;
+}
+
+/**
+ * \brief Set the allocation unit size of the card behind the image, 0 (the default) for none.
+ **/
+void block_file_set_au_size(uint32_t blocks) {
+  block_au_size = blocks;
+}
+
+int block_init() {
+  struct stat st;
+
+  if((block_fd = open(image_name, block_ro ? O_RDONLY : O_RDWR)) < 0) {
+    fprintf(stderr, "\nFailed to open %s: %s\n", image_name, strerror(errno));
+    block_error = errno;
+    return -1;
+  }
+  if(fstat(block_fd, &st)) {
+    block_error = errno;
+    close(block_fd);
+    block_fd = -1;
+    return -1;
+  }
+  block_fs_size = st.st_size;
+  block_is_device = S_ISBLK(st.st_mode);
+#ifdef BLKGETSIZE64
+  if(S_ISBLK(st.st_mode) && ioctl(block_fd, BLKGETSIZE64, &block_fs_size)) {
+    block_error = errno;
+    close(block_fd);
+    block_fd = -1;
+    return -1;
+  }
+#endif
+  if(block_fs_size / BLOCK_SIZE > MAX_BLOCK) {
+    // blockno_t can't address the rest, use what it can
+    block_fs_size = (uint64_t)MAX_BLOCK * BLOCK_SIZE;
+  }
+#ifdef BLOCK_FILE_IO_URING
+  if(block_file_ring_setup()) {
+    block_file_ring_teardown();
+  }
+#endif
+  return 0;
+}
+
+int block_halt() {
+  if(block_fd >= 0) {
+#ifdef BLOCK_FILE_IO_URING
+    block_file_drain();
+    block_file_ring_teardown();
+#endif
+    close(block_fd);
+    block_fd = -1;
+  }
+  return 0;
+}
+
+/**
+ * \brief Move count blocks between buf and the image with pread()/pwrite().
+ **/
+static int block_file_transfer(uint8_t op, blockno_t block, blockno_t count, void *buf) {
+  uint8_t *p = (uint8_t *)buf;
+  off_t offset = (off_t)block * BLOCK_SIZE;
+  size_t len = (size_t)count * BLOCK_SIZE;
+  ssize_t n;
+
+  if((uint64_t)block + count > block_fs_size / BLOCK_SIZE) {
+    return -1;
+  }
+  if((op == BLOCK_OP_WRITE) && block_ro) {
+    block_error = EROFS;
+    return -1;
+  }
+  while(len > 0) {
+    if(op == BLOCK_OP_READ) {
+      n = pread(block_fd, p, len, offset);
+    } else {
+      n = pwrite(block_fd, p, len, offset);
+    }
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      block_error = errno;
+      return -1;
+    }
+    if(n == 0) {
+      block_error = EIO;
+      return -1;
+    }
+    p += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int block_read(blockno_t block, void *buffer) {
+  return block_file_transfer(BLOCK_OP_READ, block, 1, buffer);
+}
+
+int block_read_multi(blockno_t block, blockno_t count, void *buffer) {
+  return block_file_transfer(BLOCK_OP_READ, block, count, buffer);
+}
+
+int block_write(blockno_t block, void *buffer) {
+  return block_file_transfer(BLOCK_OP_WRITE, block, 1, buffer);
+}
+
+/**
+ * \brief Clear blocks with BLKZEROOUT on a device or by punching a zeroed range in an image file.
+ *
+ * Falls back to writing zeroed blocks when the kernel or the file system can't do either.
+ **/
+int block_write_zeroes(blockno_t block, blockno_t count) {
+  static uint8_t zeros[64 * BLOCK_SIZE];
+  blockno_t amount;
+
+  if((uint64_t)block + count > block_fs_size / BLOCK_SIZE) {
+    return -1;
+  }
+  if(block_ro) {
+    block_error = EROFS;
+    return -1;
+  }
+#ifdef BLOCK_FILE_IO_URING
+  // writes still in the ring would land on top of the zeros
+  block_file_drain();
+#endif
+#ifdef __linux__
+  if(block_is_device) {
+#ifdef BLKZEROOUT
+    uint64_t range[2] = { (uint64_t)block * BLOCK_SIZE, (uint64_t)count * BLOCK_SIZE };
+    if(ioctl(block_fd, BLKZEROOUT, range) == 0) {
+      return 0;
+    }
+#endif
+  } else if(fallocate(block_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, (off_t)block * BLOCK_SIZE,
+                      (off_t)count * BLOCK_SIZE) == 0) {
+    return 0;
+  }
+#endif
+  while(count > 0) {
+    amount = (count > sizeof(zeros) / BLOCK_SIZE) ? sizeof(zeros) / BLOCK_SIZE : count;
+    if(block_file_transfer(BLOCK_OP_WRITE, block, amount, zeros)) {
+      return -1;
+    }
+    block += amount;
+    count -= amount;
+  }
+  return 0;
+}
+
+/**
+ * \brief Discard blocks with BLKDISCARD on a device or by punching a hole in an image file.
+ *
+ * Failures are ignored, the blocks just stay as they were.
+ **/
+int block_discard(blockno_t block, blockno_t count) {
+  if((uint64_t)block + count > block_fs_size / BLOCK_SIZE) {
+    return -1;
+  }
+  if(block_ro) {
+    block_error = EROFS;
+    return -1;
+  }
+#ifdef BLOCK_FILE_IO_URING
+  block_file_drain();
+#endif
+#ifdef __linux__
+  if(block_is_device) {
+#ifdef BLKDISCARD
+    uint64_t range[2] = { (uint64_t)block * BLOCK_SIZE, (uint64_t)count * BLOCK_SIZE };
+    ioctl(block_fd, BLKDISCARD, range);
+#endif
+  } else {
+    fallocate(block_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)block * BLOCK_SIZE,
+              (off_t)count * BLOCK_SIZE);
+  }
+#endif
+  return 0;
+}
+
+const void *block_get_ptr(blockno_t block __attribute__((__unused__)),
+                          blockno_t count __attribute__((__unused__))) {
+  return NULL;
+}
+
+int block_sync() {
+#ifdef BLOCK_FILE_IO_URING
+  block_file_drain();
+#endif
+  if(block_ro) {
+    return 0;
+  }
+  if(fdatasync(block_fd)) {
+    block_error = errno;
+    return -1;
+  }
+  return 0;
+}
+
+blockno_t block_get_volume_size() {
+  return block_fs_size / BLOCK_SIZE;
+}
+
+blockno_t block_get_au_size() {
+  return block_au_size;
+}
+
+int block_get_block_size() {
+  return BLOCK_SIZE;
+}
+
+int block_get_device_read_only() {
+  return block_ro;
+}
+
+int block_get_error() {
+  return block_error;
+}
+
+int block_file_using_io_uring() {
+#ifdef BLOCK_FILE_IO_URING
+  return ring.fd >= 0;
+#else
+  return 0;
+#endif
+}
+
+#ifdef BLOCK_DRIVER_ASYNC
+#ifdef BLOCK_FILE_IO_URING
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * \brief Create the ring and check it can really read from the image.
+ *
+ * Older kernels have io_uring without the plain read and write operations and some sandboxes
+ * refuse the system calls, either way the driver then stays with pread()/pwrite().
+ **/
+static int block_file_ring_setup() {
+  struct io_uring_params p;
+  struct block_request req;
+  uint8_t probe[BLOCK_SIZE];
+
+  memset(&p, 0, sizeof(p));
+  if((ring.fd = sys_io_uring_setup(BLOCK_FILE_QUEUE_DEPTH, &p)) < 0) {
+    return -1;
+  }
+  ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(ring.cq_ring_size > ring.sq_ring_size) {
+      ring.sq_ring_size = ring.cq_ring_size;
+    }
+    ring.cq_ring_size = ring.sq_ring_size;
+  }
+  ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQ_RING);
+  if(ring.sq_ring == MAP_FAILED) {
+    ring.sq_ring = NULL;
+    return -1;
+  }
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring.cq_ring = ring.sq_ring;
+  } else {
+    ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring.fd, IORING_OFF_CQ_RING);
+    if(ring.cq_ring == MAP_FAILED) {
+      ring.cq_ring = NULL;
+      return -1;
+    }
+  }
+  ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring.fd, IORING_OFF_SQES);
+  if(ring.sqes == MAP_FAILED) {
+    ring.sqes = NULL;
+    return -1;
+  }
+  ring.sq_head = (unsigned *)((uint8_t *)ring.sq_ring + p.sq_off.head);
+  ring.sq_tail = (unsigned *)((uint8_t *)ring.sq_ring + p.sq_off.tail);
+  ring.sq_mask = (unsigned *)((uint8_t *)ring.sq_ring + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)((uint8_t *)ring.sq_ring + p.sq_off.array);
+  ring.cq_head = (unsigned *)((uint8_t *)ring.cq_ring + p.cq_off.head);
+  ring.cq_tail = (unsigned *)((uint8_t *)ring.cq_ring + p.cq_off.tail);
+  ring.cq_mask = (unsigned *)((uint8_t *)ring.cq_ring + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)((uint8_t *)ring.cq_ring + p.cq_off.cqes);
+  ring.pending = ring.in_flight = 0;
+
+  memset(&req, 0, sizeof(req));
+  req.op = BLOCK_OP_READ;
+  req.block = 0;
+  req.count = 1;
+  req.buf = probe;
+  if(block_submit(&req) || (sys_io_uring_enter(ring.fd, 1, 1, IORING_ENTER_GETEVENTS) != 1)) {
+    return -1;
+  }
+  ring.pending = 0;
+  block_poll();
+  return (req.done && (req.result == 0)) ? 0 : -1;
+}
+
+static void block_file_ring_teardown() {
+  if(ring.sqes) {
+    munmap(ring.sqes, ring.sqes_size);
+  }
+  if(ring.cq_ring && (ring.cq_ring != ring.sq_ring)) {
+    munmap(ring.cq_ring, ring.cq_ring_size);
+  }
+  if(ring.sq_ring) {
+    munmap(ring.sq_ring, ring.sq_ring_size);
+  }
+  if(ring.fd >= 0) {
+    close(ring.fd);
+  }
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+}
+
+/**
+ * \brief Hand the queued requests to the kernel, optionally waiting for one to complete, then
+ * collect whatever has completed.  Called with the ring lock held.
+ *
+ * \returns the completed requests chained through their next pointers, their callbacks still
+ * have to be run (without the lock held, they may submit more requests).
+ **/
+static struct block_request *block_file_reap(int wait) {
+  struct block_request *done = NULL, *req;
+  unsigned head, flags;
+  int n;
+
+  // another thread may already have collected the request being waited for
+  wait = wait && ring.in_flight;
+  flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  if(ring.pending || wait) {
+    n = sys_io_uring_enter(ring.fd, ring.pending, wait ? 1 : 0, flags);
+    if(n > 0) {
+      ring.pending -= n;
+    }
+  }
+  head = *ring.cq_head;
+  while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    req = (struct block_request *)(uintptr_t)cqe->user_data;
+    if(cqe->res == (int)(req->count * BLOCK_SIZE)) {
+      req->result = 0;
+    } else {
+      block_error = (cqe->res < 0) ? -cqe->res : EIO;
+      req->result = -1;
+    }
+    req->next = done;
+    done = req;
+    ring.in_flight--;
+    head++;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  return done;
+}
+
+static int block_file_complete(struct block_request *done) {
+  struct block_request *next;
+  int n = 0;
+  while(done) {
+    next = done->next;
+    __atomic_store_n(&done->done, 1, __ATOMIC_RELEASE);
+    if(done->callback) {
+      done->callback(done);
+    }
+    done = next;
+    n++;
+  }
+  return n;
+}
+
+static void block_file_drain() {
+  struct block_request *done;
+  if(ring.fd < 0) {
+    return;
+  }
+  pthread_mutex_lock(&ring_lock);
+  while(ring.in_flight) {
+    done = block_file_reap(1);
+    pthread_mutex_unlock(&ring_lock);
+    block_file_complete(done);
+    pthread_mutex_lock(&ring_lock);
+  }
+  pthread_mutex_unlock(&ring_lock);
+}
+
+#endif /* ifdef BLOCK_FILE_IO_URING */
+
+int block_submit(struct block_request *req) {
+  req->done = 0;
+#ifdef BLOCK_FILE_IO_URING
+  if(ring.fd >= 0) {
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+
+    if((req->op == BLOCK_OP_WRITE) && block_ro) {
+      block_error = EROFS;
+      return -1;
+    }
+    if((uint64_t)req->block + req->count > block_fs_size / BLOCK_SIZE) {
+      return -1;
+    }
+    pthread_mutex_lock(&ring_lock);
+    if(ring.in_flight >= BLOCK_FILE_QUEUE_DEPTH) {
+      pthread_mutex_unlock(&ring_lock);
+      return -1;
+    }
+    tail = *ring.sq_tail;
+    sqe = &ring.sqes[tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (req->op == BLOCK_OP_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = block_fd;
+    sqe->off = (uint64_t)req->block * BLOCK_SIZE;
+    sqe->addr = (uintptr_t)req->buf;
+    sqe->len = req->count * BLOCK_SIZE;
+    sqe->user_data = (uintptr_t)req;
+    ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+    ring.in_flight++;
+    pthread_mutex_unlock(&ring_lock);
+    return 0;
+  }
+#endif
+  req->result = block_file_transfer(req->op, req->block, req->count, req->buf);
+  req->done = 1;
+  if(req->callback) {
+    req->callback(req);
+  }
+  return 0;
+}
+
+int block_poll() {
+#ifdef BLOCK_FILE_IO_URING
+  struct block_request *done;
+  if(ring.fd >= 0) {
+    pthread_mutex_lock(&ring_lock);
+    done = block_file_reap(0);
+    pthread_mutex_unlock(&ring_lock);
+    return block_file_complete(done);
+  }
+#endif
+  return 0;
+}
+
+int block_wait(struct block_request *req) {
+#ifdef BLOCK_FILE_IO_URING
+  struct block_request *done;
+  while(!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&ring_lock);
+    done = block_file_reap(1);
+    pthread_mutex_unlock(&ring_lock);
+    block_file_complete(done);
+  }
+#endif
+  return req->result;
+}
+
+int block_get_queue_depth() {
+#ifdef BLOCK_FILE_IO_URING
+  if(ring.fd >= 0) {
+    return BLOCK_FILE_QUEUE_DEPTH;
+  }
+#endif
+  return 1;
+}
+#endif /* ifdef BLOCK_DRIVER_ASYNC */
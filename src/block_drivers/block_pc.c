@@ -30,6 +30,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(BLOCK_PC_WORKER) && !defined(BLOCK_DRIVER_ASYNC)
+#error "BLOCK_PC_WORKER is part of the asynchronous interface, define BLOCK_DRIVER_ASYNC too"
+#endif
+#ifdef BLOCK_DRIVER_ASYNC
+#include <pthread.h>
+#endif
 #include "hash.h"
 #include "../block.h"
 #include "block_pc.h"
@@ -38,14 +48,80 @@ uint64_t block_fs_size=0;
 uint8_t *blocks = NULL;
 int block_ro;
 static const char *image_name = NULL;
+static int map_mode = 0;
+static blockno_t au_size = 0;
+
+#ifdef BLOCK_PC_WORKER
+static int block_pc_start_worker();
+static void block_pc_stop_worker();
+#endif
 
 void block_pc_set_image_name(const char * const filename) {
     image_name = filename;
     return;
 }
 
+/**
+ * \brief Choose how block_init() gets at the image.
+ *
+ * By default the whole image is read into memory, which takes a while and is limited to 2GB.
+ * #BLOCK_PC_MMAP_PRIVATE maps the image instead so start-up costs nothing and only the sectors
+ * touched are ever read, while writes still stay in memory as they do by default.
+ * #BLOCK_PC_MMAP_SHARED writes changes through to the image file, block_sync() waits for them.
+ *
+ * \param mode 0 to read the image into memory, #BLOCK_PC_MMAP_PRIVATE or #BLOCK_PC_MMAP_SHARED.
+ **/
+void block_pc_set_mmap(int mode) {
+  map_mode = mode;
+}
+
+/**
+ * \brief Set the allocation unit size block_get_au_size() reports, 0 (the default) for none.
+ **/
+void block_pc_set_au_size(uint32_t blocks) {
+  au_size = blocks;
+}
+
+static int block_pc_map() {
+  struct stat st;
+  int fd;
+  
+  if((fd = open(image_name, (map_mode == BLOCK_PC_MMAP_SHARED) ? O_RDWR : O_RDONLY)) < 0) {
+    fprintf(stderr, "\nFailed to open filesystem image, does it exist?\n");
+    return -1;
+  }
+  if(fstat(fd, &st) || (st.st_size == 0)) {
+    close(fd);
+    return -1;
+  }
+  block_fs_size = st.st_size;
+  blocks = (uint8_t *)mmap(NULL, block_fs_size, PROT_READ | PROT_WRITE,
+                           (map_mode == BLOCK_PC_MMAP_SHARED) ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  // the mapping holds its own reference to the file
+  close(fd);
+  if(blocks == MAP_FAILED) {
+    blocks = NULL;
+    fprintf(stderr, "\nFailed to mmap() the filesystem image.\n");
+    return -1;
+  }
+  return 0;
+}
+
 int block_init() {
   FILE *block_fp;
+  if(map_mode) {
+    if(block_pc_map()) {
+      return -1;
+    }
+#ifdef BLOCK_PC_WORKER
+    if(block_pc_start_worker()) {
+      fprintf(stderr, "\nFailed to start the block worker thread.\n");
+      block_halt();
+      return -1;
+    }
+#endif
+    return 0;
+  }
   if(!(block_fp = fopen(image_name, "rb"))) {
     fprintf(stderr, "\nFailed to open filesystem image, does it exist?\n");
     return -1;
@@ -53,7 +129,7 @@ int block_init() {
   fseek(block_fp, 0, SEEK_END);
   block_fs_size = ftell(block_fp);
   if(!(block_fs_size < 2048L * 1024L * 1024L)) {
-    fprintf(stderr, "\nAborting, image is over 2GB.\n");
+    fprintf(stderr, "\nAborting, image is over 2GB, use block_pc_set_mmap().\n");
     fclose(block_fp);
     return -1;
   }
@@ -71,12 +147,28 @@ int block_init() {
   }
   
   fclose(block_fp);
+#ifdef BLOCK_PC_WORKER
+  if(block_pc_start_worker()) {
+    fprintf(stderr, "\nFailed to start the block worker thread.\n");
+    free(blocks);
+    blocks = NULL;
+    return -1;
+  }
+#endif
   return 0;
 }
 
 int block_halt() {
+#ifdef BLOCK_PC_WORKER
+    block_pc_stop_worker();
+#endif
     if(blocks) {
-        free(blocks);
+        if(map_mode) {
+            munmap(blocks, block_fs_size);
+        } else {
+            free(blocks);
+        }
+        blocks = NULL;
     }
     return 0;
 }
@@ -85,7 +177,7 @@ int block_read(blockno_t block, void *buffer) {
 //   printf("block read from %x\n", block * BLOCK_SIZE);
   /* we can't allow the file to grow (wouldn't happen with a physical volume) so need to check
      first because in rb+ file will grow if we seek past the end. */
-  if((block+1) * BLOCK_SIZE - 1 > block_fs_size) {
+  if(((uint64_t)block + 1) * BLOCK_SIZE - 1 > block_fs_size) {
     return -1;
   }
 //   fseek(block_fp, block * BLOCK_SIZE, SEEK_SET);
@@ -93,13 +185,28 @@ int block_read(blockno_t block, void *buffer) {
 //     return -1;
 //   }
 //   fflush(block_fp);
-  memcpy(buffer, blocks + block * BLOCK_SIZE, BLOCK_SIZE);
+  memcpy(buffer, blocks + (uint64_t)block * BLOCK_SIZE, BLOCK_SIZE);
+  return 0;
+}
+
+int block_read_multi(blockno_t block, blockno_t count, void *buffer) {
+  if(((uint64_t)block + count) * BLOCK_SIZE - 1 > block_fs_size) {
+    return -1;
+  }
+  memcpy(buffer, blocks + (uint64_t)block * BLOCK_SIZE, (uint64_t)count * BLOCK_SIZE);
   return 0;
 }
 
+const void *block_get_ptr(blockno_t block, blockno_t count) {
+  if(((uint64_t)block + count) * BLOCK_SIZE - 1 > block_fs_size) {
+    return NULL;
+  }
+  return blocks + (uint64_t)block * BLOCK_SIZE;
+}
+
 int block_write(blockno_t block, void *buffer) {
 //   printf("block write at %x\n", block * BLOCK_SIZE);
-  if((block + 1) * BLOCK_SIZE - 1 > block_fs_size) {
+  if(((uint64_t)block + 1) * BLOCK_SIZE - 1 > block_fs_size) {
     return -1;
   }
   
@@ -108,7 +215,205 @@ int block_write(blockno_t block, void *buffer) {
 //     return -1;
 //   }
 //   fflush(block_fp);
-  memcpy(blocks + block * BLOCK_SIZE, buffer, BLOCK_SIZE);
+  memcpy(blocks + (uint64_t)block * BLOCK_SIZE, buffer, BLOCK_SIZE);
+  return 0;
+}
+
+int block_write_zeroes(blockno_t block, blockno_t count) {
+  if(((uint64_t)block + count) * BLOCK_SIZE - 1 > block_fs_size) {
+    return -1;
+  }
+  memset(blocks + (uint64_t)block * BLOCK_SIZE, 0, (uint64_t)count * BLOCK_SIZE);
+  return 0;
+}
+
+/**
+ * Discarded blocks are cleared, which makes anything that reads them before writing show up in
+ * the tests.
+ **/
+int block_discard(blockno_t block, blockno_t count) {
+  return block_write_zeroes(block, count);
+}
+
+#ifdef BLOCK_DRIVER_ASYNC
+/*
+ * Simulated request queue so code written for an asynchronous driver can be tested on the host.
+ * Requests are only carried out when block_poll() is called, one per call in submission order,
+ * which stands in for the device working through its queue while the caller gets on with
+ * something else.
+ *
+ * With BLOCK_PC_WORKER defined a worker thread works through the queue instead, so transfers
+ * really do overlap with the caller.  BLOCK_PC_LATENCY_US adds a delay per block transferred to
+ * make the overlap measurable, e.g. to stand in for an SPI bus.  Callbacks then run on the worker
+ * thread as they would in an interrupt handler.
+ */
+#ifndef BLOCK_PC_QUEUE_DEPTH
+#define BLOCK_PC_QUEUE_DEPTH 4
+#endif
+#ifndef BLOCK_PC_LATENCY_US
+#define BLOCK_PC_LATENCY_US 0
+#endif
+
+static struct block_request *queue_head = NULL, *queue_tail = NULL;
+static int queue_length = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef BLOCK_PC_WORKER
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static int worker_running = 0;
+static int completed = 0;
+#endif
+
+static struct block_request *block_pc_dequeue() {
+  struct block_request *req;
+  if((req = queue_head) != NULL) {
+    if((queue_head = req->next) == NULL) {
+      queue_tail = NULL;
+    }
+    queue_length--;
+  }
+  return req;
+}
+
+static void block_pc_execute(struct block_request *req) {
+  blockno_t i;
+  
+#if BLOCK_PC_LATENCY_US > 0
+  usleep(BLOCK_PC_LATENCY_US * req->count);
+#endif
+  if(req->op == BLOCK_OP_READ) {
+    req->result = block_read_multi(req->block, req->count, req->buf);
+  } else {
+    req->result = 0;
+    for(i=0;(i<req->count) && (req->result == 0);i++) {
+      req->result = block_write(req->block + i, (uint8_t *)req->buf + i * BLOCK_SIZE);
+    }
+  }
+}
+
+int block_submit(struct block_request *req) {
+  pthread_mutex_lock(&queue_lock);
+  if(queue_length >= BLOCK_PC_QUEUE_DEPTH) {
+    pthread_mutex_unlock(&queue_lock);
+    return -1;
+  }
+  req->done = 0;
+  req->next = NULL;
+  if(queue_tail) {
+    queue_tail->next = req;
+  } else {
+    queue_head = req;
+  }
+  queue_tail = req;
+  queue_length++;
+#ifdef BLOCK_PC_WORKER
+  pthread_cond_signal(&queue_cond);
+#endif
+  pthread_mutex_unlock(&queue_lock);
+  return 0;
+}
+
+#ifdef BLOCK_PC_WORKER
+static void *block_pc_worker(void *arg __attribute__((__unused__))) {
+  struct block_request *req;
+  
+  pthread_mutex_lock(&queue_lock);
+  for(;;) {
+    while(worker_running && (queue_head == NULL)) {
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+    // drain the queue before stopping so nothing submitted is lost
+    if((req = block_pc_dequeue()) == NULL) {
+      break;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    block_pc_execute(req);
+    if(req->callback) {
+      req->callback(req);
+    }
+    pthread_mutex_lock(&queue_lock);
+    __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+    completed++;
+    pthread_cond_broadcast(&done_cond);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return NULL;
+}
+
+static int block_pc_start_worker() {
+  worker_running = 1;
+  if(pthread_create(&worker, NULL, block_pc_worker, NULL)) {
+    worker_running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+static void block_pc_stop_worker() {
+  if(worker_running) {
+    pthread_mutex_lock(&queue_lock);
+    worker_running = 0;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(worker, NULL);
+  }
+}
+
+int block_poll() {
+  int n;
+  pthread_mutex_lock(&queue_lock);
+  n = completed;
+  completed = 0;
+  pthread_mutex_unlock(&queue_lock);
+  return n;
+}
+
+int block_wait(struct block_request *req) {
+  pthread_mutex_lock(&queue_lock);
+  while(!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+    pthread_cond_wait(&done_cond, &queue_lock);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return req->result;
+}
+#else
+int block_poll() {
+  struct block_request *req;
+  
+  pthread_mutex_lock(&queue_lock);
+  req = block_pc_dequeue();
+  pthread_mutex_unlock(&queue_lock);
+  if(req == NULL) {
+    return 0;
+  }
+  block_pc_execute(req);
+  __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+  if(req->callback) {
+    req->callback(req);
+  }
+  return 1;
+}
+
+int block_wait(struct block_request *req) {
+  while(!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+    block_poll();
+  }
+  return req->result;
+}
+#endif
+
+int block_get_queue_depth() {
+  return BLOCK_PC_QUEUE_DEPTH;
+}
+#endif
+
+int block_sync() {
+  if(map_mode == BLOCK_PC_MMAP_SHARED) {
+    return msync(blocks, block_fs_size, MS_SYNC) ? -1 : 0;
+  }
+  // otherwise the image only exists in memory until it is snapshotted
   return 0;
 }
 
@@ -116,6 +421,10 @@ blockno_t block_get_volume_size() {
   return block_fs_size / BLOCK_SIZE;
 }
 
+blockno_t block_get_au_size() {
+  return au_size;
+}
+
 int block_get_block_size() {
   return BLOCK_SIZE;
 }
@@ -29,7 +29,12 @@
 #ifndef BLOCK_PC_H
 #define BLOCK_PC_H 1
 
+#define BLOCK_PC_MMAP_PRIVATE 1
+#define BLOCK_PC_MMAP_SHARED  2
+
 void block_pc_set_image_name(const char * const filename);
+void block_pc_set_mmap(int mode);
+void block_pc_set_au_size(uint32_t blocks);
 void block_pc_set_ro();
 void block_pc_set_rw();
 int block_pc_snapshot(const char *filename, uint64_t start, uint64_t len);
@@ -27,6 +27,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <libopencm3/stm32/spi.h>
 #include <libopencm3/stm32/f1/rcc.h>
 #include <libopencm3/stm32/f1/gpio.h>
@@ -34,7 +35,12 @@
 #include "../block.h"
 #include "config.h"
 
-SDCard card = {0, 0, 0, 0};
+SDCard card = {0, 0, 0, 0, 0, 0};
+
+/* AU_SIZE codes from the SD status in 512 byte blocks, 16KB up to 64MB */
+static const uint32_t sd_au_blocks[16] = {
+  0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 24576, 32768, 49152, 65536, 131072
+};
 /**
  *  sd_command - internal function to send a properly formatted command to
  *               to the SD card.
@@ -82,6 +88,22 @@ uint16_t sd_command(uint8_t code, uint32_t data, uint8_t chksm) {
   return c;
 }
 
+/**
+ *  sd_data_token - wait for the start token of a data block, giving up
+ *                  after SD_TOKEN_RETRIES bytes so a card that has stopped
+ *                  answering can't hang the caller.  Returns 0xFE if the
+ *                  block is coming, anything else is an error.
+ */
+static uint16_t sd_data_token() {
+  uint16_t c = 0xFF;
+  uint32_t i;
+  
+  for(i=0;(i<SD_TOKEN_RETRIES) && (c == 0xFF);i++) {
+    c = spi_xfer(SD_SPI, 0xFF);
+  }
+  return c;
+}
+
 /**
  * sd_card_reset - performs a software reset on the card to get it ready for
  *                 use.
@@ -244,6 +266,33 @@ int sd_card_reset() {
     spi_xfer(SD_SPI, 0xFF);   /* the checksum */
   }
 
+  /* the SCR says what an erased block reads back as, assume ones if it can't be read */
+  card.erase_ones = 1;
+  if(sd_command(ACMD51, 0, 1) == 0) {
+    if(sd_data_token() == 0xFE) {
+      spi_xfer(SD_SPI, 0xFF);   /* SCR structure and spec version */
+      c = spi_xfer(SD_SPI, 0xFF);
+      card.erase_ones = (c & 0x80) ? 1 : 0;
+      for(i=0;i<6 + 2;i++) {
+        spi_xfer(SD_SPI, 0xFF);   /* rest of the SCR and the checksum */
+      }
+    }
+  }
+
+  /* the SD status has the size of the card's allocation units, AU_SIZE is the top of byte 10 */
+  card.au_size = 0;
+  if(sd_command(ACMD13, 0, 1) == 0) {
+    spi_xfer(SD_SPI, 0xFF);   /* second byte of the R2 response */
+    if(sd_data_token() == 0xFE) {
+      for(i=0;i<64 + 2;i++) {
+        c = spi_xfer(SD_SPI, 0xFF);
+        if(i == 10) {
+          card.au_size = sd_au_blocks[c >> 4];
+        }
+      }
+    }
+  }
+
   return 0;
 }
 
@@ -305,9 +354,9 @@ int block_read(blockno_t block, void *buf) {
     return c;
   }
   
-  do {
-    c = spi_xfer(SD_SPI, 0xFF);
-  } while(c != 0xFE);
+  if(sd_data_token() != 0xFE) {
+    return -1;
+  }
 
   for(i=0;i<512;i++) {
     *bp++ = spi_xfer(SD_SPI, 0xFF);
@@ -318,6 +367,47 @@ int block_read(blockno_t block, void *buf) {
   return 0;
 }
 
+int block_read_multi(blockno_t block, blockno_t count, void *buf) {
+  int i;
+  uint16_t c;
+  uint8_t *bp = buf;
+  
+  if(count == 1) {
+    return block_read(block, buf);
+  }
+  
+  if(card.card_type == SD_CARD_SC) {
+    block <<= 9;
+  }
+
+  c = sd_command(CMD18, block, 1);
+
+  if(c != 0) {
+    return c;
+  }
+  
+  while(count--) {
+    if(sd_data_token() != 0xFE) {
+      /* still have to stop the transfer before the card takes another command */
+      sd_command(CMD12, 0, 1);
+      while(spi_xfer(SD_SPI, 0xFF) != 0xFF) {__asm__("nop");}
+      return -1;
+    }
+
+    for(i=0;i<512;i++) {
+      *bp++ = spi_xfer(SD_SPI, 0xFF);
+    }
+    spi_xfer(SD_SPI, 0xFF);
+    spi_xfer(SD_SPI, 0xFF);   /* read checksum bytes and dispose of */
+  }
+  
+  /* stop the transmission and wait for the card to finish */
+  sd_command(CMD12, 0, 1);
+  while(spi_xfer(SD_SPI, 0xFF) != 0xFF) {__asm__("nop");}
+
+  return 0;
+}
+
 int block_write(blockno_t block, void *buf) {
   int i;
   uint16_t c;
@@ -357,10 +447,73 @@ int block_write(blockno_t block, void *buf) {
   return 0;
 }
 
+/**
+ * sd_erase - erase count blocks with CMD32/33/38, waiting until the card has
+ *            finished.
+ **/
+static uint16_t sd_erase(blockno_t block, blockno_t count) {
+  uint32_t start = block, end = block + count - 1;
+  uint16_t c;
+
+  if(card.card_type == SD_CARD_SC) {
+    start <<= 9;
+    end <<= 9;
+  }
+  if((c = sd_command(CMD32, start, 1)) != 0) {
+    return c;
+  }
+  if((c = sd_command(CMD33, end, 1)) != 0) {
+    return c;
+  }
+  if((c = sd_command(CMD38, 0, 1)) != 0) {
+    return c;
+  }
+  while(spi_xfer(SD_SPI, 0xFF) != 0xFF) {__asm__("nop");}     // busy until the erase is done
+  return 0;
+}
+
+/**
+ * Long runs are erased when the card reads erased blocks as zeros, which saves sending the data
+ * and lets the card drop the old contents without copying them.  Everything else is written as
+ * zeroed blocks.
+ **/
+int block_write_zeroes(blockno_t block, blockno_t count) {
+  static uint8_t zeros[512];
+  uint16_t c;
+
+  if(count == 0) {
+    return 0;
+  }
+  if(!card.erase_ones && (count >= SD_ERASE_MIN_BLOCKS)) {
+    return sd_erase(block, count);
+  }
+  while(count--) {
+    if((c = block_write(block++, zeros)) != 0) {
+      return c;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Freed runs are erased so the card's garbage collection has nothing to copy out of them, runs
+ * too short to be worth an erase are left alone.
+ **/
+int block_discard(blockno_t block, blockno_t count) {
+  if(count < SD_ERASE_MIN_BLOCKS) {
+    return 0;
+  }
+  return sd_erase(block, count);
+}
+
 blockno_t block_get_volume_size() {
   return card.size;
 }
 
+blockno_t block_get_au_size() {
+  return card.au_size;
+}
+
 int block_get_block_size() {
   return BLOCK_SIZE;
 }
@@ -381,6 +534,11 @@ int block_sync() {
   return 0;
 }
 
+const void *block_get_ptr(blockno_t block __attribute__((__unused__)),
+                          blockno_t count __attribute__((__unused__))) {
+  return NULL;
+}
+
 int block_halt() {
   return 0;
 }
@@ -51,7 +51,12 @@
 #define CMD17         17
 #define CMD18         18
 #define CMD24         24
+#define CMD32         32
+#define CMD33         33
+#define CMD38         38
+#define ACMD13        0x80 + 13
 #define ACMD41        0x80 + 41
+#define ACMD51        0x80 + 51
 
 /* Error status codes returned in the SD info struct */
 #define SD_ERR_NO_PART      1
@@ -60,12 +65,26 @@
 
 #define SD_RETRIES 1000
 
+/* bytes to clock while waiting for a data block to start, a card may take 100ms to send one so
+   this is well over that at a few MHz */
+#ifndef SD_TOKEN_RETRIES
+#define SD_TOKEN_RETRIES 200000
+#endif
+
+/* block_write_zeroes() and block_discard() erase runs at least this long, shorter ones are
+   written as zeros or left alone */
+#ifndef SD_ERASE_MIN_BLOCKS
+#define SD_ERASE_MIN_BLOCKS 64
+#endif
+
 /* SD card info struct */
 typedef struct {
   uint16_t  card_type;
   uint8_t   read_only;
   uint32_t  size;
   uint8_t   error;
+  uint8_t   erase_ones;     /* erased blocks read as 0xFF (DATA_STAT_AFTER_ERASE in the SCR) */
+  uint32_t  au_size;        /* allocation unit in blocks (AU_SIZE in the SD status), 0 if unknown */
 } SDCard;
 
 #endif /* ifndef BLOCK_SD_H */
@@ -13,8 +13,19 @@
 
 #define MAXNAMLEN 255		/* sizeof(struct dirent.d_name)-1 */
 
+/* values for d_type, DT_UNKNOWN means the caller has to stat the entry to find out */
+#define DT_UNKNOWN  0
+#define DT_FIFO     1
+#define DT_CHR      2
+#define DT_DIR      4
+#define DT_BLK      6
+#define DT_REG      8
+#define DT_LNK      10
+#define DT_SOCK     12
+
 struct dirent {
   int d_ino;
+  unsigned char d_type;
   char d_name[MAXNAMLEN+1];
 };
 
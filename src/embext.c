@@ -50,8 +50,41 @@ struct buffer_object {
     uint8_t buffer[512];
     uint32_t lba_block;
     uint16_t dirty;
+    uint16_t valid;
 };
 
+#if EXT2_FILE_READAHEAD > 0
+struct file_readahead {
+    uint8_t data[EXT2_FILE_READAHEAD * 512];
+    uint32_t lba_block[EXT2_FILE_READAHEAD];
+    uint32_t writes[EXT2_FILE_READAHEAD];   // write count of each sector when it was read
+    struct block_request req[EXT2_FILE_READAHEAD];
+    uint32_t first_sector;
+    uint32_t count;
+    uint32_t window;
+    struct buffer_object map[3];
+};
+#endif
+
+#if EXT2_STREAM_BUFFERS > 0
+#define EXT2_STREAM_EMPTY   0
+#define EXT2_STREAM_READING 1
+#define EXT2_STREAM_WRITING 2
+
+struct file_stream {
+    uint8_t data[EXT2_STREAM_BUFFERS][512];
+    struct block_request req[EXT2_STREAM_BUFFERS];
+    uint32_t sector[EXT2_STREAM_BUFFERS];
+    uint32_t writes[EXT2_STREAM_BUFFERS];
+    uint8_t state[EXT2_STREAM_BUFFERS];
+    uint32_t next;
+    uint32_t held_sector;
+    uint32_t held_lba;
+    int error;
+    struct buffer_object map[3];
+};
+#endif
+
 struct file_ent {
     uint32_t magic;
     struct ext2context *context;
@@ -60,12 +93,378 @@ struct file_ent {
     uint32_t inode_number;
     struct buffer_object buffer;
     struct inode inode;
+    struct dirent *dirent;
+    uint32_t map_index;         // last block looked up in the block map, for an appending
+    uint32_t map_block;         // handle the tail of the file, valid while map_block isn't 0
+    uint32_t buffer_writes;     // write count of the buffered sector when it was filled
+    uint32_t ra_last_ino;
+    uint32_t ra_start_ino;
+    uint32_t ra_end_ino;
+#if EXT2_FILE_READAHEAD > 0
+    struct file_readahead *readahead;
+    uint32_t ra_next_sector;
+#endif
+#if EXT2_STREAM_BUFFERS > 0
+    struct file_stream *stream;
+#endif
+    struct file_ent *next_open; // next in the context's list of open handles
     int rerrno;
 };
 
+/**
+ * \brief Count a write of count sectors from block once it has been made, passing its result on.
+ **/
+static int ext2_count_write(struct ext2context *context, blockno_t block, blockno_t count, int r) {
+    blockno_t i;
+    for(i=0;(i < count) && (i < EXT2_WRITE_COUNTERS);i++) {
+        ext2_counter_inc(&context->writes[(block + i) % EXT2_WRITE_COUNTERS]);
+    }
+    return r;
+}
+
+#define ext2_write_count(c, block) ext2_counter_get(&(c)->writes[(block) % EXT2_WRITE_COUNTERS])
+
+#ifdef EMBEXT_NONBLOCK
+// what the non-blocking calls may do while they run
+#define EXT2_NB_OFF     0       // not in a non-blocking call, every transfer completes in place
+#define EXT2_NB_TRY     1       // a read that would wait is queued and the call gives up
+#define EXT2_NB_COMMIT  2       // the call has started changing things and must run to the end
+
+#define EXT2_NB_EMPTY   0
+#define EXT2_NB_READING 1
+#define EXT2_NB_VALID   2
+#define EXT2_NB_WRITING 3
+
+static int ext2_nb_idle(struct ext2context *context) {
+    int i;
+    for(i=0;i<EXT2_NB_SLOTS;i++) {
+        if((context->nb_slots[i].state == EXT2_NB_READING) || (context->nb_slots[i].state == EXT2_NB_WRITING)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static struct ext2_nb_slot *ext2_nb_find(struct ext2context *context, blockno_t block) {
+    int i;
+    for(i=0;i<EXT2_NB_SLOTS;i++) {
+        if((context->nb_slots[i].state != EXT2_NB_EMPTY) && (context->nb_slots[i].req.block == block)) {
+            return &context->nb_slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Bring the state of a slot up to date with its request, waiting for it if asked to.
+ **/
+static void ext2_nb_complete(struct ext2context *context, struct ext2_nb_slot *slot, int wait) {
+    if((slot->state == EXT2_NB_READING) || (slot->state == EXT2_NB_WRITING)) {
+        if(wait) {
+            block_wait(&slot->req);
+        }
+        if(slot->req.done) {
+            if(slot->req.result) {
+                if(slot->state == EXT2_NB_WRITING) {
+                    // nobody is waiting for a write, so close reports it
+                    context->nb_error = EIO;
+                }
+                slot->state = EXT2_NB_EMPTY;
+            } else {
+                slot->state = EXT2_NB_VALID;
+            }
+        }
+    }
+}
+
+/**
+ * \brief Pick a slot to reuse, the least recently used one without a transfer in flight.
+ *
+ * Slots used since the current non-blocking call started are kept, otherwise a call that needs
+ * more sectors than there are slots would evict its own earlier reads on every attempt.
+ *
+ * \returns the slot or NULL if every slot is busy.
+ **/
+static struct ext2_nb_slot *ext2_nb_victim(struct ext2context *context) {
+    struct ext2_nb_slot *best = NULL;
+    int i;
+    for(i=0;i<EXT2_NB_SLOTS;i++) {
+        ext2_nb_complete(context, &context->nb_slots[i], 0);
+        if(context->nb_slots[i].state == EXT2_NB_EMPTY) {
+            return &context->nb_slots[i];
+        }
+        if((context->nb_slots[i].state == EXT2_NB_VALID) &&
+            ((context->nb_mode == EXT2_NB_OFF) || (context->nb_slots[i].used < context->nb_start)) &&
+            ((best == NULL) || (context->nb_slots[i].used < best->used))) {
+            best = &context->nb_slots[i];
+        }
+    }
+    return best;
+}
+
+/**
+ * \brief Read a sector, from the slots if it is there.
+ *
+ * Inside a non-blocking call (before it has committed to any change) a sector that isn't
+ * already in a slot is queued for reading and the read fails with the context marked deferred,
+ * the caller then unwinds and the call is repeated once the transfer has completed.  Everything
+ * read after the first deferral may be rubbish, so later misses fail without queueing anything.
+ * If every slot holds a sector this call has already used, waiting for a transfer won't help
+ * and the sector is read in place.
+ **/
+static int ext2_block_read(struct ext2context *context, blockno_t block, void *buf) {
+    struct ext2_nb_slot *slot = ext2_nb_find(context, block);
+    
+    if(slot) {
+        ext2_nb_complete(context, slot, context->nb_mode != EXT2_NB_TRY);
+        if(slot->state == EXT2_NB_VALID) {
+            memcpy(buf, slot->data, sizeof(slot->data));
+            slot->used = ++context->nb_clock;
+            return 0;
+        }
+        if(slot->state != EXT2_NB_EMPTY) {
+            context->nb_deferred = 1;
+            return -1;
+        }
+    }
+    if(context->nb_mode != EXT2_NB_TRY) {
+        return block_read(block, buf);
+    }
+    if(!context->nb_deferred) {
+        if((slot = ext2_nb_victim(context)) != NULL) {
+            slot->req.op = BLOCK_OP_READ;
+            slot->req.block = block;
+            slot->req.count = 1;
+            slot->req.buf = slot->data;
+            slot->req.callback = NULL;
+            if(block_submit(&slot->req) == 0) {
+                slot->state = EXT2_NB_READING;
+                slot->used = ++context->nb_clock;
+            } else {
+                slot->state = EXT2_NB_EMPTY;
+            }
+        } else if(ext2_nb_idle(context)) {
+            return block_read(block, buf);
+        }
+    }
+    context->nb_deferred = 1;
+    return -1;
+}
+
+/**
+ * \brief Write a sector, queued behind the caller's back inside a non-blocking call.
+ *
+ * Blocking calls write straight through and keep any slot holding the sector up to date.
+ **/
+static int ext2_block_write(struct ext2context *context, blockno_t block, void *buf) {
+    struct ext2_nb_slot *slot = ext2_nb_find(context, block);
+    int i, r;
+    
+    if(context->nb_deferred) {
+        // the caller is working from a read that never happened
+        return -1;
+    }
+    if(slot) {
+        // writes to one sector must reach the device in order
+        ext2_nb_complete(context, slot, 1);
+    }
+    if(context->nb_mode == EXT2_NB_OFF) {
+        r = block_write(block, buf);
+        if(slot) {
+            memcpy(slot->data, buf, sizeof(slot->data));
+            slot->state = r ? EXT2_NB_EMPTY : EXT2_NB_VALID;
+        }
+        return ext2_count_write(context, block, 1, r);
+    }
+    if((slot == NULL) && ((slot = ext2_nb_victim(context)) == NULL)) {
+        // every slot has a transfer in flight, wait for the oldest
+        slot = &context->nb_slots[0];
+        for(i=1;i<EXT2_NB_SLOTS;i++) {
+            if(context->nb_slots[i].used < slot->used) {
+                slot = &context->nb_slots[i];
+            }
+        }
+        ext2_nb_complete(context, slot, 1);
+    }
+    memcpy(slot->data, buf, sizeof(slot->data));
+    slot->req.op = BLOCK_OP_WRITE;
+    slot->req.block = block;
+    slot->req.count = 1;
+    slot->req.buf = slot->data;
+    slot->req.callback = NULL;
+    while(block_submit(&slot->req)) {
+        block_poll();
+    }
+    slot->state = EXT2_NB_WRITING;
+    slot->used = ++context->nb_clock;
+    // reads of the sector come from the slot until the write is done
+    return ext2_count_write(context, block, 1, 0);
+}
+
+/**
+ * \brief Wait for queued writes to any of count sectors from block, before reading them another way.
+ **/
+static void ext2_nb_drain(struct ext2context *context, blockno_t block, blockno_t count) {
+    int i;
+    for(i=0;i<EXT2_NB_SLOTS;i++) {
+        if((context->nb_slots[i].state == EXT2_NB_WRITING) && (context->nb_slots[i].req.block >= block) &&
+            (context->nb_slots[i].req.block < block + count)) {
+            ext2_nb_complete(context, &context->nb_slots[i], 1);
+        }
+    }
+}
+
+#if EXT2_INODE_CACHE_SECTORS > 0
+static int ext2_block_read_multi(struct ext2context *context, blockno_t block, blockno_t count, void *buf) {
+    ext2_nb_drain(context, block, count);
+    return block_read_multi(block, count, buf);
+}
+#endif
+
+/**
+ * \brief Clear count sectors from block, after any queued writes to them and keeping the slots right.
+ **/
+static int ext2_block_zero(struct ext2context *context, blockno_t block, blockno_t count) {
+    int i;
+    
+    if(context->nb_deferred) {
+        return -1;
+    }
+    for(i=0;i<EXT2_NB_SLOTS;i++) {
+        if((context->nb_slots[i].state != EXT2_NB_EMPTY) && (context->nb_slots[i].req.block >= block) &&
+            (context->nb_slots[i].req.block < block + count)) {
+            ext2_nb_complete(context, &context->nb_slots[i], 1);
+        }
+        if((context->nb_slots[i].state == EXT2_NB_VALID) && (context->nb_slots[i].req.block >= block) &&
+            (context->nb_slots[i].req.block < block + count)) {
+            memset(context->nb_slots[i].data, 0, sizeof(context->nb_slots[i].data));
+        }
+    }
+    return ext2_count_write(context, block, count, block_write_zeroes(block, count));
+}
+
+/**
+ * \brief Discard count sectors from block once queued writes to them are done, dropping their slots.
+ **/
+static int ext2_block_discard(struct ext2context *context, blockno_t block, blockno_t count) {
+    int i;
+    
+    for(i=0;i<EXT2_NB_SLOTS;i++) {
+        if((context->nb_slots[i].state != EXT2_NB_EMPTY) && (context->nb_slots[i].req.block >= block) &&
+            (context->nb_slots[i].req.block < block + count)) {
+            ext2_nb_complete(context, &context->nb_slots[i], 1);
+            context->nb_slots[i].state = EXT2_NB_EMPTY;
+        }
+    }
+    return block_discard(block, count);
+}
+
+#define ext2_nb_deferred(c)     ((c)->nb_deferred)
+#define ext2_nb_active(c)       ((c)->nb_mode != EXT2_NB_OFF)
+// from here on the current call may block, but it will finish what it started
+#define ext2_nb_commit(c)       do { if((c)->nb_mode == EXT2_NB_TRY) (c)->nb_mode = EXT2_NB_COMMIT; } while(0)
+// the current call has reached a point where it could stop again
+#define ext2_nb_checkpoint(c)   do { if((c)->nb_mode == EXT2_NB_COMMIT) (c)->nb_mode = EXT2_NB_TRY; } while(0)
+#else
+#define ext2_block_read(c, b, buf)          block_read(b, buf)
+#define ext2_block_write(c, b, buf)         ext2_count_write(c, b, 1, block_write(b, buf))
+#define ext2_block_read_multi(c, b, n, buf) block_read_multi(b, n, buf)
+#define ext2_block_zero(c, b, n)            ext2_count_write(c, b, n, block_write_zeroes(b, n))
+#define ext2_block_discard(c, b, n)         block_discard(b, n)
+#define ext2_nb_drain(c, b, n)              ((void)(c))
+#define ext2_nb_deferred(c)                 0
+#define ext2_nb_active(c)                   0
+#define ext2_nb_commit(c)                   ((void)(c))
+#define ext2_nb_checkpoint(c)               ((void)(c))
+#endif
+
+#if EXT2_STREAM_BUFFERS > 0
+/**
+ * \brief Wait for the transfer of one stream buffer to finish and free the buffer.
+ *
+ * Nobody waits on a streamed write, so a failure is kept and reported by the next write or the
+ * close of the handle.
+ **/
+static int ext2_stream_finish(struct file_ent *fe, int i) {
+    struct file_stream *st = fe->stream;
+    int result = 0;
+    if(st->state[i] != EXT2_STREAM_EMPTY) {
+        result = block_wait(&st->req[i]);
+        if(st->state[i] == EXT2_STREAM_WRITING) {
+            if(result) {
+                st->error = EIO;
+            }
+            ext2_count_write(fe->context, st->req[i].block, 1, result);
+        }
+        st->state[i] = EXT2_STREAM_EMPTY;
+    }
+    return result;
+}
+
+/**
+ * \brief Finish any streamed write of a sector before it is read or written again.
+ **/
+static void ext2_stream_settle(struct file_ent *fe, uint32_t lba_block) {
+    int i;
+    if(fe->stream) {
+        for(i=0;i<EXT2_STREAM_BUFFERS;i++) {
+            if((fe->stream->state[i] == EXT2_STREAM_WRITING) &&
+                (fe->stream->req[i].block == lba_block + fe->context->part_start)) {
+                ext2_stream_finish(fe, i);
+            }
+        }
+    }
+}
+#else
+#define ext2_stream_settle(fe, lba_block) ((void)(fe))
+#endif
+
+#ifdef EMBEXT_THREADSAFE
+static ext2_lock_t *ext2_bg_lock(struct ext2context *context, uint32_t block_group) {
+    return &context->bg_locks[block_group];
+}
+
+static ext2_lock_t *ext2_sb_lock(struct ext2context *context) {
+    return &context->sb_lock;
+}
+
+static ext2_lock_t *ext2_orphan_lock(struct ext2context *context) {
+    return &context->orphan_lock;
+}
+
+static ext2_lock_t *ext2_open_lock(struct ext2context *context) {
+    return &context->open_lock;
+}
+
+static struct ext2_inode_slot *ext2_inode_slot(struct ext2context *context, uint32_t inode) {
+    uint32_t inodes_per_sector = block_get_block_size() / context->superblock.s_inode_size;
+    return &context->inode_slots[((inode - 1) / inodes_per_sector) % EXT2_INODE_LOCKS];
+}
+
+#define ext2_inode_lock(c, i) (&ext2_inode_slot(c, i)->lock)
+#define ext2_inode_seq(c, i)  (&ext2_inode_slot(c, i)->seq)
+#else
+#define ext2_bg_lock(c, g)    ((void)(c), (void)(g), (ext2_lock_t *)0)
+#define ext2_sb_lock(c)       ((void)(c), (ext2_lock_t *)0)
+#define ext2_orphan_lock(c)   ((void)(c), (ext2_lock_t *)0)
+#define ext2_open_lock(c)     ((void)(c), (ext2_lock_t *)0)
+#define ext2_inode_lock(c, i) ((void)(c), (void)(i), (ext2_lock_t *)0)
+#define ext2_inode_seq(c, i)  ((void)(c), (void)(i), (ext2_seq_t *)0)
+#endif
+
 static int ext2_store_buffer(struct file_ent *fe) {
+    int r;
     // flushing a modified block back to disk
-    if(block_write(fe->buffer.lba_block + fe->context->part_start, fe->buffer.buffer)) {
+    ext2_stream_settle(fe, fe->buffer.lba_block);
+    // lock free readers of a locked inode (path lookups) retry if its contents change under them
+    if(fe->flags & EXT2_FLAG_LOCKED) {
+        ext2_seq_write_begin(ext2_inode_seq(fe->context, fe->inode_number));
+    }
+    r = ext2_block_write(fe->context, fe->buffer.lba_block + fe->context->part_start, fe->buffer.buffer);
+    if(fe->flags & EXT2_FLAG_LOCKED) {
+        ext2_seq_write_end(ext2_inode_seq(fe->context, fe->inode_number));
+    }
+    if(r) {
         fe->rerrno = EIO;
         return -1;
     }
@@ -73,18 +472,80 @@ static int ext2_store_buffer(struct file_ent *fe) {
     return 0;
 }
 
+/**
+ * \brief Check that the handle's buffer holds the current contents of a sector.
+ *
+ * Once anything has been written to the volume since the buffer was filled it may be out of
+ * date, e.g. a directory being listed while another handle appends to it.  Data the handle
+ * hasn't written out yet is its own and always current.
+ **/
+static int ext2_buffer_current(struct file_ent *fe, uint32_t lba_block) {
+    return fe->buffer.valid && (fe->buffer.lba_block == lba_block) &&
+           (fe->buffer.dirty ||
+            (fe->buffer_writes == ext2_write_count(fe->context, lba_block + fe->context->part_start)));
+}
+
 static int ext2_load_buffer(struct file_ent *fe, uint32_t block_number, uint32_t offset) {
+    uint32_t lba_block = block_number * (ext2_block_size(fe->context) / block_get_block_size());
+    lba_block += (offset / sizeof(fe->buffer.buffer)) * (sizeof(fe->buffer.buffer) / block_get_block_size());
+    if(ext2_buffer_current(fe, lba_block)) {
+        // e.g. the next entry of a map sector being filled in
+        return 0;
+    }
     if(fe->buffer.dirty) {
+#ifdef EMBEXT_NONBLOCK
+        uint8_t probe[512];
+        // a non-blocking call keeps its dirty sector until the replacement has arrived
+        if((fe->context->nb_mode == EXT2_NB_TRY) &&
+            ext2_block_read(fe->context, lba_block + fe->context->part_start, probe)) {
+            return -1;
+        }
+#endif
         if(ext2_store_buffer(fe)) {
             return -1;
         }
     }
-    fe->buffer.lba_block = block_number * (ext2_block_size(fe->context) / block_get_block_size());
-    fe->buffer.lba_block += (offset / sizeof(fe->buffer.buffer)) * (sizeof(fe->buffer.buffer) / block_get_block_size());
-    block_read(fe->buffer.lba_block + fe->context->part_start, fe->buffer.buffer);
+    fe->buffer.lba_block = lba_block;
+    ext2_stream_settle(fe, lba_block);
+    fe->buffer_writes = ext2_write_count(fe->context, lba_block + fe->context->part_start);
+    if(ext2_block_read(fe->context, fe->buffer.lba_block + fe->context->part_start, fe->buffer.buffer)) {
+        fe->buffer.valid = 0;
+        fe->rerrno = EIO;
+        return -1;
+    }
+    fe->buffer.valid = 1;
     return 0;
 }    
 
+/**
+ * \brief Make sure the buffer holds the sector of a block at the given file position, reading it
+ * only if it doesn't.
+ *
+ * Only used on the file data path, metadata sectors that other handles may have rewritten are
+ * always re-read with ext2_load_buffer().  The buffer is read again if anything has been written
+ * to the volume since it was filled.  A sector wholly past the end of the file holds nothing of
+ * it yet, so it is cleared rather than read.
+ **/
+static int ext2_select_sector(struct file_ent *fe, uint32_t block_number, uint64_t position) {
+    uint32_t offset = position % ext2_block_size(fe->context);
+    uint32_t lba_block = block_number * (ext2_block_size(fe->context) / block_get_block_size());
+    lba_block += (offset / sizeof(fe->buffer.buffer)) * (sizeof(fe->buffer.buffer) / block_get_block_size());
+    if(ext2_buffer_current(fe, lba_block)) {
+        return 0;
+    }
+    if(position - position % sizeof(fe->buffer.buffer) >= fe->inode.i_size) {
+        if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+            return -1;
+        }
+        fe->buffer_writes = ext2_write_count(fe->context, lba_block + fe->context->part_start);
+        memset(fe->buffer.buffer, 0, sizeof(fe->buffer.buffer));
+        fe->buffer.lba_block = lba_block;
+        fe->buffer.valid = 1;
+        return 0;
+    }
+    return ext2_load_buffer(fe, block_number, offset);
+}
+
 static int ext2_read_buffer(void *dest, struct buffer_object *buffer, int offset, int count) {
     memcpy(dest, &buffer->buffer[offset % sizeof(buffer->buffer)], count);
     return 0;
@@ -97,9 +558,10 @@ static int ext2_write_buffer(struct buffer_object *buffer, void *source, int off
 }
 
 static uint32_t ext2_buffer_space(struct file_ent *fe) {
-    return ext2_block_size(fe->context) - 1 - (fe->cursor % sizeof(fe->buffer.buffer));
+    return sizeof(fe->buffer.buffer) - (fe->cursor % sizeof(fe->buffer.buffer));
 }
 
+
 #ifdef EMBEXT_DEBUG
 void ext2_print_inode(void *fe) {
     int i;
@@ -143,14 +605,15 @@ void ext2_print_bg1_bitmap(struct ext2context *context) {
     }
     printf("block group count = %d\n", block_group_count);
     
+    uint8_t buf[512];
     uint32_t bg_block = context->superblock_block + 1;
     
     bg_block <<= (context->superblock.s_log_block_size + 1);
     bg_block += ((0 * 32) / block_get_block_size());
     
-    block_read(bg_block + context->part_start, context->sysbuf);
+    ext2_block_read(context, bg_block + context->part_start, buf);
     
-    struct block_group_descriptor *block_table = (struct block_group_descriptor *)&context->sysbuf[0];
+    struct block_group_descriptor *block_table = (struct block_group_descriptor *)&buf[0];
     
     printf("bg_block_bitmap = %" PRIu32 "\n", block_table->bg_block_bitmap);
     printf("bg_inode_bitmap = %" PRIu32 "\n", block_table->bg_inode_bitmap);
@@ -169,14 +632,14 @@ void ext2_print_bg1_bitmap(struct ext2context *context) {
     bmp_block += context->part_start;
     
     while(bmp_read < (1024u << context->superblock.s_log_block_size)) {
-        block_read(bmp_block, context->sysbuf);
+        ext2_block_read(context, bmp_block, buf);
         
         for(j=0;j<16;j++) {
             for(i=0;i<32;i++) {
-                printf("%02x", context->sysbuf[j*32+i]);
-                if(context->sysbuf[j*32+i]) {
+                printf("%02x", buf[j*32+i]);
+                if(buf[j*32+i]) {
                     for(k=1;k<0x100;k<<=1) {
-                        if(context->sysbuf[j*32+i] & k) {
+                        if(buf[j*32+i] & k) {
                             nused++;
                         }
                     }
@@ -201,8 +664,9 @@ void ext2_print_bg1_bitmap(struct ext2context *context) {
  * \brief fetches a block group descriptor from disk.
  * 
  * Block group descriptors contain the block number of the inode and block bitmaps and a count of
- * the free blocks and inodes in the block group.  This call uses the sysbuf.  The block group
- * descriptor is always read from the primary table, immediately after the first superblock.
+ * the free blocks and inodes in the block group.  The block group descriptor is always read from
+ * the primary table, immediately after the first superblock, or from the copy of it kept in
+ * memory when built with #EMBEXT_BG_CACHE.  The cached copy is read without taking any lock.
  * 
  * \param context The ext2 filesystem context for the mounted volume.
  * \param bg A pointer to a struct to store the block group descriptor that's been requested.
@@ -212,6 +676,22 @@ void ext2_print_bg1_bitmap(struct ext2context *context) {
 int ext2_get_bg_descriptor(struct ext2context *context, 
                            struct block_group_descriptor *bg, 
                            uint32_t block_group) {
+#ifdef EMBEXT_BG_CACHE
+    struct ext2_bg_cache_entry *entry;
+    uint32_t seq;
+    if(block_group >= context->num_blockgroups) {
+        return -1;
+    }
+    
+    entry = &context->bg_cache[block_group];
+    do {
+        seq = ext2_seq_read_begin(&entry->seq);
+        memcpy(bg, &entry->bg, sizeof(struct block_group_descriptor));
+    } while(ext2_seq_read_retry(&entry->seq, seq));
+    
+    return 0;
+#else
+    uint8_t buf[512];
     uint32_t lba_block;
     if(block_group >= context->num_blockgroups) {
         return -1;
@@ -226,14 +706,17 @@ int ext2_get_bg_descriptor(struct ext2context *context,
     // now find the disk-block offset
     lba_block += block_group / (block_get_block_size() / sizeof(struct block_group_descriptor));
     
-    block_read(lba_block + context->part_start, context->sysbuf);
+    if(ext2_block_read(context, lba_block + context->part_start, buf)) {
+        return -1;
+    }
     
     // copy the appropriate chunk from the buffer
     memcpy(bg, 
-           &context->sysbuf[sizeof(struct block_group_descriptor) * (block_group % (block_get_block_size() / sizeof(struct block_group_descriptor)))], 
+           &buf[sizeof(struct block_group_descriptor) * (block_group % (block_get_block_size() / sizeof(struct block_group_descriptor)))], 
            sizeof(struct block_group_descriptor));
     
     return 0;
+#endif
 }
 
 /**
@@ -241,8 +724,8 @@ int ext2_get_bg_descriptor(struct ext2context *context,
  * 
  * Block group descriptors have a count of free blocks and inodes within the strorage group they
  * describe.  After an allocation the block group descriptor must therefore be written back to the
- * disk.  This call uses sysbuf.  This call will write copies back to every backup of the block
- * group descriptor table on the disk.
+ * disk.  This call will write copies back to every backup of the block group descriptor table on
+ * the disk.  The caller must hold the lock for the block group.
  * 
  * \param context The ext2 filesystem context for the mounted partition.
  * \param bg A pointer to the block group descriptor struct to be stored.
@@ -252,12 +735,19 @@ int ext2_get_bg_descriptor(struct ext2context *context,
 int ext2_write_bg_descriptor(struct ext2context *context,
                              struct block_group_descriptor *bg,
                              uint32_t block_group) {
+    uint8_t buf[512];
     uint32_t i;
     uint32_t lba_block;
     if(block_group >= context->num_blockgroups) {
         return -1;
     }
     
+#ifdef EMBEXT_BG_CACHE
+    ext2_seq_write_begin(&context->bg_cache[block_group].seq);
+    memcpy(&context->bg_cache[block_group].bg, bg, sizeof(struct block_group_descriptor));
+    ext2_seq_write_end(&context->bg_cache[block_group].seq);
+#endif
+    
     for(i=0;i<context->num_superblocks;i++) {
         // get the block number of the start of the descriptor table
         lba_block = context->superblock_blocks[i] + 1;
@@ -268,64 +758,155 @@ int ext2_write_bg_descriptor(struct ext2context *context,
         // step along to the disk block containing this descriptor
         lba_block += (block_group / (block_get_block_size() / sizeof(struct block_group_descriptor)));
         
-        block_read(lba_block + context->part_start, context->sysbuf);
+        ext2_block_read(context, lba_block + context->part_start, buf);
         
         // copy the descriptor to the table
-        memcpy(&context->sysbuf[sizeof(struct block_group_descriptor) * (block_group % (block_get_block_size() / sizeof(struct block_group_descriptor)))],
+        memcpy(&buf[sizeof(struct block_group_descriptor) * (block_group % (block_get_block_size() / sizeof(struct block_group_descriptor)))],
                bg,
                sizeof(struct block_group_descriptor));
+        
+        if(ext2_block_write(context, lba_block + context->part_start, buf)) {
+            return -1;
+        }
     }
     
     return 0;
 }
 
-int ext2_flush_inode(struct file_ent *fe) {
-    uint32_t inode_block;
-    uint32_t block_group = (fe->inode_number - 1) / fe->context->superblock.s_inodes_per_group;
-    uint32_t inode_index = (fe->inode_number - 1) % fe->context->superblock.s_inodes_per_group;
-    // now load the block group descriptor for that block group
-    struct block_group_descriptor bg;
-
-    if(fe->flags & EXT2_FLAG_FS_DIRTY) {
-        ext2_get_bg_descriptor(fe->context, &bg, block_group);
-        
-        // the inode table may again be more than one block but it is contiguous within each
-        // block group.  Since we're already looking at the right block group we can now treat it
-        // as contiguous.
-        inode_block = bg.bg_inode_table;
-        inode_block += inode_index / (ext2_block_size(fe->context) / fe->context->superblock.s_inode_size);
+int ext2_flush_superblock(struct ext2context *context) {
+    uint8_t buf[512];
+    uint32_t i, lba_block;
     
-        // load the sector
-        ext2_load_buffer(fe, inode_block,
-                         (inode_index * fe->context->superblock.s_inode_size) % ext2_block_size(fe->context));
-
-        ext2_write_buffer(&fe->buffer, &fe->inode, inode_index * fe->context->superblock.s_inode_size, sizeof(struct inode));
+    memset(buf, 0, block_get_block_size());
+    ext2_lock(ext2_sb_lock(context));
+    for(i=0;i<context->num_superblocks;i++) {
+        context->superblock.s_block_group_nr = context->superblock_blocks[i];
+        memcpy(buf, &context->superblock, sizeof(struct superblock));
+        lba_block = context->superblock_blocks[i] << (context->superblock.s_log_block_size + 1);
+        if(lba_block == 0) {
+            // the primary copy is always 1024 bytes in, inside block 0 when blocks are bigger than that
+            lba_block = 2;
+        }
+        ext2_block_write(context, lba_block + context->part_start, buf);
+    }
+    ext2_unlock(ext2_sb_lock(context));
+    return 0;
+}
 
-        ext2_store_buffer(fe);
+#if EXT2_DISCARD_RANGES > 0
+/**
+ * \brief Pass the freed ranges waiting in the context to the block driver, with discard_lock held.
+ **/
+static int ext2_discard_issue(struct ext2context *context) {
+    uint32_t sectors_per_block = ext2_block_size(context) / block_get_block_size();
+    uint32_t i;
+    int r = 0;
     
-        fe->flags &= ~EXT2_FLAG_FS_DIRTY;
+    for(i=0;i<context->discard_count;i++) {
+        if(ext2_block_discard(context, context->discard[i].start * sectors_per_block + context->part_start,
+                              context->discard[i].count * sectors_per_block)) {
+            r = -1;
+        }
     }
-  
-    return 0;
+    context->discard_count = 0;
+    return r;
 }
 
-int ext2_flush_superblock(struct ext2context *context) {
+/**
+ * \brief Remember that count blocks from start have been freed.
+ *
+ * The range is merged with one it follows or comes before, when the list is full everything on
+ * it is discarded to make room.
+ **/
+static void ext2_discard_add(struct ext2context *context, uint32_t start, uint32_t count) {
+    struct ext2_discard_range *d;
     uint32_t i;
     
-    memset(context->sysbuf, 0, block_get_block_size());
-    for(i=0;i<context->num_superblocks;i++) {
-        context->superblock.s_block_group_nr = context->superblock_blocks[i];
-        memcpy(context->sysbuf, &context->superblock, sizeof(struct superblock));
-        block_write((context->superblock_blocks[i] << (context->superblock.s_log_block_size + 1)) + context->part_start, context->sysbuf);
+    ext2_lock(&context->discard_lock);
+    for(i=0;i<context->discard_count;i++) {
+        d = &context->discard[i];
+        if(d->start + d->count == start) {
+            d->count += count;
+            break;
+        }
+        if(start + count == d->start) {
+            d->start = start;
+            d->count += count;
+            break;
+        }
     }
-    return 0;
+    if(i == context->discard_count) {
+        if(context->discard_count == EXT2_DISCARD_RANGES) {
+            ext2_discard_issue(context);
+        }
+        context->discard[context->discard_count].start = start;
+        context->discard[context->discard_count].count = count;
+        context->discard_count++;
+    }
+    ext2_unlock(&context->discard_lock);
+}
+
+/**
+ * \brief Take blocks that have just been allocated back out of the ranges waiting to be discarded.
+ *
+ * Must be called before anything is written to them.
+ **/
+static void ext2_discard_cancel(struct ext2context *context, uint32_t start, uint32_t count) {
+    struct ext2_discard_range *d;
+    uint32_t i, end;
+    
+    ext2_lock(&context->discard_lock);
+    for(i=0;i<context->discard_count;) {
+        d = &context->discard[i];
+        end = d->start + d->count;
+        if((start >= end) || (start + count <= d->start)) {
+            i++;
+        } else if((start > d->start) && (start + count < end)) {
+            // split round the allocation, if there's no room for the far end it just isn't discarded
+            if(context->discard_count < EXT2_DISCARD_RANGES) {
+                context->discard[context->discard_count].start = start + count;
+                context->discard[context->discard_count].count = end - (start + count);
+                context->discard_count++;
+            }
+            d->count = start - d->start;
+            i++;
+        } else if(start > d->start) {
+            d->count = start - d->start;
+            i++;
+        } else if(start + count < end) {
+            d->count = end - (start + count);
+            d->start = start + count;
+            i++;
+        } else {
+            *d = context->discard[--context->discard_count];
+        }
+    }
+    ext2_unlock(&context->discard_lock);
+}
+
+/**
+ * \brief Discard everything freed since the last time.
+ **/
+static int ext2_discard_flush(struct ext2context *context) {
+    int r;
+    ext2_lock(&context->discard_lock);
+    r = ext2_discard_issue(context);
+    ext2_unlock(&context->discard_lock);
+    return r;
 }
+#else
+#define ext2_discard_add(c, s, n)       ((void)(c))
+#define ext2_discard_cancel(c, s, n)    ((void)(c))
+#define ext2_discard_flush(c)           ((void)(c), 0)
+#endif
 
 /**
  * \brief Carries out an allocation/deallocation of a block.
  * 
  * This function will allocate or deallocate a block.  This includes updating the bitmap, the
- * number of blocks used in the block group, the number of blocks used in the superblock.
+ * number of blocks used in the block group, the number of blocks used in the superblock.  The
+ * block group lock is held for the bitmap and descriptor update, so callers that have already
+ * scanned the bitmap under that lock can call this without losing the block to another thread.
  * 
  * \param context The ext2 filesystem context for the affected partition.
  * \param block The block number to be allocated/deallocated
@@ -340,36 +921,44 @@ int ext2_change_allocated(struct ext2context *context,
                           int allocated,
                           int for_directory
                          ) {
+    uint8_t buf[512];
     uint32_t lba_block;
     uint32_t bitmap_offset;
+    uint32_t block_group;
     struct block_group_descriptor bg;
     
-    // Step 1. change the bitmap in the appropriate block group
-    ext2_get_bg_descriptor(context, &bg, block / context->superblock.s_blocks_per_group);
+    // bitmaps start counting at the first data block, not at block zero
+    block_group = (block - context->superblock.s_first_data_block) / context->superblock.s_blocks_per_group;
+    bitmap_offset = (block - context->superblock.s_first_data_block) % context->superblock.s_blocks_per_group;
     
-    lba_block = bg.bg_block_bitmap;
+    ext2_lock(ext2_bg_lock(context, block_group));
+    
+    // Step 1. change the bitmap in the appropriate block group
+    ext2_get_bg_descriptor(context, &bg, block_group);
     
-    bitmap_offset = block % context->superblock.s_blocks_per_group;
+    lba_block = bg.bg_block_bitmap * (ext2_block_size(context) / block_get_block_size());
     
     lba_block += (bitmap_offset / 8) / block_get_block_size();
     
-    block_read(lba_block + context->part_start, context->sysbuf);
+    ext2_block_read(context, lba_block + context->part_start, buf);
     
-    if(context->sysbuf[(bitmap_offset / 8) % block_get_block_size()] & (1 << (bitmap_offset % 8))) {
+    if(buf[(bitmap_offset / 8) % block_get_block_size()] & (1 << (bitmap_offset % 8))) {
         if(allocated == EXT2_ALLOCATED) {
+            ext2_unlock(ext2_bg_lock(context, block_group));
             return -1;      // can't allocate an already allocated block
         } else {
-            context->sysbuf[(bitmap_offset / 8) % block_get_block_size()] &= ~(1 << (bitmap_offset % 8));
+            buf[(bitmap_offset / 8) % block_get_block_size()] &= ~(1 << (bitmap_offset % 8));
         }
     } else {
         if(allocated == EXT2_DEALLOCATED) {
+            ext2_unlock(ext2_bg_lock(context, block_group));
             return -1;      // can't deallocate an already free block
         } else {
-            context->sysbuf[(bitmap_offset / 8) % block_get_block_size()] |= (1 << (bitmap_offset % 8));
+            buf[(bitmap_offset / 8) % block_get_block_size()] |= (1 << (bitmap_offset % 8));
         }
     }
     
-    block_write(lba_block + context->part_start, context->sysbuf);
+    ext2_block_write(context, lba_block + context->part_start, buf);
     
     // Step 2. update the block group descriptor
     if(allocated == EXT2_ALLOCATED) {
@@ -384,39 +973,189 @@ int ext2_change_allocated(struct ext2context *context,
         }
     }
     
-    ext2_write_bg_descriptor(context, &bg, block / context->superblock.s_blocks_per_group);
+    if(allocated == EXT2_DEALLOCATED) {
+        // before the group is unlocked, so it can't be handed out again before it is on the list
+        ext2_discard_add(context, block, 1);
+    }
+    ext2_write_bg_descriptor(context, &bg, block_group);
+    ext2_unlock(ext2_bg_lock(context, block_group));
+    if(allocated == EXT2_ALLOCATED) {
+        ext2_discard_cancel(context, block, 1);
+    }
     
     // Step 3. update the superblock
+    ext2_lock(ext2_sb_lock(context));
     if(allocated == EXT2_ALLOCATED) {
         context->superblock.s_free_blocks_count --;
     } else {
         context->superblock.s_free_blocks_count ++;
     }
+    ext2_unlock(ext2_sb_lock(context));
     return 0;
 }
 
-static int ext2_allocate_inode(struct file_ent *fe) {
-    uint32_t i, j;
+/**
+ * \brief Blocks being freed, gathered so each bitmap sector and descriptor is written just once.
+ *
+ * The lock of the block group being worked on is held from the first block freed in it until
+ * ext2_free_flush() moves on, so keep the work done in between to reading the block map.
+ **/
+struct ext2_free_batch {
+    uint32_t block_group;       // group the pending changes are in
+    uint32_t bitmap_lba;        // first sector of that group's block bitmap
+    uint32_t lba_block;         // bitmap sector held in buf
+    uint32_t freed;             // bits cleared in the group so far
+    uint32_t total;             // blocks freed through the batch
+    uint32_t run_start;         // consecutive blocks freed, not yet passed to ext2_discard_add()
+    uint32_t run_count;
+    int for_directory;
+    int active;                 // block_group is locked and buf holds lba_block
+    int dirty;                  // buf has bits cleared that aren't on the disk yet
+    uint8_t buf[512];
+};
+
+static void ext2_free_begin(struct ext2_free_batch *batch, int for_directory) {
+    batch->active = 0;
+    batch->freed = 0;
+    batch->total = 0;
+    batch->run_count = 0;
+    batch->for_directory = for_directory;
+}
+
+/**
+ * \brief Write out the bitmap sector and the counts of the block group in the batch.
+ **/
+static int ext2_free_flush(struct ext2context *context, struct ext2_free_batch *batch) {
     struct block_group_descriptor bg;
-    int most_free_inodes = 0;
-    int most_free_inodes_group = 0;
-    uint8_t bitmap_byte;
+    int r = 0;
     
-    for(i=0;i<fe->context->num_blockgroups;i++) {
-        ext2_get_bg_descriptor(fe->context, &bg, i);
-        if(most_free_inodes < bg.bg_free_inodes_count) {
-            most_free_inodes = bg.bg_free_inodes_count;
-            most_free_inodes_group = i;
-        }
-        printf("%d free inodes in group %d\n", bg.bg_free_inodes_count, i);
+    if(!batch->active) {
+        return 0;
     }
-    if(most_free_inodes == 0) {
-        printf("No free inodes\n");
-        fe->rerrno = ENOSPC;
-        return -1;
+    if(batch->dirty && ext2_block_write(context, batch->lba_block + context->part_start, batch->buf)) {
+        r = -1;
     }
-    printf("Allocating new inode in group %d\n", most_free_inodes_group);
+    batch->dirty = 0;
+    ext2_get_bg_descriptor(context, &bg, batch->block_group);
+    bg.bg_free_blocks_count += batch->freed;
+    if(batch->for_directory) {
+        bg.bg_used_dirs_count -= batch->freed;
+    }
+    if(ext2_write_bg_descriptor(context, &bg, batch->block_group)) {
+        r = -1;
+    }
+    if(batch->run_count) {
+        ext2_discard_add(context, batch->run_start, batch->run_count);
+        batch->run_count = 0;
+    }
+    ext2_unlock(ext2_bg_lock(context, batch->block_group));
+    
+    ext2_lock(ext2_sb_lock(context));
+    context->superblock.s_free_blocks_count += batch->freed;
+    ext2_unlock(ext2_sb_lock(context));
+    batch->active = 0;
+    batch->freed = 0;
+    return r;
+}
+
+/**
+ * \brief Free a block as part of a batch, see ext2_change_allocated() for the single block case.
+ *
+ * Blocks passed in ascending order (as they mostly are coming off the block map) cost one read
+ * and one write per bitmap sector and one descriptor update per block group.
+ *
+ * \returns 0 on success, 1 if the block was already free, -1 if the bitmap couldn't be read.
+ **/
+static int ext2_free_block(struct ext2context *context, struct ext2_free_batch *batch, uint32_t block) {
+    struct block_group_descriptor bg;
+    uint32_t block_group, bitmap_offset, lba_block;
+    
+    block_group = (block - context->superblock.s_first_data_block) / context->superblock.s_blocks_per_group;
+    bitmap_offset = (block - context->superblock.s_first_data_block) % context->superblock.s_blocks_per_group;
+    
+    if(batch->active && (batch->block_group != block_group)) {
+        ext2_free_flush(context, batch);
+    }
+    if(!batch->active) {
+        ext2_lock(ext2_bg_lock(context, block_group));
+        if(ext2_get_bg_descriptor(context, &bg, block_group)) {
+            ext2_unlock(ext2_bg_lock(context, block_group));
+            return -1;
+        }
+        batch->block_group = block_group;
+        batch->bitmap_lba = bg.bg_block_bitmap * (ext2_block_size(context) / block_get_block_size());
+        batch->lba_block = batch->bitmap_lba + (bitmap_offset / 8) / block_get_block_size();
+        if(ext2_block_read(context, batch->lba_block + context->part_start, batch->buf)) {
+            ext2_unlock(ext2_bg_lock(context, block_group));
+            return -1;
+        }
+        batch->active = 1;
+        batch->dirty = 0;
+    }
+    lba_block = batch->bitmap_lba + (bitmap_offset / 8) / block_get_block_size();
+    if(lba_block != batch->lba_block) {
+        // moving on to another sector of the same bitmap
+        if(batch->dirty) {
+            ext2_block_write(context, batch->lba_block + context->part_start, batch->buf);
+            batch->dirty = 0;
+        }
+        batch->lba_block = lba_block;
+        if(ext2_block_read(context, batch->lba_block + context->part_start, batch->buf)) {
+            // still count what was freed so far
+            ext2_free_flush(context, batch);
+            return -1;
+        }
+    }
+    if(!(batch->buf[(bitmap_offset / 8) % block_get_block_size()] & (1 << (bitmap_offset % 8)))) {
+        return 1;       // can't deallocate an already free block
+    }
+    batch->buf[(bitmap_offset / 8) % block_get_block_size()] &= ~(1 << (bitmap_offset % 8));
+    batch->freed++;
+    batch->total++;
+    batch->dirty = 1;
+    if(batch->run_count && (block == batch->run_start + batch->run_count)) {
+        batch->run_count++;
+    } else {
+        if(batch->run_count) {
+            ext2_discard_add(context, batch->run_start, batch->run_count);
+        }
+        batch->run_start = block;
+        batch->run_count = 1;
+    }
+    return 0;
+}
+
+static int ext2_allocate_inode(struct file_ent *fe) {
+    uint32_t i, j;
+    struct block_group_descriptor bg;
+    int most_free_inodes = 0;
+    int most_free_inodes_group = 0;
+    uint8_t bitmap_byte = 0xFF;
+    
+    for(i=0;i<fe->context->num_blockgroups;i++) {
+        ext2_get_bg_descriptor(fe->context, &bg, i);
+        if(most_free_inodes < bg.bg_free_inodes_count) {
+            most_free_inodes = bg.bg_free_inodes_count;
+            most_free_inodes_group = i;
+        }
+        printf("%d free inodes in group %d\n", bg.bg_free_inodes_count, i);
+    }
+    if(most_free_inodes == 0) {
+        printf("No free inodes\n");
+        fe->rerrno = ENOSPC;
+        return -1;
+    }
+    printf("Allocating new inode in group %d\n", most_free_inodes_group);
+    
+    /* another thread may have taken the last free inode since the scan above, the descriptor is
+     * re-read under the lock and the bitmap search and update happen without releasing it */
+    ext2_lock(ext2_bg_lock(fe->context, most_free_inodes_group));
     ext2_get_bg_descriptor(fe->context, &bg, most_free_inodes_group);
+    if(bg.bg_free_inodes_count == 0) {
+        ext2_unlock(ext2_bg_lock(fe->context, most_free_inodes_group));
+        fe->rerrno = ENOSPC;
+        return -1;
+    }
     
     for(i=0;i<fe->context->superblock.s_inodes_per_group/8;i++) {
         ext2_load_buffer(fe, bg.bg_inode_bitmap, i);
@@ -430,7 +1169,7 @@ static int ext2_allocate_inode(struct file_ent *fe) {
             break;
         }
     }
-    if((i < fe->context->superblock.s_inodes_per_group) && (j < 8)) {
+    if((i < fe->context->superblock.s_inodes_per_group/8) && (j < 8)) {
         fe->inode_number = (fe->context->superblock.s_inodes_per_group * most_free_inodes_group +
                             i * 8 + j + 1);
         bitmap_byte |= (1 << j);        // allocate this inode in the bitmap
@@ -438,13 +1177,17 @@ static int ext2_allocate_inode(struct file_ent *fe) {
         ext2_store_buffer(fe);
         bg.bg_free_inodes_count -= 1;   // decrement the inode count
         ext2_write_bg_descriptor(fe->context, &bg, most_free_inodes_group);
+        ext2_unlock(ext2_bg_lock(fe->context, most_free_inodes_group));
+        ext2_lock(ext2_sb_lock(fe->context));
         fe->context->superblock.s_free_inodes_count -= 1;
         ext2_flush_superblock(fe->context);
+        ext2_unlock(ext2_sb_lock(fe->context));
         printf("Allocating new inode %d\n", fe->inode_number);
     } else {
         // this should never happen because we've already determined that there are free
         // inodes in this block group.  So this must be an error in the filesystem or the
         // driver.
+        ext2_unlock(ext2_bg_lock(fe->context, most_free_inodes_group));
         fe->rerrno = EIO;
         return -1;
     }
@@ -452,18 +1195,238 @@ static int ext2_allocate_inode(struct file_ent *fe) {
     return 0;
 }
 
+/**
+ * \brief Mark an inode free in its bitmap, block group and superblock counts.
+ *
+ * \returns 0 on success, 1 if the inode was already free, -1 on error.
+ **/
+static int ext2_free_inode(struct ext2context *context, uint32_t inode, int for_directory) {
+    uint8_t buf[512];
+    uint32_t block_group = (inode - 1) / context->superblock.s_inodes_per_group;
+    uint32_t index = (inode - 1) % context->superblock.s_inodes_per_group;
+    uint32_t lba_block;
+    struct block_group_descriptor bg;
+    
+    ext2_lock(ext2_bg_lock(context, block_group));
+    ext2_get_bg_descriptor(context, &bg, block_group);
+    lba_block = bg.bg_inode_bitmap * (ext2_block_size(context) / block_get_block_size());
+    lba_block += (index / 8) / block_get_block_size();
+    if(ext2_block_read(context, lba_block + context->part_start, buf)) {
+        ext2_unlock(ext2_bg_lock(context, block_group));
+        return -1;
+    }
+    if(!(buf[(index / 8) % block_get_block_size()] & (1 << (index % 8)))) {
+        ext2_unlock(ext2_bg_lock(context, block_group));
+        return 1;       // already free
+    }
+    buf[(index / 8) % block_get_block_size()] &= ~(1 << (index % 8));
+    ext2_block_write(context, lba_block + context->part_start, buf);
+    bg.bg_free_inodes_count++;
+    if(for_directory) {
+        bg.bg_used_dirs_count--;
+    }
+    ext2_write_bg_descriptor(context, &bg, block_group);
+    ext2_unlock(ext2_bg_lock(context, block_group));
+    
+    ext2_lock(ext2_sb_lock(context));
+    context->superblock.s_free_inodes_count++;
+    ext2_unlock(ext2_sb_lock(context));
+    return 0;
+}
+
+/**
+ * \brief Find the free run of blocks in a group to allocate from.
+ *
+ * The bitmap is stepped through a byte at a time where the byte is all free or all used, bit by
+ * bit elsewhere.  The search stops at the first run count long, otherwise the longest is given.
+ *
+ * \param from Bit in the group to start looking at.
+ * \param length Set to the length of the run found (at most count), 0 if there isn't one.
+ * \returns the first bit of the run.
+ **/
+static uint32_t ext2_find_run(struct ext2context *context, struct block_group_descriptor *bg,
+                              uint32_t from, uint32_t count, uint32_t *length) {
+    uint8_t buf[512];
+    uint32_t bits = context->superblock.s_blocks_per_group;
+    uint32_t sector_bits = block_get_block_size() * 8;
+    uint32_t loaded = (uint32_t)-1;
+    uint32_t bit, run = 0, run_start = 0, best = 0;
+    uint8_t byte;
+    
+    *length = 0;
+    for(bit=from;(bit < bits) && (*length < count);) {
+        if(bit / sector_bits != loaded) {
+            loaded = bit / sector_bits;
+            if(ext2_block_read(context, bg->bg_block_bitmap * (ext2_block_size(context) / block_get_block_size()) +
+                               loaded + context->part_start, buf)) {
+                break;
+            }
+        }
+        byte = buf[(bit / 8) % block_get_block_size()];
+        if(((bit % 8) == 0) && (bit + 8 <= bits) && ((byte == 0x00) || (byte == 0xFF))) {
+            if(byte == 0xFF) {
+                run = 0;
+            } else {
+                run_start = run ? run_start : bit;
+                run += 8;
+            }
+            bit += 8;
+        } else {
+            if(byte & (1 << (bit % 8))) {
+                run = 0;
+            } else {
+                run_start = run ? run_start : bit;
+                run++;
+            }
+            bit++;
+        }
+        if(run > *length) {
+            *length = run;
+            best = run_start;
+        }
+    }
+    if(*length > count) {
+        *length = count;
+    }
+    return best;
+}
+
+/**
+ * \brief Check that no block of the device allocation unit starting at block is in use.
+ **/
+static int ext2_au_empty(struct ext2context *context, uint32_t block) {
+    struct block_group_descriptor bg;
+    uint8_t buf[512];
+    uint32_t sector_bits = block_get_block_size() * 8;
+    uint32_t end = block + context->au_blocks;
+    uint32_t group, bit, lba_block, loaded = (uint32_t)-1, loaded_group = (uint32_t)-1;
+    uint8_t byte;
+    
+    if((block < context->superblock.s_first_data_block) || (end > context->superblock.s_blocks_count)) {
+        return 0;
+    }
+    while(block < end) {
+        group = (block - context->superblock.s_first_data_block) / context->superblock.s_blocks_per_group;
+        bit = (block - context->superblock.s_first_data_block) % context->superblock.s_blocks_per_group;
+        if(group != loaded_group) {
+            ext2_get_bg_descriptor(context, &bg, group);
+            loaded_group = group;
+        }
+        lba_block = bg.bg_block_bitmap * (ext2_block_size(context) / block_get_block_size()) + bit / sector_bits;
+        if(lba_block != loaded) {
+            if(ext2_block_read(context, lba_block + context->part_start, buf)) {
+                return 0;
+            }
+            loaded = lba_block;
+        }
+        byte = buf[(bit / 8) % block_get_block_size()];
+        if(((bit % 8) == 0) && (block + 8 <= end) && (bit + 8 <= context->superblock.s_blocks_per_group) &&
+            (byte == 0)) {
+            block += 8;
+        } else if(byte & (1 << (bit % 8))) {
+            return 0;
+        } else {
+            block++;
+        }
+    }
+    return 1;
+}
+
+/**
+ * \brief Find an allocation unit of the device with nothing in it, for a large file to move to.
+ *
+ * The search carries on from the unit after the last one found so units are handed out in order.
+ * This is only a hint, nothing is locked and the block is allocated as usual afterwards.
+ *
+ * \returns the first block of the unit, 0 if there are no empty units.
+ **/
+static uint32_t ext2_au_goal(struct ext2context *context) {
+    uint32_t au = context->au_blocks;
+    uint32_t base, units, unit, n;
+    
+    // units are counted from the start of the device, not the partition
+    base = (au - (context->part_start / (ext2_block_size(context) / block_get_block_size())) % au) % au;
+    if(base >= context->superblock.s_blocks_count) {
+        return 0;
+    }
+    units = (context->superblock.s_blocks_count - base) / au;
+    for(n=0;n<units;n++) {
+        unit = (context->au_next + n) % units;
+        if(ext2_au_empty(context, base + unit * au)) {
+            context->au_next = unit + 1;
+            return base + unit * au;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Check whether a block is the first of a device allocation unit.
+ **/
+static int ext2_au_start(struct ext2context *context, uint32_t block) {
+    uint32_t sectors_per_block = ext2_block_size(context) / block_get_block_size();
+    return context->au_blocks && (((context->part_start / sectors_per_block) + block) % context->au_blocks == 0);
+}
+
+/**
+ * \brief Allocate a particular block if it is free.
+ *
+ * \returns the block, 0 if it is in use or the bitmap couldn't be read.
+ **/
+static uint32_t ext2_allocate_at(struct file_ent *fe, uint32_t block) {
+    struct ext2context *context = fe->context;
+    struct block_group_descriptor bg;
+    uint8_t buf[512];
+    uint32_t group, bit;
+    
+    if((block < context->superblock.s_first_data_block) || (block >= context->superblock.s_blocks_count)) {
+        return 0;
+    }
+    group = (block - context->superblock.s_first_data_block) / context->superblock.s_blocks_per_group;
+    bit = (block - context->superblock.s_first_data_block) % context->superblock.s_blocks_per_group;
+    ext2_lock(ext2_bg_lock(context, group));
+    ext2_get_bg_descriptor(context, &bg, group);
+    if(ext2_block_read(context, bg.bg_block_bitmap * (ext2_block_size(context) / block_get_block_size()) +
+                       bit / (block_get_block_size() * 8) + context->part_start, buf) ||
+        (buf[(bit / 8) % block_get_block_size()] & (1 << (bit % 8)))) {
+        ext2_unlock(ext2_bg_lock(context, group));
+        return 0;
+    }
+    ext2_nb_commit(context);
+    if(ext2_change_allocated(context, block, EXT2_ALLOCATED, 0)) {
+        block = 0;
+    }
+    ext2_unlock(ext2_bg_lock(context, group));
+    return block;
+}
+
 uint32_t ext2_allocate_block(struct file_ent *fe, uint32_t previous_block) {
 //     uint32_t block_group = (fe->inode_number - 1) / fe->context->superblock.s_inodes_per_group;
 //     uint32_t block_index = (fe->inode_number - 1) % fe->context->superblock.s_inodes_per_group;
 //     uint32_t lba_block;
 //     uint32_t bitmap_offset;
-    uint8_t bitmap_byte;
     uint32_t i, j;
     uint32_t block_no;
     int most_free_blocks = 0, most_free_blocks_group = 0;
     struct block_group_descriptor bg;
     
-    // if there is a previous block specified and it wasn't the last block in its group
+    // carry on from the previous block so a file written in order is in order on the volume, a
+    // large file going into a unit that is already in use moves to an empty one instead
+    block_no = previous_block ? previous_block + 1 : 0;
+    if(block_no && ext2_au_start(fe->context, block_no) && (fe->cursor >= EXT2_AU_LARGE_FILE) &&
+        !ext2_au_empty(fe->context, block_no)) {
+        block_no = 0;
+    }
+    if(!block_no && fe->context->au_blocks && (fe->cursor >= EXT2_AU_LARGE_FILE)) {
+        block_no = ext2_au_goal(fe->context);
+    }
+    if(block_no && ((block_no = ext2_allocate_at(fe, block_no)) != 0)) {
+        return block_no;
+    }
+    if(ext2_nb_deferred(fe->context)) {
+        return 0;
+    }
+    
 //     if(previous_block && ((previous_block + 1) % context->superblock.s_blocks_per_group)) {
 //         ext2_get_bg_descriptor(context, &bg, previous_block / context->superblock.s_blocks_per_group);
 //         
@@ -495,6 +1458,7 @@ uint32_t ext2_allocate_block(struct file_ent *fe, uint32_t previous_block) {
 //         }
 //     } else {
         // no previous block, or next block was already allocated start somewhere new
+        (void)previous_block;
         for(i=0;i<fe->context->num_blockgroups;i++) {
             ext2_get_bg_descriptor(fe->context, &bg, i);
             if(most_free_blocks < bg.bg_free_blocks_count) {
@@ -502,646 +1466,2869 @@ uint32_t ext2_allocate_block(struct file_ent *fe, uint32_t previous_block) {
                 most_free_blocks_group = i;
             }
         }
+        if(ext2_nb_deferred(fe->context)) {
+            return 0;
+        }
         if(most_free_blocks == 0) {
             fe->rerrno = ENOSPC;
             return 0;
         }
+        ext2_lock(ext2_bg_lock(fe->context, most_free_blocks_group));
         ext2_get_bg_descriptor(fe->context, &bg, most_free_blocks_group);
         
-        for(i=0;i<fe->context->superblock.s_blocks_per_group/8;i++) {
-            ext2_load_buffer(fe, bg.bg_block_bitmap, i);
-            ext2_read_buffer(&bitmap_byte, &fe->buffer, i, 1);
-            for(j=0;j<8;j++) {
-                if(!(bitmap_byte & (1 << j))) {
-                    break;
-                }
-            }
-            if(j < 8) {
-                break;
-            }
-        }
-        if((i < fe->context->superblock.s_blocks_per_group/8) && (j < 8)) {
+        // the first free block in the group, reading each bitmap sector once
+        i = ext2_find_run(fe->context, &bg, 0, 1, &j);
+        if(j) {
             block_no = (fe->context->superblock.s_blocks_per_group * most_free_blocks_group + 
-                        i * 8 + j + 1);
-            if(ext2_change_allocated(fe->context, block_no, EXT2_ALLOCATED, fe->inode.i_mode & S_IFDIR ? 1 : 0)) {
+                        i + fe->context->superblock.s_first_data_block);
+            ext2_nb_commit(fe->context);
+            /* bg_used_dirs_count counts directories, not the blocks they use */
+            if(ext2_change_allocated(fe->context, block_no, EXT2_ALLOCATED, 0)) {
+                ext2_unlock(ext2_bg_lock(fe->context, most_free_blocks_group));
                 return 0;
             }
+            ext2_unlock(ext2_bg_lock(fe->context, most_free_blocks_group));
             return block_no;
         }
+        ext2_unlock(ext2_bg_lock(fe->context, most_free_blocks_group));
 //     }
     
     return 0;
 }
+
+
+/**
+ * \brief Allocate up to count consecutive blocks, as close after goal as possible.
+ *
+ * The group goal is in is searched from goal on first, then the group with the most free blocks.
+ * If neither has a run count long the longest one found is taken.  The bitmap sectors,
+ * descriptor and superblock count are each updated once for the whole run.
+ *
+ * \param goal The block the run would ideally start at, 0 for no preference.
+ * \param got Set to the number of blocks allocated.
+ * \returns the first block of the run or 0 on error.
+ **/
+static uint32_t ext2_allocate_run(struct file_ent *fe, uint32_t goal, uint32_t count, uint32_t *got) {
+    struct ext2context *context = fe->context;
+    struct block_group_descriptor bg;
+    uint8_t buf[512];
+    uint32_t sector_bits = block_get_block_size() * 8;
+    uint32_t lba_block, start = 0, length = 0, bit, i;
+    uint32_t group[2], from[2], most_free_blocks = 0, longest = 0;
+    int pass, passes = 0, best = 0;
     
-int ext2_truncate_file(struct file_ent *fe) {
-    int i,j,k;
-    uint32_t block, block2, block3;
-    int32_t indirect_entries = ext2_block_size(fe->context) / 4;
-    int isdir = (fe->inode.i_mode & EXT2_S_IFDIR) ? 1 : 0;
-    for(i=0;i<12;i++) {
-        if(fe->inode.i_block[i]) {
-            ext2_change_allocated(fe->context, fe->inode.i_block[i], EXT2_DEALLOCATED, isdir);
+    *got = 0;
+    // a large run goes into an empty allocation unit unless it carries straight on from the last
+    if(context->au_blocks && ((uint64_t)count * ext2_block_size(context) >= EXT2_AU_LARGE_FILE) &&
+        (!goal || (ext2_au_start(context, goal) && !ext2_au_empty(context, goal))) &&
+        ((i = ext2_au_goal(context)) != 0)) {
+        goal = i;
+    }
+    if((goal >= context->superblock.s_first_data_block) && (goal < context->superblock.s_blocks_count)) {
+        group[passes] = (goal - context->superblock.s_first_data_block) / context->superblock.s_blocks_per_group;
+        from[passes++] = (goal - context->superblock.s_first_data_block) % context->superblock.s_blocks_per_group;
+    }
+    group[passes] = 0;
+    from[passes] = 0;
+    for(i=0;i<context->num_blockgroups;i++) {
+        ext2_get_bg_descriptor(context, &bg, i);
+        if(most_free_blocks < bg.bg_free_blocks_count) {
+            most_free_blocks = bg.bg_free_blocks_count;
+            group[passes] = i;
         }
-        fe->inode.i_block[i] = 0;
     }
-    if(fe->inode.i_block[12]) {
-        // indirect blocks
-        for(i=0;i<indirect_entries;i++) {
-            ext2_load_buffer(fe, fe->inode.i_block[12], i * 4);
-            ext2_read_buffer(&block, &fe->buffer, i * 4, 4);
-            if(block) {
-                ext2_change_allocated(fe->context, block, EXT2_DEALLOCATED, isdir);
-            } else {
-                break;
-            }
+    if(most_free_blocks == 0) {
+        fe->rerrno = ENOSPC;
+        return 0;
+    }
+    passes++;
+    for(pass=0;pass<passes;pass++) {
+        ext2_lock(ext2_bg_lock(context, group[pass]));
+        ext2_get_bg_descriptor(context, &bg, group[pass]);
+        start = ext2_find_run(context, &bg, from[pass], count, &length);
+        if(length == count) {
+            break;
+        }
+        ext2_unlock(ext2_bg_lock(context, group[pass]));
+        if(length > longest) {
+            longest = length;
+            best = pass;
         }
-        // finally free the indirect block
-        ext2_change_allocated(fe->context, fe->inode.i_block[12], EXT2_DEALLOCATED, isdir);
-        fe->inode.i_block[12] = 0;
     }
-    if(fe->inode.i_block[13]) {
-        // double indirect blocks
-        for(i=0;i<indirect_entries;i++) {
-            ext2_load_buffer(fe, fe->inode.i_block[13], i *4);
-            ext2_read_buffer(&block, &fe->buffer, i * 4, 4);
-            if(block) {
-                for(j=0;j<indirect_entries;j++) {
-                    ext2_load_buffer(fe, block, j * 4);
-                    ext2_read_buffer(&block2, &fe->buffer, j * 4, 4);
-                    if(block2) {
-                        ext2_change_allocated(fe->context, block2, EXT2_DEALLOCATED, isdir);
-                    } else {
-                        break;
-                    }
-                }
-                ext2_change_allocated(fe->context, block, EXT2_DEALLOCATED, isdir);
-            } else {
-                break;
-            }
+    if(pass == passes) {
+        // no group had the whole run, look again at the longest one found under the lock
+        pass = best;
+        ext2_lock(ext2_bg_lock(context, group[pass]));
+        ext2_get_bg_descriptor(context, &bg, group[pass]);
+        start = ext2_find_run(context, &bg, from[pass], count, &length);
+        if(length == 0) {
+            ext2_unlock(ext2_bg_lock(context, group[pass]));
+            fe->rerrno = ENOSPC;
+            return 0;
         }
-        ext2_change_allocated(fe->context, fe->inode.i_block[13], EXT2_DEALLOCATED, isdir);
-        fe->inode.i_block[13] = 0;
     }
-    if(fe->inode.i_block[14]) {
-        // triply indirect blocks
-        for(i=0;i<indirect_entries;i++) {
-            ext2_load_buffer(fe, fe->inode.i_block[13], i * 4);
-            ext2_read_buffer(&block, &fe->buffer, i * 4, 4);
-            if(block) {
-                for(j=0;j<indirect_entries;j++) {
-                    ext2_load_buffer(fe, block, j * 4);
-                    ext2_read_buffer(&block2, &fe->buffer, j * 4, 4);
-                    if(block2) {
-                        for(k=0;k<indirect_entries;k++) {
-                            ext2_load_buffer(fe, block, k * 4);
-                            ext2_read_buffer(&block3, &fe->buffer, k * 4, 4);
-                            if(block3) {
-                                ext2_change_allocated(fe->context, block3, EXT2_DEALLOCATED, isdir);
-                            } else {
-                                break;
-                            }
-                        }
-                        ext2_change_allocated(fe->context, block2, EXT2_DEALLOCATED, isdir);
-                    } else {
-                        break;
-                    }
-                }
-                ext2_change_allocated(fe->context, block, EXT2_DEALLOCATED, isdir);
-            } else {
-                break;
-            }
+    
+    lba_block = bg.bg_block_bitmap * (ext2_block_size(context) / block_get_block_size()) + context->part_start;
+    for(bit=start;bit<start + length;) {
+        i = bit / sector_bits;
+        if(ext2_block_read(context, lba_block + i, buf)) {
+            ext2_unlock(ext2_bg_lock(context, group[pass]));
+            fe->rerrno = EIO;
+            return 0;
+        }
+        for(;(bit < start + length) && (bit / sector_bits == i);bit++) {
+            buf[(bit / 8) % block_get_block_size()] |= (1 << (bit % 8));
+        }
+        if(ext2_block_write(context, lba_block + i, buf)) {
+            ext2_unlock(ext2_bg_lock(context, group[pass]));
+            fe->rerrno = EIO;
+            return 0;
         }
-        ext2_change_allocated(fe->context, fe->inode.i_block[14], EXT2_DEALLOCATED, isdir);
-        fe->inode.i_block[14] = 0;
     }
-    fe->inode.i_size = 0;
-    fe->inode.i_blocks = 0;
-    return 0;
+    bg.bg_free_blocks_count -= length;
+    ext2_write_bg_descriptor(context, &bg, group[pass]);
+    ext2_unlock(ext2_bg_lock(context, group[pass]));
+    start += context->superblock.s_blocks_per_group * group[pass] + context->superblock.s_first_data_block;
+    ext2_discard_cancel(context, start, length);
+    
+    ext2_lock(ext2_sb_lock(context));
+    context->superblock.s_free_blocks_count -= length;
+    ext2_unlock(ext2_sb_lock(context));
+    *got = length;
+    return start;
 }
-
+    
 int ext2_update_atime(struct file_ent *fe) {
     fe->inode.i_atime = time(NULL);
-    fe->flags |= EXT2_FLAG_FS_DIRTY;
+    fe->flags |= EXT2_FLAG_TIME_DIRTY;
     return 0;
 }
 
 int ext2_update_mtime(struct file_ent *fe) {
     fe->inode.i_mtime = time(NULL);
-    fe->flags |= EXT2_FLAG_FS_DIRTY;
+    fe->flags |= EXT2_FLAG_TIME_DIRTY;
     return 0;
 }
 
-int ext2_open_inode(struct file_ent *fe, uint32_t inode) {
-    struct block_group_descriptor *block_table;
-    uint32_t inode_block;
-    uint32_t block_group = (inode - 1) / fe->context->superblock.s_inodes_per_group;
-    uint32_t inode_index = (inode - 1) % fe->context->superblock.s_inodes_per_group;
-    // now load the block group descriptor for that block group
-    uint32_t bg_block = fe->context->superblock_block + 1;
-  
-    /* check for a bad inode number */
-    if((inode > fe->context->superblock.s_inodes_count) || (inode == 0)) {
-        return -1;
-    }
-        
-    bg_block <<= (fe->context->superblock.s_log_block_size + 1);
-  
-    bg_block += ((block_group * 32) / block_get_block_size());
-  
-    block_read(bg_block + fe->context->part_start, fe->context->sysbuf);
-  
-    block_table = (struct block_group_descriptor *)&fe->context->sysbuf[(block_group * 32) % block_get_block_size()];
-  
-    inode_block = block_table->bg_inode_table;
-  
-    inode_block <<= (fe->context->superblock.s_log_block_size + 1);
-  
-    inode_block += (inode_index / (block_get_block_size() / fe->context->superblock.s_inode_size));
-  
-    block_read(inode_block + fe->context->part_start, fe->context->sysbuf);
-  
-    memcpy(&fe->inode, &fe->context->sysbuf[(inode_index % (block_get_block_size() / fe->context->superblock.s_inode_size)) * fe->context->superblock.s_inode_size], sizeof(struct inode));
-  
-    fe->inode_number = inode;
-    fe->flags = EXT2_FLAG_READ;
-    fe->cursor = 0;
-  
-    return 0;
+/**
+ * \brief Work out where an inode lives in the inode table of its block group.
+ *
+ * \param context The ext2 filesystem context for the mounted volume.
+ * \param bg The descriptor of the block group containing the inode.
+ * \param inode The inode number.
+ * \param lba_block Set to the disk block (relative to the partition) holding the inode.
+ * \param offset Set to the byte offset of the inode within that disk block.
+ **/
+static void ext2_inode_position(struct ext2context *context, struct block_group_descriptor *bg,
+                                uint32_t inode, uint32_t *lba_block, uint32_t *offset) {
+    uint32_t inode_index = (inode - 1) % context->superblock.s_inodes_per_group;
+    uint32_t inodes_per_sector = block_get_block_size() / context->superblock.s_inode_size;
+    
+    *lba_block = bg->bg_inode_table;
+    *lba_block <<= (context->superblock.s_log_block_size + 1);
+    *lba_block += inode_index / inodes_per_sector;
+    *offset = (inode_index % inodes_per_sector) * context->superblock.s_inode_size;
 }
 
-int ext2_lookup_path(struct file_ent *fe, const char *path, int *rerrno) {
-    char local_path[MAX_PATH_LEN];
-    char *elements[MAX_PATH_LEVELS];
-    int levels = 0;
-    uint32_t ino = EXT2_ROOT_INO;
-    struct dirent *de;
-    int i;
-  
-    strncpy(local_path, path, sizeof(local_path));
-    local_path[MAX_PATH_LEN-1] = 0;
-  
-    if((elements[levels] = strtok(local_path, "/"))) {
-        while(++levels < MAX_PATH_LEVELS) {
-            if(!(elements[levels] = strtok(NULL, "/"))) {
-                break;
+#if EXT2_INODE_CACHE_SECTORS > 0
+/**
+ * \brief Copy an inode table sector out of the inode cache.
+ *
+ * \returns 0 if the sector was cached and copied to buf, -1 if it wasn't cached.
+ **/
+static int ext2_inode_cache_read(struct ext2context *context, uint32_t lba_block, uint8_t *buf) {
+    struct ext2_inode_cache_entry *entry;
+    uint32_t i, seq;
+    int hit;
+    
+    for(i=0;i<EXT2_INODE_CACHE_SECTORS;i++) {
+        entry = &context->inode_cache[i];
+        do {
+            seq = ext2_seq_read_begin(&entry->seq);
+            hit = entry->valid && (entry->lba_block == lba_block);
+            if(hit) {
+                memcpy(buf, &context->inode_cache_data[i * 512], 512);
             }
+        } while(ext2_seq_read_retry(&entry->seq, seq));
+        if(hit) {
+            return 0;
         }
     }
-  
-    for(i=0;i<levels;i++) {
-        if(ext2_open_inode(fe, ino)) {
-            *rerrno = ENOENT;
-            return -1;
-        }
-        de = ext2_readdir(fe, rerrno);
-        while(de != NULL) {
-            if(strcmp(de->d_name, elements[i]) == 0) {
-                break;
+    return -1;
+}
+
+/**
+ * \brief Write an inode table sector to disk and keep any cached copy of it in step.
+ *
+ * The write and cache update happen under the cache lock so a readahead running at the same
+ * time cannot put an older copy of the sector back in the cache.
+ **/
+static int ext2_inode_cache_write(struct ext2context *context, uint32_t lba_block, uint8_t *buf) {
+    struct ext2_inode_cache_entry *entry;
+    uint32_t i;
+    int r;
+    
+    ext2_lock(&context->inode_cache_lock);
+    r = ext2_block_write(context, lba_block + context->part_start, buf);
+    for(i=0;i<EXT2_INODE_CACHE_SECTORS;i++) {
+        entry = &context->inode_cache[i];
+        if(entry->valid && (entry->lba_block == lba_block)) {
+            ext2_seq_write_begin(&entry->seq);
+            if(r == 0) {
+                memcpy(&context->inode_cache_data[i * 512], buf, 512);
+            } else {
+                entry->valid = 0;
             }
-            de = ext2_readdir(fe, rerrno);
+            ext2_seq_write_end(&entry->seq);
         }
-        if(de == NULL) {
-            *rerrno = ENOENT;
-            return -1;
-        }
-        ino = de->d_ino;
     }
-
-    // right, ino is now the inode of the target file/directory
-    return ino;//ext2_open_inode(fe, ino);
+    ext2_unlock(&context->inode_cache_lock);
+    return r;
 }
 
-static uint32_t ext2_block_from_offset(struct file_ent *fe, uint64_t offset) {
-    uint32_t block_index = offset / ext2_block_size(fe->context);
-    uint32_t block;
-    uint32_t indirect_entries = (ext2_block_size(fe->context) / 4);
+/**
+ * \brief Fetch the inode table sectors starting at the one holding inode into the cache.
+ *
+ * Up to #EXT2_INODE_READAHEAD sectors are read with a single multi-block request, stopping at the
+ * end of the inode table of the block group.  Nothing is read if the first sector is cached.
+ *
+ * \returns the number of inodes from inode onwards that are now cached.
+ **/
+static uint32_t ext2_inode_readahead(struct ext2context *context, uint32_t inode) {
+    struct block_group_descriptor bg;
+    struct ext2_inode_cache_entry *entry;
+    uint32_t lba_block, offset, table_end, count, first, read, i;
+    uint32_t inodes_per_sector = block_get_block_size() / context->superblock.s_inode_size;
+    uint8_t probe[512];
     
-    if(block_index < 12) {
-        block = fe->inode.i_block[block_index];
-    } else {
-        block_index -= 12;
-        if(block_index < indirect_entries) {
-            ext2_load_buffer(fe, fe->inode.i_block[12], block_index * 4);
-            ext2_read_buffer(&block, &fe->buffer, block_index * 4, 4);
-        } else {
-            block_index -= indirect_entries;
-            if(block_index < indirect_entries * indirect_entries) {
-                ext2_load_buffer(fe, fe->inode.i_block[13], (block_index / indirect_entries) * 4);
-                ext2_read_buffer(&block, &fe->buffer, (block_index / indirect_entries) * 4, 4);
-                ext2_load_buffer(fe, block, (block_index % indirect_entries) * 4);
-                ext2_read_buffer(&block, &fe->buffer, (block_index % indirect_entries) * 4, 4);
-            } else {
-                block_index -= indirect_entries * indirect_entries;
-                if(block_index < indirect_entries * indirect_entries * indirect_entries) {
-                    ext2_load_buffer(fe, fe->inode.i_block[14], (block_index / (indirect_entries * indirect_entries)) * 4);
-                    ext2_read_buffer(&block, &fe->buffer, (block_index / (indirect_entries * indirect_entries)) * 4, 4);
-                    ext2_load_buffer(fe, block, ((block_index / indirect_entries) % indirect_entries) * 4);
-                    ext2_read_buffer(&block, &fe->buffer, ((block_index / indirect_entries) % indirect_entries) * 4, 4);
-                    ext2_load_buffer(fe, block, (block_index % indirect_entries) * 4);
-                    ext2_read_buffer(&block, &fe->buffer, (block_index % indirect_entries) * 4, 4);
-                } else {
-                    /* cursor past largest file size possible */
-                    return -1;
-                }
-            }
-        }
+    ext2_get_bg_descriptor(context, &bg, (inode - 1) / context->superblock.s_inodes_per_group);
+    ext2_inode_position(context, &bg, inode, &lba_block, &offset);
+    if(ext2_inode_cache_read(context, lba_block, probe) == 0) {
+        return inodes_per_sector - offset / context->superblock.s_inode_size;
     }
     
-    return block;
-}
-
-int ext2_select_buffer(struct file_ent *fe) {
-    uint32_t block = ext2_block_from_offset(fe, fe->cursor);
-    uint32_t new_block;
-    uint32_t previous_block = ext2_block_from_offset(fe, ((fe->cursor / ext2_block_size(fe->context)) - 1) * ext2_block_size(fe->context));
+    table_end = bg.bg_inode_table << (context->superblock.s_log_block_size + 1);
+    table_end += (context->superblock.s_inodes_per_group + inodes_per_sector - 1) / inodes_per_sector;
+    count = table_end - lba_block;
+    if(count > EXT2_INODE_READAHEAD) {
+        count = EXT2_INODE_READAHEAD;
+    }
+    if(count > EXT2_INODE_CACHE_SECTORS) {
+        count = EXT2_INODE_CACHE_SECTORS;
+    }
     
-    if(block) {
-        ext2_load_buffer(fe, block, fe->cursor % ext2_block_size(fe->context));
-    } else {
-        if(fe->flags & EXT2_FLAG_WRITE) {
-            new_block = ext2_allocate_block(fe, previous_block);
-            if(new_block) {
-                fe->inode.i_block[0] = new_block;
-                ext2_load_buffer(fe, new_block, fe->cursor % ext2_block_size(fe->context));
-            } else {
-                return -1;
-            }
-        } else {
-            return -1;
+    ext2_lock(&context->inode_cache_lock);
+    // the run is read straight into the cache so it has to fit without wrapping
+    if(context->inode_cache_next + count > EXT2_INODE_CACHE_SECTORS) {
+        context->inode_cache_next = 0;
+    }
+    first = context->inode_cache_next;
+    
+    // never hold two copies of one sector, and keep the slots being filled hidden from readers
+    for(i=0;i<EXT2_INODE_CACHE_SECTORS;i++) {
+        entry = &context->inode_cache[i];
+        if(entry->valid && (entry->lba_block >= lba_block) && (entry->lba_block < lba_block + count)) {
+            ext2_seq_write_begin(&entry->seq);
+            entry->valid = 0;
+            ext2_seq_write_end(&entry->seq);
         }
     }
-    return 0;
+    for(i=first;i<first+count;i++) {
+        ext2_seq_write_begin(&context->inode_cache[i].seq);
+        context->inode_cache[i].valid = 0;
+    }
+    read = 0;
+    if(ext2_block_read_multi(context, lba_block + context->part_start, count, &context->inode_cache_data[first * 512]) == 0) {
+        for(i=0;i<count;i++) {
+            context->inode_cache[first + i].lba_block = lba_block + i;
+            context->inode_cache[first + i].valid = 1;
+        }
+        read = count * inodes_per_sector - offset / context->superblock.s_inode_size;
+    }
+    for(i=first;i<first+count;i++) {
+        ext2_seq_write_end(&context->inode_cache[i].seq);
+    }
+    context->inode_cache_next = (first + count) % EXT2_INODE_CACHE_SECTORS;
+    ext2_unlock(&context->inode_cache_lock);
+    return read;
 }
+#endif
 
-int is_power(int x, int ofy) {
-    while((x % ofy ) == 0) {
-        x /= ofy;
+static int ext2_fetch_inode_sector(struct ext2context *context, uint32_t lba_block, uint8_t *buf) {
+#if EXT2_INODE_CACHE_SECTORS > 0
+    if(ext2_inode_cache_read(context, lba_block, buf) == 0) {
+        return 0;
     }
-    return x == 1;
+#endif
+    return ext2_block_read(context, lba_block + context->part_start, buf);
+}
+
+static int ext2_store_inode_sector(struct ext2context *context, uint32_t lba_block, uint8_t *buf) {
+#if EXT2_INODE_CACHE_SECTORS > 0
+    return ext2_inode_cache_write(context, lba_block, buf);
+#else
+    return ext2_block_write(context, lba_block + context->part_start, buf);
+#endif
 }
 
 /**
- * callable file access routines
- */
+ * \brief Read the inode table sector holding inode, from the inode cache if it is there.
+ *
+ * The copy is retried if the sector was rewritten while it was being read.
+ **/
+static int ext2_read_inode_sector(struct ext2context *context, uint32_t inode,
+                                  uint32_t lba_block, uint8_t *buf) {
+    uint32_t seq;
+    int r;
+    do {
+        seq = ext2_seq_read_begin(ext2_inode_seq(context, inode));
+        r = ext2_fetch_inode_sector(context, lba_block, buf);
+    } while(ext2_seq_read_retry(ext2_inode_seq(context, inode), seq));
+    return r;
+}
 
-int ext2_mount(blockno_t part_start, blockno_t volume_size, 
-               uint8_t filesystem_hint __attribute__((__unused__)), /* don't trust partition table */
-               struct ext2context **context) {
-    uint32_t i;
-    int n;
-    (*context) = (struct ext2context *)malloc(sizeof(struct ext2context));
-    (*context)->part_start = part_start;
-    block_read(part_start+2, (*context)->sysbuf);
-    memcpy(&(*context)->superblock, (*context)->sysbuf, sizeof(struct superblock));
-    
-    if((*context)->superblock.s_magic != EXT2_SUPER_MAGIC) {
-        free((*context));
+/**
+ * \brief Read an inode structure from the inode table.
+ *
+ * Locates the inode table sector holding the requested inode and copies the inode out of it.
+ * No lock is taken, the copy is retried if the sector was rewritten while it was being read.
+ *
+ * \param context The ext2 filesystem context for the mounted volume.
+ * \param inode The inode number to read.
+ * \param in Pointer to storage for the inode.
+ * \returns 0 on success, -1 if the inode number is out of range or the inode can't be read.
+ **/
+static int ext2_read_inode(struct ext2context *context, uint32_t inode, struct inode *in) {
+    uint8_t buf[512];
+    struct block_group_descriptor bg;
+    uint32_t inode_block, offset;
+  
+    /* check for a bad inode number */
+    if((inode > context->superblock.s_inodes_count) || (inode == 0)) {
         return -1;
     }
-    if(((*context)->superblock.s_blocks_count << (*context)->superblock.s_log_block_size) >
-        volume_size
-    ) {
-        free((*context));
+        
+    if(ext2_get_bg_descriptor(context, &bg, (inode - 1) / context->superblock.s_inodes_per_group)) {
         return -1;
     }
-        
-    if((*context)->superblock.s_log_block_size == 0) {
-        (*context)->superblock_block = 1;
-    } else {
-        (*context)->superblock_block = 0;
+    ext2_inode_position(context, &bg, inode, &inode_block, &offset);
+    if(ext2_read_inode_sector(context, inode, inode_block, buf)) {
+        return -1;
     }
   
-    if(((*context)->superblock.s_rev_level == 1) && 
-        ((*context)->superblock.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
-        (*context)->sparse = 1;
-    } else {
-        (*context)->sparse = 0;
-    }
+    memcpy(in, &buf[offset], sizeof(struct inode));
   
-    (*context)->read_only = block_get_device_read_only();
-    (*context)->num_blockgroups = ((*context)->superblock.s_blocks_count /
-                                   (*context)->superblock.s_blocks_per_group);
-    if((*context)->superblock.s_blocks_count % (*context)->superblock.s_blocks_per_group) {
-        (*context)->num_blockgroups++;
+    return 0;
+}
+
+int ext2_flush_inode(struct file_ent *fe) {
+    uint8_t buf[512];
+    uint32_t inode_block, offset;
+    int r;
+    // now load the block group descriptor for that block group
+    struct block_group_descriptor bg;
+
+    if(fe->flags & (EXT2_FLAG_FS_DIRTY | EXT2_FLAG_TIME_DIRTY)) {
+        ext2_get_bg_descriptor(fe->context, &bg, (fe->inode_number - 1) / fe->context->superblock.s_inodes_per_group);
+        ext2_inode_position(fe->context, &bg, fe->inode_number, &inode_block, &offset);
+    
+        // other inodes share this sector so the read-modify-write must not interleave
+        ext2_lock(ext2_inode_lock(fe->context, fe->inode_number));
+        ext2_seq_write_begin(ext2_inode_seq(fe->context, fe->inode_number));
+        r = ext2_fetch_inode_sector(fe->context, inode_block, buf);
+        if(r == 0) {
+            memcpy(&buf[offset], &fe->inode, sizeof(struct inode));
+            r = ext2_store_inode_sector(fe->context, inode_block, buf);
+        }
+        ext2_seq_write_end(ext2_inode_seq(fe->context, fe->inode_number));
+        ext2_unlock(ext2_inode_lock(fe->context, fe->inode_number));
+        if(r) {
+            fe->rerrno = EIO;
+            return -1;
+        }
+    
+        fe->flags &= ~(EXT2_FLAG_FS_DIRTY | EXT2_FLAG_TIME_DIRTY);
     }
+  
+    return 0;
+}
+
+/**
+ * \brief Free the blocks below an indirect block from a logical index on.
+ *
+ * When first is 0 nothing on the disk points at the indirect block any more, so it and
+ * everything below it is simply freed.  Otherwise it stays: the entry first falls in is trimmed
+ * one level down, then the entries past it are cleared and each sector written before the blocks
+ * they pointed at are freed.  After a power cut the map then never points at a block the bitmap
+ * calls free, which another file could have been given.
+ *
+ * \param depth 1 if the entries of block are data blocks, 2 or 3 for further levels.
+ * \param first Index of the first block to free, counted from the first block block maps.
+ * \param copy Space for one sector of entries while they are freed, shared by every level.
+ **/
+static int ext2_free_indirect(struct file_ent *fe, struct ext2_free_batch *batch, uint32_t block, int depth,
+                              uint32_t first, uint32_t *copy) {
+    uint32_t indirect_entries = ext2_block_size(fe->context) / 4;
+    uint32_t sector_entries = sizeof(fe->buffer.buffer) / 4;
+    uint32_t cover = (depth == 3) ? indirect_entries * indirect_entries : (depth == 2) ? indirect_entries : 1;
+    uint32_t i, j, n, entry;
+    int r = 0;
     
-    if((*context)->sparse) {
-        (*context)->num_superblocks = 0;
-        for(i=0;i<(*context)->num_blockgroups;i++) {
-            if((i == 0) || (i == 1) || is_power(3, i) || is_power(5, i) || is_power(7, i)) {
-                (*context)->num_superblocks++;
+    if(first == 0) {
+        for(i=0;i<indirect_entries;i++) {
+            // entries come a sector at a time, or again after a lower level has used the buffer
+            if(ext2_load_buffer(fe, block, i * 4)) {
+                return -1;
             }
-        }
-        (*context)->superblock_blocks = (uint32_t *)malloc(sizeof(uint32_t) * (*context)->num_superblocks);
-        n = 0;
-        for(i=0;i<(*context)->num_blockgroups;i++) {
-            if((i == 0) || (i == 1) || is_power(3, i) || is_power(5, i) || is_power(7, i)) {
-                (*context)->superblock_blocks[n++] = i * (*context)->superblock.s_blocks_per_group + (*context)->superblock_block;
+            ext2_read_buffer(&entry, &fe->buffer, i * 4, 4);
+            if(entry == 0) {
+                continue;       // files may have holes, keep looking
+            }
+            if(depth > 1) {
+                r |= ext2_free_indirect(fe, batch, entry, depth - 1, 0, copy);
+            } else {
+                r |= ext2_free_block(fe->context, batch, entry);
             }
         }
-    } else {
-        (*context)->num_superblocks = (*context)->num_blockgroups;
-        (*context)->superblock_blocks = (uint32_t *)malloc(sizeof(uint32_t) * (*context)->num_superblocks);
-        for(i=0;i<(*context)->num_superblocks;i++) {
-            (*context)->superblock_blocks[i] = i * (*context)->superblock.s_blocks_per_group + (*context)->superblock_block;
+        return r | ext2_free_block(fe->context, batch, block);
+    }
+    
+    i = first / cover;
+    if(first % cover) {
+        if(ext2_load_buffer(fe, block, i * 4)) {
+            return -1;
+        }
+        ext2_read_buffer(&entry, &fe->buffer, i * 4, 4);
+        if(entry) {
+            r |= ext2_free_indirect(fe, batch, entry, depth - 1, first % cover, copy);
+        }
+        i++;
+    }
+    for(;i<indirect_entries;i=j) {
+        j = (i / sector_entries + 1) * sector_entries;
+        if(ext2_load_buffer(fe, block, i * 4)) {
+            return -1;
+        }
+        ext2_read_buffer(copy, &fe->buffer, i * 4, (j - i) * 4);
+        for(n=0;(n < j - i) && (copy[n] == 0);n++);
+        if(n == j - i) {
+            continue;           // nothing mapped by the rest of this sector
+        }
+        entry = 0;
+        for(n=0;n<j - i;n++) {
+            ext2_write_buffer(&fe->buffer, &entry, (i + n) * 4, 4);
+        }
+        if(ext2_store_buffer(fe)) {
+            return -1;
+        }
+        for(n=0;n<j - i;n++) {
+            if(copy[n] && (depth > 1)) {
+                r |= ext2_free_indirect(fe, batch, copy[n], depth - 1, 0, copy);
+            } else if(copy[n]) {
+                r |= ext2_free_block(fe->context, batch, copy[n]);
+            }
         }
     }
+    return r;
+}
+
+/**
+ * \brief Free every block of the open file from a logical block index on.
+ *
+ * Indirect blocks left with no entries are freed too and i_blocks is reduced to match.  The
+ * entries going are taken out of the map, and the inode written with whatever it loses, before
+ * any of the blocks are freed, so the inode should already have its new size.
+ *
+ * \returns 0 on success, 1 if some of the blocks were free already, -1 on error.
+ **/
+static int ext2_free_from(struct file_ent *fe, uint32_t first) {
+    struct ext2_free_batch batch;
+    uint32_t copy[sizeof(fe->buffer.buffer) / 4];
+    uint32_t detached[15];
+    uint64_t indirect_entries = ext2_block_size(fe->context) / 4;
+    uint64_t base, size;
+    uint32_t i;
+    int r = 0;
     
-//     printf("\nSuperblocks at\n  ");
-//     for(i=0;i<(*context)->num_superblocks;i++) {
-//         printf("%" PRIu32 " ", (*context)->superblock_blocks[i]);
-//     }
-//     printf("\n");
+    fe->map_block = 0;
+    if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+        return -1;
+    }
+    ext2_free_begin(&batch, 0);
+    // indirect blocks that keep some entries clear the rest themselves
+    for(i=0,base=12,size=indirect_entries;i<3;i++,base+=size,size*=indirect_entries) {
+        if(fe->inode.i_block[12 + i] && (first > base) && (first < base + size)) {
+            r |= ext2_free_indirect(fe, &batch, fe->inode.i_block[12 + i], i + 1, first - base, copy);
+        }
+    }
+    // then the inode's own entries, it is written without them before they are freed
+    memset(detached, 0, sizeof(detached));
+    for(i=0,base=12,size=indirect_entries;(r >= 0) && (i<15);i++) {
+        if(((i < 12) && (i >= first)) || ((i >= 12) && (first <= base))) {
+            detached[i] = fe->inode.i_block[i];
+            fe->inode.i_block[i] = 0;
+        }
+        if(i >= 12) {
+            base += size;
+            size *= indirect_entries;
+        }
+    }
+    fe->flags |= EXT2_FLAG_FS_DIRTY;
+    if((r >= 0) && ext2_flush_inode(fe)) {
+        // left out of the map, fsck will find them
+        r = -1;
+    }
+    for(i=0;(r >= 0) && (i<15);i++) {
+        if(detached[i] && (i < 12)) {
+            r |= ext2_free_block(fe->context, &batch, detached[i]);
+        } else if(detached[i]) {
+            r |= ext2_free_indirect(fe, &batch, detached[i], i - 11, 0, copy);
+        }
+    }
+    if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+        r = -1;
+    }
+    r |= ext2_free_flush(fe->context, &batch);
+    // the buffer may hold a sector of a block that is free now
+    fe->buffer.valid = 0;
+    fe->inode.i_blocks = (fe->inode.i_blocks > batch.total * (ext2_block_size(fe->context) / 512)) ?
+                         fe->inode.i_blocks - batch.total * (ext2_block_size(fe->context) / 512) : 0;
+    fe->flags |= EXT2_FLAG_FS_DIRTY;
+    return (r < 0) ? -1 : r;
+}
 
-    (*context)->superblock.s_mtime = time(NULL);
-    (*context)->superblock.s_mnt_count++;
-    if((*context)->superblock.s_state == EXT2_ERROR_FS) {
-        printf("Not properly unmounted, should run e2fsck\n");
-    } else if((*context)->superblock.s_mnt_count > (*context)->superblock.s_max_mnt_count) {
-        printf("Routine maintenance, should run e2fsck\n");
+int ext2_truncate_file(struct file_ent *fe) {
+    int r;
+    fe->inode.i_size = 0;
+    r = ext2_free_from(fe, 0);
+    fe->inode.i_blocks = 0;
+    return r;
+}
+
+static void ext2_stat_inode(struct ext2context *context, uint32_t inode_number,
+                            struct inode *in, struct stat *st) {
+    st->st_dev = 0;
+    st->st_ino = inode_number;
+    st->st_mode = in->i_mode;
+    st->st_nlink = in->i_links_count;   /* number of hard links to the file */
+    st->st_uid = in->i_uid;
+    st->st_gid = in->i_gid;
+    st->st_rdev = 0;
+    st->st_size = in->i_size;
+    st->st_atime = in->i_atime;
+    st->st_mtime = in->i_mtime;
+    st->st_ctime = in->i_ctime;
+    st->st_blksize = ext2_block_size(context);
+    st->st_blocks = in->i_blocks;
+}
+
+int ext2_open_inode(struct file_ent *fe, uint32_t inode) {
+    if(ext2_read_inode(fe->context, inode, &fe->inode)) {
+        return -1;
     }
-    (*context)->superblock.s_state = EXT2_ERROR_FS;
-    
-    /* mount count and the fact that the filesystem is currently mounted should be written to
-     * disk immediately. */
-    ext2_flush_superblock((*context));
+    if(!fe->buffer.dirty) {
+        fe->buffer.valid = 0;
+    }
+  
+    fe->inode_number = inode;
+    fe->flags = EXT2_FLAG_READ;
+    fe->cursor = 0;
+    fe->map_block = 0;
+#if EXT2_FILE_READAHEAD > 0
+    fe->ra_next_sector = 0;
+    if(fe->readahead) {
+        fe->readahead->count = 0;
+        fe->readahead->window = 2;
+        fe->readahead->map[0].valid = fe->readahead->map[1].valid = fe->readahead->map[2].valid = 0;
+    }
+#endif
+  
     return 0;
 }
 
-int ext2_umount(struct ext2context *context) {
-    context->superblock.s_state = EXT2_VALID_FS;
-    ext2_flush_superblock(context);
-    
-    free(context->superblock_blocks);
-    free(context);
-    
+/**
+ * \brief Re-read the inode of an open handle and take its inode lock.
+ *
+ * Used by internal callers that need exclusive use of an inode for a read-modify-write
+ * sequence, e.g. appending an entry to a directory.  The in-memory copy is refreshed after the
+ * lock is taken so changes made by other threads before the lock was acquired are not lost.
+ * The lock is released by ext2_close() once the inode has been written back.
+ *
+ * Lock free readers of the inode and its contents (path lookups) only wait while a sector of
+ * it is being written, each write must leave the contents consistent.  With rewrite set they
+ * wait from here until ext2_close() instead, for changes that take several writes to make
+ * sense (e.g. moving entries between the sectors of a directory).  The handle must then not
+ * look up paths or open files until it is closed.
+ *
+ * \param vfe The open file handle.
+ * \param rewrite Non zero to keep lock free readers out until the handle is closed.
+ * \returns 0 on success, -1 on error.
+ **/
+int ext2_lock_inode(void *vfe, int rewrite) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    ext2_lock(ext2_inode_lock(fe->context, fe->inode_number));
+    if(ext2_read_inode(fe->context, fe->inode_number, &fe->inode)) {
+        ext2_unlock(ext2_inode_lock(fe->context, fe->inode_number));
+        return -1;
+    }
+    fe->map_block = 0;
+    fe->flags |= EXT2_FLAG_LOCKED;
+    if(rewrite) {
+        ext2_seq_write_begin(ext2_inode_seq(fe->context, fe->inode_number));
+        fe->flags |= EXT2_FLAG_REWRITE;
+    }
     return 0;
 }
 
-void *ext2_open(struct ext2context *context, const char *name, int flags, int mode, 
-                           int *rerrno) {
-    int i, ino, internal_call = mode & 01000;
-    mode = mode & 0777;
-    char *local_path = NULL, *local_name = NULL;
-    struct file_ent *fe = (struct file_ent *)malloc(sizeof(struct file_ent));
-    if(fe == NULL) {
-        (*rerrno) = ENOMEM;
-        return NULL;
+static const uint8_t ext2_ft_to_dt[] = {
+    DT_UNKNOWN, DT_REG, DT_DIR, DT_CHR, DT_BLK, DT_FIFO, DT_SOCK, DT_LNK
+};
+
+/**
+ * \brief Read the next entry from an open directory into caller owned storage.
+ *
+ * Unused entries (inode 0) are skipped.  On volumes with the filetype feature d_type is filled
+ * from the directory entry so walkers can tell directories from files without reading the inode,
+ * otherwise it is DT_UNKNOWN.  The handle's cursor is left at the start of the next
+ * record so ext2_telldir() returns a cookie for it.  Internal scans call this directly, callers
+ * outside the library go through ext2_readdir_r() which adds inode readahead.
+ *
+ * \returns 0 on success (including end of directory), -1 on error.
+ **/
+static int ext2_next_dirent(struct file_ent *fe, struct dirent *entry, struct dirent **result,
+                            int *rerrno) {
+    struct ext2_dir_header dh;
+    int64_t pos;
+  
+    *result = NULL;
+    if(!(fe->inode.i_mode & EXT2_S_IFDIR)) {
+        *rerrno = ENOTDIR;
+        return -1;
     }
-    memset(fe, 0, sizeof(struct file_ent));
-    fe->magic = EMBEXT_MAGIC;
-    fe->context = context;
-    ino = ext2_lookup_path(fe, name, rerrno);
-    i = ext2_open_inode(fe, ino);
-    if((flags & O_RDWR)) {
-        fe->flags |= (EXT2_FLAG_READ | EXT2_FLAG_WRITE);
-    } else {
-        if((flags & O_WRONLY) == 0) {
-            fe->flags |= EXT2_FLAG_READ;
-        } else {
-            fe->flags |= EXT2_FLAG_WRITE;
+    
+    while(fe->cursor < fe->inode.i_size) {
+        pos = fe->cursor;
+        if(ext2_read(fe, &dh, sizeof(dh), rerrno) < (int)sizeof(dh)) {
+            return -1;
+        }
+        if((dh.rec_len < sizeof(dh)) || (dh.rec_len % 4) || (dh.name_len > dh.rec_len - sizeof(dh))) {
+            /* a corrupt record length would have us loop forever or read past the block */
+            *rerrno = EIO;
+            return -1;
+        }
+        if(dh.inode == 0) {
+            fe->cursor = pos + dh.rec_len;
+            continue;
+        }
+        if(ext2_read(fe, entry->d_name, dh.name_len, rerrno) < dh.name_len) {
+            return -1;
+        }
+        entry->d_name[dh.name_len] = 0;
+        entry->d_ino = dh.inode;
+        entry->d_type = DT_UNKNOWN;
+        if((fe->context->superblock.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) &&
+            (dh.file_type < sizeof(ext2_ft_to_dt))) {
+            entry->d_type = ext2_ft_to_dt[dh.file_type];
         }
+        fe->cursor = pos + dh.rec_len;
+        *result = entry;
+        return 0;
     }
-  
-    if(flags & O_APPEND) {
-        fe->flags |= EXT2_FLAG_APPEND;
-    }
-    if((i == -1) && ((*rerrno) == ENOENT)) {
-        /* file doesn't exist */
-        if((flags & (O_CREAT)) == 0) {
-            /* tried to open a non-existent file with no create */
-            fe->magic = 0;
-            free(fe);
-            (*rerrno) = ENOENT;
-            return NULL;
-        } else {
-            /* opening a new file for writing */
-            /* only create files in directories that aren't read only */
-            if(fe->context->read_only) {
-                fe->magic = 0;
-                free(fe);
-                (*rerrno) = EROFS;
-                return NULL;
+    return 0;
+}
+
+int ext2_lookup_path(struct file_ent *fe, const char *path, int *rerrno) {
+    char local_path[MAX_PATH_LEN];
+    char *elements[MAX_PATH_LEVELS];
+    int levels = 0;
+    uint32_t ino = EXT2_ROOT_INO;
+    uint32_t seq;
+    struct dirent entry;
+    struct dirent *de;
+    int i;
+  
+    strncpy(local_path, path, sizeof(local_path));
+    local_path[MAX_PATH_LEN-1] = 0;
+  
+    if((elements[levels] = strtok(local_path, "/"))) {
+        while(++levels < MAX_PATH_LEVELS) {
+            if(!(elements[levels] = strtok(NULL, "/"))) {
+                break;
             }
-            if(ext2_allocate_inode(fe)) {
-                fe->magic = 0;
-                *rerrno = fe->rerrno;
-                free(fe);
-                return NULL;
+        }
+    }
+  
+    for(i=0;i<levels;i++) {
+        /* scan the directory without locking it, if an entry was added while we were looking
+         * the directory is scanned again */
+        do {
+            seq = ext2_seq_read_begin(ext2_inode_seq(fe->context, ino));
+            if(ext2_open_inode(fe, ino)) {
+                *rerrno = ENOENT;
+                return -1;
             }
-            for(i=strlen(name)-1;i>-1;i--) {
-                if(name[i] == '/') {
-                    printf("Found last separator in\n%s\nat %d\n", name, i);
-                    local_path = (char *)malloc(i+1);
-                    local_name = (char *)malloc(strlen(name) - i);
-                    strncpy(local_path, name, i);
-                    local_path[i] = 0;
-                    strncpy(local_name, &name[i+1], strlen(name) - i);
+            while(ext2_next_dirent(fe, &entry, &de, rerrno) == 0) {
+                if((de == NULL) || (strcmp(de->d_name, elements[i]) == 0)) {
                     break;
                 }
             }
-            if(local_path == NULL) {
-                *rerrno = ENOENT;
-                fe->magic = 0;
-                free(fe);
-                return NULL;
-            }
-            if(ext2_append_to_directory(fe->context, local_path, fe->inode_number,
-                                        local_name, rerrno)) {
-                free(local_path);
-                free(local_name);
-                fe->magic = 0;
-                free(fe);
-                return NULL;
-            }
-            /* finished with these so free before they get forgotten */
-            free(local_path);
-            free(local_name);
-            /* allocated an inode in the bitmap and group/superblock counts */
-            /* now need to write the fields in the new inode */
-            fe->inode.i_mode = mode | EXT2_S_IFREG;
-            fe->inode.i_uid = getuid();
-            fe->inode.i_gid = getgid();
-            fe->inode.i_size = 0;
-            fe->inode.i_atime = time(NULL);
-            fe->inode.i_ctime = time(NULL);
-            fe->inode.i_mtime = time(NULL);
-            fe->inode.i_dtime = 0;
-            fe->inode.i_links_count = 1;
-            fe->inode.i_blocks = 0;
-            fe->inode.i_flags = 0;
-            fe->inode.i_osd1 = 0;
-            memset(fe->inode.i_block, 0, sizeof(fe->inode.i_block));
-            fe->inode.i_generation = 0;
-            fe->inode.i_file_acl = 0;
-            fe->inode.i_dir_acl = 0;
-            fe->inode.i_faddr = 0;
-            memset(fe->inode.i_osd2, 0, sizeof(fe->inode.i_osd2));
-            
-            ext2_print_inode(fe);
-            
-            fe->cursor = 0;
-            
-            fe->flags |= EXT2_FLAG_FS_DIRTY;
-            ext2_flush_inode(fe);
-            return fe;
+        } while(ext2_seq_read_retry(ext2_inode_seq(fe->context, ino), seq));
+        if(de == NULL) {
+            *rerrno = ENOENT;
+            return -1;
         }
-    } else if(i == 0) {
-        /* file does exist */
-        if((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
-            /* tried to force creation of an existing file */
-            free(fe);
-            (*rerrno) = EEXIST;
-            return NULL;
-        } else {
-            if((flags & (O_WRONLY | O_RDWR)) == 0) {
-                /* read existing file */
-                return fe;
-            } else {
-                /* file opened for write access, check permissions */
-                if(fe->context->read_only) {
-                    /* requested write on read only filesystem */
-                    free(fe);
-                    (*rerrno) = EROFS;
-                    return NULL;
-                }
-                // TODO read only permissions
-//         if(file_num[fd].attributes & FAT_ATT_RO) {
-//           /* The file is read-only refuse permission */
-//           free(fe);
-//           (*rerrno) = EACCES;
-//           return NULL;
-//         }
-                if((fe->inode.i_mode & EXT2_S_IFDIR) && (!internal_call)) {
-                    /* Tried to open a directory for writing */
-                    free(fe);
-                    (*rerrno) = EISDIR;
-                    return NULL;
-                }
-                if(flags & O_TRUNC) {
-                    /* Need to truncate the file to zero length */
-                    ext2_truncate_file(fe);
-                    fe->cursor = 0;
-                }
-                return fe;
+        ino = de->d_ino;
+    }
+
+    // right, ino is now the inode of the target file/directory
+    return ino;//ext2_open_inode(fe, ino);
+}
+
+/**
+ * \brief Address sectors of the volume in place, if the block driver keeps them in memory.
+ *
+ * Anything this handle still has to write to those sectors is written first so the view is
+ * current.
+ *
+ * \returns a read only pointer to count sectors or NULL if they have to be read.
+ **/
+static const uint8_t *ext2_sector_ptr(struct file_ent *fe, uint32_t lba_block, uint32_t count) {
+    uint32_t i;
+    if(fe->buffer.dirty && (fe->buffer.lba_block >= lba_block) && (fe->buffer.lba_block < lba_block + count) &&
+        ext2_store_buffer(fe)) {
+        return NULL;
+    }
+    for(i=0;i<count;i++) {
+        ext2_stream_settle(fe, lba_block + i);
+    }
+    ext2_nb_drain(fe->context, lba_block + fe->context->part_start, count);
+    return (const uint8_t *)block_get_ptr(lba_block + fe->context->part_start, count);
+}
+
+/**
+ * \brief Read entry index of the block map (indirect) block block.
+ *
+ * With map NULL the sector is loaded into the handle's own buffer and always re-read, like any
+ * other metadata.  A private map buffer is only re-read when it holds a different sector, which
+ * lets a caller map a run of blocks reading each indirect sector once.
+ *
+ * \returns the entry, 0 if the map block itself is not allocated or can't be read.
+ **/
+static uint32_t ext2_read_map_entry(struct file_ent *fe, struct buffer_object *map,
+                                    uint32_t block, uint32_t index) {
+    uint32_t entry;
+    uint32_t lba_block;
+    const uint8_t *p;
+    
+    if(block == 0) {
+        return 0;
+    }
+    lba_block = block * (ext2_block_size(fe->context) / block_get_block_size());
+    lba_block += ((index * 4) / sizeof(map->buffer)) * (sizeof(map->buffer) / block_get_block_size());
+    if((p = ext2_sector_ptr(fe, lba_block, 1)) != NULL) {
+        memcpy(&entry, &p[(index * 4) % sizeof(map->buffer)], 4);
+        return entry;
+    }
+    if(map == NULL) {
+        if(ext2_load_buffer(fe, block, index * 4)) {
+            return 0;
+        }
+        map = &fe->buffer;
+    } else {
+        if(!map->valid || (map->lba_block != lba_block)) {
+            if(ext2_block_read(fe->context, lba_block + fe->context->part_start, map->buffer)) {
+                map->valid = 0;
+                return 0;
             }
+            map->lba_block = lba_block;
+            map->valid = 1;
+        }
+    }
+    ext2_read_buffer(&entry, map, index * 4, 4);
+    return entry;
+}
+
+/**
+ * \brief Translate a logical block index of the open file to a block number on the volume.
+ *
+ * \param map NULL or one private buffer per level of indirection, see ext2_read_map_entry().
+ * \param span Set to the number of blocks from block_index on that are unallocated for the same
+ *             reason (a missing indirect block covers many), always 1 for an allocated block.
+ * \returns the block number, 0 for an unallocated block.
+ **/
+static uint32_t ext2_map_lookup(struct file_ent *fe, uint32_t block_index, struct buffer_object *map,
+                                uint32_t *span) {
+    uint32_t block;
+    uint32_t indirect_entries = (ext2_block_size(fe->context) / 4);
+    
+    *span = 1;
+    if(block_index < 12) {
+        return fe->inode.i_block[block_index];
+    }
+    block_index -= 12;
+    if(block_index < indirect_entries) {
+        if((block = ext2_read_map_entry(fe, map, fe->inode.i_block[12], block_index)) == 0) {
+            *span = fe->inode.i_block[12] ? 1 : indirect_entries - block_index;
+        }
+        return block;
+    }
+    block_index -= indirect_entries;
+    if(block_index < indirect_entries * indirect_entries) {
+        if((block = ext2_read_map_entry(fe, map, fe->inode.i_block[13], block_index / indirect_entries)) == 0) {
+            *span = fe->inode.i_block[13] ? indirect_entries - block_index % indirect_entries :
+                                            indirect_entries * indirect_entries - block_index;
+            return 0;
+        }
+        return ext2_read_map_entry(fe, map ? &map[1] : NULL, block, block_index % indirect_entries);
+    }
+    block_index -= indirect_entries * indirect_entries;
+    if((uint64_t)block_index < (uint64_t)indirect_entries * indirect_entries * indirect_entries) {
+        if((block = ext2_read_map_entry(fe, map, fe->inode.i_block[14], block_index / (indirect_entries * indirect_entries))) == 0) {
+            *span = fe->inode.i_block[14] ? indirect_entries * indirect_entries - block_index % (indirect_entries * indirect_entries) :
+                                            indirect_entries * indirect_entries * indirect_entries - block_index;
+            return 0;
+        }
+        if((block = ext2_read_map_entry(fe, map ? &map[1] : NULL, block, (block_index / indirect_entries) % indirect_entries)) == 0) {
+            *span = indirect_entries - block_index % indirect_entries;
+            return 0;
+        }
+        return ext2_read_map_entry(fe, map ? &map[2] : NULL, block, block_index % indirect_entries);
+    }
+    /* cursor past largest file size possible */
+    return -1;
+}
+
+/**
+ * \brief ext2_map_lookup() through the last block found, which is remembered in the handle.
+ *
+ * Small writes to the end of a file come back to the same block many times, without this each
+ * one would read the indirect sector into the handle's buffer, writing out and then reading back
+ * the sector being filled.
+ **/
+static uint32_t ext2_map_run(struct file_ent *fe, uint32_t block_index, struct buffer_object *map,
+                             uint32_t *span) {
+    uint32_t block;
+    
+    *span = 1;
+    if(fe->map_block && (fe->map_index == block_index)) {
+        return fe->map_block;
+    }
+    block = ext2_map_lookup(fe, block_index, map, span);
+    if(block && (block != (uint32_t)-1)) {
+        fe->map_index = block_index;
+        fe->map_block = block;
+    }
+    return block;
+}
+
+static uint32_t ext2_map_block(struct file_ent *fe, uint32_t block_index, struct buffer_object *map) {
+    uint32_t span;
+    return ext2_map_run(fe, block_index, map, &span);
+}
+
+static uint32_t ext2_block_from_offset(struct file_ent *fe, uint64_t offset) {
+    return ext2_map_block(fe, offset / ext2_block_size(fe->context), NULL);
+}
+
+/**
+ * \brief Allocate a block for the block map of the file and clear it.
+ *
+ * Map blocks go wherever the first free block is rather than after the data, so they don't break
+ * up the run (or allocation unit) the data is being written into.
+ *
+ * \returns the block number or 0 on error.
+ **/
+static uint32_t ext2_new_map_block(struct file_ent *fe) {
+    uint32_t block;
+    uint32_t sectors_per_block = ext2_block_size(fe->context) / sizeof(fe->buffer.buffer);
+    
+    if((block = ext2_allocate_block(fe, 0)) == 0) {
+        return 0;
+    }
+    fe->inode.i_blocks += ext2_block_size(fe->context) / 512;
+    fe->flags |= EXT2_FLAG_FS_DIRTY;
+    if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+        return 0;
+    }
+    fe->buffer.valid = 0;
+    if(ext2_block_zero(fe->context, block * sectors_per_block + fe->context->part_start, sectors_per_block)) {
+        fe->rerrno = EIO;
+        return 0;
+    }
+    return block;
+}
+
+/**
+ * \brief Point up to count logical blocks of the open file from block_index at consecutive blocks
+ * on the volume from block.
+ *
+ * Only the entries held in the same map sector as the first are set, so a run is written into
+ * the map a sector at a time.  Any indirect blocks missing on the way are allocated, cleared and
+ * counted in i_blocks, the caller counts the data blocks themselves.  Entries are written through
+ * the handle's buffer, which is left dirty.
+ *
+ * \returns the number of blocks set, -1 on error.
+ **/
+static int ext2_set_blocks(struct file_ent *fe, uint32_t block_index, uint32_t block, uint32_t count) {
+    uint32_t indirect_entries = (ext2_block_size(fe->context) / 4);
+    uint32_t offsets[3];
+    uint32_t parent, entry, i;
+    int depth, level, root;
+    
+    fe->map_block = 0;
+    if(block_index < 12) {
+        for(i=0;(i<count) && (block_index + i < 12);i++) {
+            fe->inode.i_block[block_index + i] = block + i;
         }
+        fe->flags |= EXT2_FLAG_FS_DIRTY;
+        return i;
+    }
+    block_index -= 12;
+    if(block_index < indirect_entries) {
+        root = 12;
+        depth = 1;
+        offsets[0] = block_index;
+    } else if((block_index -= indirect_entries) < indirect_entries * indirect_entries) {
+        root = 13;
+        depth = 2;
+        offsets[0] = block_index / indirect_entries;
+        offsets[1] = block_index % indirect_entries;
+    } else if((uint64_t)(block_index -= indirect_entries * indirect_entries) <
+              (uint64_t)indirect_entries * indirect_entries * indirect_entries) {
+        root = 14;
+        depth = 3;
+        offsets[0] = block_index / (indirect_entries * indirect_entries);
+        offsets[1] = (block_index / indirect_entries) % indirect_entries;
+        offsets[2] = block_index % indirect_entries;
     } else {
-        free(fe);
-        return NULL;
+        fe->rerrno = EFBIG;
+        return -1;
+    }
+    
+    if(fe->inode.i_block[root] == 0) {
+        if((fe->inode.i_block[root] = ext2_new_map_block(fe)) == 0) {
+            return -1;
+        }
+    }
+    parent = fe->inode.i_block[root];
+    for(level=0;level<depth - 1;level++) {
+        if(ext2_load_buffer(fe, parent, offsets[level] * 4)) {
+            return -1;
+        }
+        ext2_read_buffer(&entry, &fe->buffer, offsets[level] * 4, 4);
+        if(entry == 0) {
+            if((entry = ext2_new_map_block(fe)) == 0) {
+                return -1;
+            }
+            if(ext2_load_buffer(fe, parent, offsets[level] * 4)) {
+                return -1;
+            }
+            ext2_write_buffer(&fe->buffer, &entry, offsets[level] * 4, 4);
+        }
+        parent = entry;
+    }
+    if(ext2_load_buffer(fe, parent, offsets[level] * 4)) {
+        return -1;
     }
+    for(i=0;(i<count) && (offsets[level] % (sizeof(fe->buffer.buffer) / 4) + i < sizeof(fe->buffer.buffer) / 4);i++) {
+        entry = block + i;
+        ext2_write_buffer(&fe->buffer, &entry, (offsets[level] + i) * 4, 4);
+    }
+    return i;
 }
 
-int ext2_close(void *vfe, int *rerrno) {
+#if EXT2_FILE_READAHEAD > 0
+/**
+ * \brief Fill the readahead window with the sectors of the file starting at sector.
+ *
+ * The window holds logically consecutive sectors of the file.  Each block is looked up in the
+ * block map so fragmented files are read correctly, and every physically contiguous run is
+ * fetched with one multi-block request.  All the runs are submitted before waiting for any of
+ * them so a driver with a request queue can keep them in flight together.  The window stops
+ * early at the end of the file, at an unallocated block or at a failed read.  Anything the handle
+ * has yet to write is written first so the window doesn't miss it.
+ **/
+static void ext2_readahead_fill(struct file_ent *fe, uint32_t sector) {
+    struct file_readahead *ra = fe->readahead;
+    uint32_t sectors_per_block = ext2_block_size(fe->context) / sizeof(fe->buffer.buffer);
+    uint32_t file_sectors = (fe->inode.i_size + sizeof(fe->buffer.buffer) - 1) / sizeof(fe->buffer.buffer);
+    uint32_t block = 0;
+    uint32_t count, run, i, n;
+    
+    ra->count = 0;
+    if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+        return;
+    }
+    ra->first_sector = sector;
+    for(count=0;(count < ra->window) && (sector + count < file_sectors);count++) {
+        if((count == 0) || ((sector + count) % sectors_per_block == 0)) {
+            block = ext2_map_block(fe, (sector + count) / sectors_per_block, ra->map);
+            if((block == 0) || (block == (uint32_t)-1)) {
+                break;
+            }
+        }
+        ra->lba_block[count] = block * sectors_per_block + (sector + count) % sectors_per_block;
+        ra->writes[count] = ext2_write_count(fe->context, ra->lba_block[count] + fe->context->part_start);
+    }
+    for(i=0,n=0;i<count;i+=run,n++) {
+        for(run=1;(i + run < count) && (ra->lba_block[i + run] == ra->lba_block[i] + run);run++);
+        ra->req[n].op = BLOCK_OP_READ;
+        ra->req[n].block = ra->lba_block[i] + fe->context->part_start;
+        ra->req[n].count = run;
+        ra->req[n].buf = &ra->data[i * sizeof(fe->buffer.buffer)];
+        ra->req[n].callback = NULL;
+        ext2_nb_drain(fe->context, ra->req[n].block, run);
+        while(block_submit(&ra->req[n])) {
+            block_poll();
+        }
+    }
+    // the window ends at the first run that failed
+    ra->count = count;
+    for(i=0;i<n;i++) {
+        if(block_wait(&ra->req[i]) && (ra->count == count)) {
+            ra->count = ((uint8_t *)ra->req[i].buf - ra->data) / sizeof(fe->buffer.buffer);
+        }
+    }
+}
+
+/**
+ * \brief Load the sector under the cursor from the readahead window.
+ *
+ * Reading the sector straight after the last one read counts as sequential access: the window
+ * is (re)filled from the cursor, doubling in size up to #EXT2_FILE_READAHEAD sectors each time it
+ * runs out.  Any other sector shrinks the window back to its starting size and is left to the
+ * normal single sector path.  A sector written (by any handle) since the window was read is
+ * taken as missing from it.  Directories are never read ahead, nor is anything read by the
+ * non-blocking calls, which have their own transfers in flight.
+ *
+ * \returns 0 if the handle's buffer now holds the sector, -1 if the caller must load it.
+ **/
+static int ext2_readahead_select(struct file_ent *fe) {
+    struct file_readahead *ra = fe->readahead;
+    uint32_t sector = fe->cursor / sizeof(fe->buffer.buffer);
+    uint32_t file_sectors = (fe->inode.i_size + sizeof(fe->buffer.buffer) - 1) / sizeof(fe->buffer.buffer);
+    uint32_t index;
+    
+    if((fe->inode.i_mode & EXT2_S_IFDIR) || ext2_nb_active(fe->context)) {
+        return -1;
+    }
+    if(ra && (sector >= ra->first_sector) && (sector - ra->first_sector < ra->count) &&
+        (ra->writes[sector - ra->first_sector] ==
+         ext2_write_count(fe->context, ra->lba_block[sector - ra->first_sector] + fe->context->part_start))) {
+        index = sector - ra->first_sector;
+    } else if((sector == fe->ra_next_sector) && (file_sectors - sector > 2)) {
+        if(ra == NULL) {
+            if((ra = (struct file_readahead *)malloc(sizeof(struct file_readahead))) == NULL) {
+                return -1;
+            }
+            memset(ra->map, 0, sizeof(ra->map));
+            ra->count = 0;
+            ra->window = 2;
+            fe->readahead = ra;
+        } else if(ra->count && (sector == ra->first_sector + ra->count)) {
+            // ran off the end of the last window, the reader is streaming
+            ra->window = (ra->window * 2 > EXT2_FILE_READAHEAD) ? EXT2_FILE_READAHEAD : ra->window * 2;
+        }
+        ext2_readahead_fill(fe, sector);
+        if(ra->count == 0) {
+            return -1;
+        }
+        index = 0;
+    } else {
+        if(sector + 1 != fe->ra_next_sector) {
+            // not just another read from the last sector, so the access is random
+            if(ra) {
+                ra->window = 2;
+            }
+            fe->ra_next_sector = sector + 1;
+        }
+        return -1;
+    }
+    
+    fe->ra_next_sector = sector + 1;
+    if(ext2_buffer_current(fe, ra->lba_block[index])) {
+        return 0;
+    }
+    if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+        return -1;
+    }
+    fe->buffer_writes = ext2_write_count(fe->context, ra->lba_block[index] + fe->context->part_start);
+    memcpy(fe->buffer.buffer, &ra->data[index * sizeof(fe->buffer.buffer)], sizeof(fe->buffer.buffer));
+    fe->buffer.lba_block = ra->lba_block[index];
+    fe->buffer.valid = 1;
+    return 0;
+}
+#endif
+
+#if EXT2_STREAM_BUFFERS > 0
+/**
+ * \brief Queue reads of the sectors of the file from first to last that aren't on their way.
+ *
+ * Stops at the end of the file, at an unallocated block, when every buffer is in use or when
+ * the driver's queue is full.
+ **/
+static void ext2_stream_queue(struct file_ent *fe, uint32_t first, uint32_t last) {
+    struct file_stream *st = fe->stream;
+    uint32_t sectors_per_block = ext2_block_size(fe->context) / sizeof(fe->buffer.buffer);
+    uint32_t file_sectors = (fe->inode.i_size + sizeof(fe->buffer.buffer) - 1) / sizeof(fe->buffer.buffer);
+    uint32_t next, block;
+    int i;
+    
+    for(next=first;(next <= last) && (next < file_sectors);next++) {
+        for(i=0;i<EXT2_STREAM_BUFFERS;i++) {
+            if((st->state[i] == EXT2_STREAM_READING) && (st->sector[i] == next)) {
+                break;
+            }
+        }
+        if(i < EXT2_STREAM_BUFFERS) {
+            continue;
+        }
+        for(i=0;(i<EXT2_STREAM_BUFFERS) && (st->state[i] != EXT2_STREAM_EMPTY);i++);
+        if(i == EXT2_STREAM_BUFFERS) {
+            break;
+        }
+        block = ext2_map_block(fe, next / sectors_per_block, st->map);
+        if((block == 0) || (block == (uint32_t)-1)) {
+            break;
+        }
+        st->req[i].op = BLOCK_OP_READ;
+        st->req[i].block = block * sectors_per_block + next % sectors_per_block + fe->context->part_start;
+        st->req[i].count = 1;
+        st->req[i].buf = st->data[i];
+        st->req[i].callback = NULL;
+        // the sector on disk has to be up to date before it is read, so changes this handle
+        // still holds for it are written first
+        if(fe->buffer.valid && fe->buffer.dirty &&
+            ((fe->buffer.lba_block + fe->context->part_start) == st->req[i].block) && ext2_store_buffer(fe)) {
+            break;
+        }
+        ext2_stream_settle(fe, st->req[i].block - fe->context->part_start);
+        ext2_nb_drain(fe->context, st->req[i].block, 1);
+        st->writes[i] = ext2_write_count(fe->context, st->req[i].block);
+        if(block_submit(&st->req[i])) {
+            break;
+        }
+        st->state[i] = EXT2_STREAM_READING;
+        st->sector[i] = next;
+    }
+}
+
+/**
+ * \brief Serve the sector under the cursor from the stream and queue the sectors after it.
+ *
+ * A streaming reader keeps the next #EXT2_STREAM_BUFFERS sectors of the file in flight, each
+ * buffer being refilled as soon as its sector has been handed over, so the device is fetching
+ * while the application works through the data.  Reads outside that window (after a seek) are
+ * abandoned and the window starts again from the cursor.
+ *
+ * \returns 0 if the handle's buffer now holds the sector, -1 if the caller must load it.
+ **/
+static int ext2_stream_select(struct file_ent *fe) {
+    struct file_stream *st = fe->stream;
+    uint32_t sector = fe->cursor / sizeof(fe->buffer.buffer);
+    int i, hit = -1;
+    
+    if((fe->inode.i_mode & EXT2_S_IFDIR) || ext2_nb_active(fe->context)) {
+        return -1;
+    }
+    if((sector == st->held_sector) && ext2_buffer_current(fe, st->held_lba)) {
+        // still working through the last sector handed over, just keep the queue topped up
+        ext2_stream_queue(fe, sector + 1, sector + EXT2_STREAM_BUFFERS);
+        return 0;
+    }
+    for(i=0;i<EXT2_STREAM_BUFFERS;i++) {
+        if((st->state[i] == EXT2_STREAM_READING) &&
+            ((st->sector[i] < sector) || (st->sector[i] > sector + EXT2_STREAM_BUFFERS))) {
+            ext2_stream_finish(fe, i);
+        }
+    }
+    ext2_stream_queue(fe, sector, sector);
+    for(i=0;i<EXT2_STREAM_BUFFERS;i++) {
+        if((st->state[i] == EXT2_STREAM_READING) && (st->sector[i] == sector)) {
+            hit = i;
+        }
+    }
+    if(hit >= 0) {
+        // a write to the sector since the read was queued means the copy may be stale
+        if(ext2_stream_finish(fe, hit) || (fe->buffer.dirty && ext2_store_buffer(fe)) ||
+            (ext2_write_count(fe->context, st->req[hit].block) != st->writes[hit])) {
+            hit = -1;
+        } else {
+            fe->buffer_writes = st->writes[hit];
+            memcpy(fe->buffer.buffer, st->data[hit], sizeof(fe->buffer.buffer));
+            fe->buffer.lba_block = st->req[hit].block - fe->context->part_start;
+            fe->buffer.valid = 1;
+            st->held_sector = sector;
+            st->held_lba = fe->buffer.lba_block;
+        }
+    }
+    ext2_stream_queue(fe, sector + 1, sector + EXT2_STREAM_BUFFERS);
+    return (hit >= 0) ? 0 : -1;
+}
+
+/**
+ * \brief Write the full sector in the handle's buffer in the background.
+ *
+ * The data is copied to the next stream buffer in turn and submitted, waiting only if that
+ * buffer's last write hasn't finished yet, so the application can fill the handle's buffer
+ * again while the device writes.
+ **/
+static int ext2_stream_store(struct file_ent *fe) {
+    struct file_stream *st = fe->stream;
+    int i = st->next;
+    
+    ext2_stream_settle(fe, fe->buffer.lba_block);
+    ext2_stream_finish(fe, i);
+    if(st->error) {
+        fe->rerrno = st->error;
+        return -1;
+    }
+    memcpy(st->data[i], fe->buffer.buffer, sizeof(fe->buffer.buffer));
+    st->req[i].op = BLOCK_OP_WRITE;
+    st->req[i].block = fe->buffer.lba_block + fe->context->part_start;
+    st->req[i].count = 1;
+    st->req[i].buf = st->data[i];
+    st->req[i].callback = NULL;
+    ext2_nb_drain(fe->context, st->req[i].block, 1);
+    while(block_submit(&st->req[i])) {
+        block_poll();
+    }
+    st->state[i] = EXT2_STREAM_WRITING;
+    st->next = (i + 1) % EXT2_STREAM_BUFFERS;
+    fe->buffer.dirty = 0;
+    return 0;
+}
+
+/**
+ * \brief Finish everything a stream has in flight and release it.
+ *
+ * \returns 0 or the error of a streamed write that failed.
+ **/
+static int ext2_stream_stop(struct file_ent *fe) {
+    int i, error;
+    for(i=0;i<EXT2_STREAM_BUFFERS;i++) {
+        ext2_stream_finish(fe, i);
+    }
+    error = fe->stream->error;
+    free(fe->stream);
+    fe->stream = NULL;
+    return error;
+}
+
+/**
+ * \brief Turn streaming on or off for an open file.
+ *
+ * A streaming handle is meant for long sequential transfers such as audio playback or logging.
+ * Reads keep the next #EXT2_STREAM_BUFFERS sectors in flight and each full sector written is
+ * handed to the block layer without waiting for it, so with a block driver that queues
+ * requests the transfers overlap with the application's own work.  Data written through a
+ * stream reaches the disk when the buffers are reused, when streaming is turned off or when the
+ * file is closed, and a failed write is reported by whichever of those comes next.
+ *
+ * \param vfe An open handle on a regular file.
+ * \param enable Non zero to start streaming, 0 to stop.
+ * \param rerrno Set to the error code on failure.
+ * \returns 0 on success, -1 on error.
+ **/
+int ext2_set_stream(void *vfe, int enable, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    int error;
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(enable) {
+        if(fe->inode.i_mode & EXT2_S_IFDIR) {
+            *rerrno = EISDIR;
+            return -1;
+        }
+        if(fe->stream == NULL) {
+            if((fe->stream = (struct file_stream *)malloc(sizeof(struct file_stream))) == NULL) {
+                *rerrno = ENOMEM;
+                return -1;
+            }
+            memset(fe->stream, 0, sizeof(struct file_stream));
+            fe->stream->held_sector = (uint32_t)-1;
+        }
+    } else if(fe->stream && ((error = ext2_stream_stop(fe)) != 0)) {
+        *rerrno = error;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * \brief Load the sector under the cursor from whatever the handle has read ahead.
+ *
+ * \returns 0 if the handle's buffer now holds the sector, -1 if the caller must load it.
+ **/
+static int ext2_prefetch_select(struct file_ent *fe) {
+#if EXT2_STREAM_BUFFERS > 0
+    if(fe->stream) {
+        return ext2_stream_select(fe);
+    }
+#endif
+#if EXT2_FILE_READAHEAD > 0
+    return ext2_readahead_select(fe);
+#else
+    (void)fe;
+    return -1;
+#endif
+}
+
+/**
+ * \brief Forget what the readahead window and stream hold before the file is changed.
+ *
+ * \param writes Non-zero to also wait for streamed writes, e.g. before their blocks are freed.
+ **/
+static void ext2_prefetch_drop(struct file_ent *fe, int writes) {
+#if EXT2_STREAM_BUFFERS > 0
+    int i;
+#endif
+#if EXT2_FILE_READAHEAD > 0
+    if(fe->readahead) {
+        fe->readahead->count = 0;
+        fe->readahead->map[0].valid = fe->readahead->map[1].valid = fe->readahead->map[2].valid = 0;
+    }
+#endif
+#if EXT2_STREAM_BUFFERS > 0
+    if(fe->stream) {
+        for(i=0;i<EXT2_STREAM_BUFFERS;i++) {
+            if(writes || (fe->stream->state[i] == EXT2_STREAM_READING)) {
+                ext2_stream_finish(fe, i);
+            }
+        }
+        fe->stream->map[0].valid = fe->stream->map[1].valid = fe->stream->map[2].valid = 0;
+    }
+#else
+    (void)writes;
+#endif
+}
+
+/**
+ * \brief Get the sector of the file under the cursor into the handle's buffer.
+ *
+ * \param allocate Non-zero to give a hole a block of its own (for writing), otherwise holes are
+ *                 left alone for the caller to read as zeros.
+ * \returns 0 when the buffer holds the sector, 1 for a hole that wasn't allocated, -1 on error.
+ **/
+int ext2_select_buffer(struct file_ent *fe, int allocate) {
+    uint32_t block_size = ext2_block_size(fe->context);
+    uint32_t block = ext2_block_from_offset(fe, fe->cursor);
+    uint32_t new_block, lba_block, cursor_lba, i, count;
+    uint32_t previous_block;
+    uint64_t start, end;
+    
+    if(ext2_nb_deferred(fe->context)) {
+        // the block map wasn't at hand, a zero here doesn't mean a hole
+        return -1;
+    }
+    if(block == (uint32_t)-1) {
+        fe->rerrno = EFBIG;
+        return -1;
+    }
+    if(block) {
+        return ext2_select_sector(fe, block, fe->cursor) ? -1 : 0;
+    }
+    if(!allocate) {
+        return 1;
+    }
+    if(!(fe->flags & EXT2_FLAG_WRITE)) {
+        return -1;
+    }
+    previous_block = (fe->cursor >= block_size) ? ext2_block_from_offset(fe, fe->cursor - block_size) : 0;
+    new_block = ext2_allocate_block(fe, previous_block);
+    if(!new_block) {
+        return -1;
+    }
+    if(ext2_set_blocks(fe, fe->cursor / block_size, new_block, 1) < 0) {
+        return -1;
+    }
+    fe->map_index = fe->cursor / block_size;
+    fe->map_block = new_block;
+    fe->inode.i_blocks += block_size / 512;
+    fe->flags |= EXT2_FLAG_FS_DIRTY;
+    
+    // whatever the block last held must not show through, clear the sectors that are (or are
+    // about to be) inside the file and start the one under the cursor off empty (and dirty, the
+    // device still has the old contents)
+    if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+        return -1;
+    }
+    memset(fe->buffer.buffer, 0, sizeof(fe->buffer.buffer));
+    fe->buffer.valid = 0;
+    lba_block = new_block * (block_size / sizeof(fe->buffer.buffer)) + fe->context->part_start;
+    i = (fe->cursor % block_size) / sizeof(fe->buffer.buffer);
+    start = fe->cursor - fe->cursor % block_size;
+    end = ((uint64_t)fe->cursor > fe->inode.i_size) ? (uint64_t)fe->cursor : fe->inode.i_size;
+    count = (end > start) ? (end - start + sizeof(fe->buffer.buffer) - 1) / sizeof(fe->buffer.buffer) : 0;
+    if(count > block_size / sizeof(fe->buffer.buffer)) {
+        count = block_size / sizeof(fe->buffer.buffer);
+    }
+    if(((i > 0) && ext2_block_zero(fe->context, lba_block, (count < i) ? count : i)) ||
+        ((count > i + 1) && ext2_block_zero(fe->context, lba_block + i + 1, count - i - 1))) {
+        fe->rerrno = EIO;
+        return -1;
+    }
+    cursor_lba = lba_block - fe->context->part_start + i;
+    fe->buffer_writes = ext2_write_count(fe->context, cursor_lba + fe->context->part_start);
+    fe->buffer.lba_block = cursor_lba;
+    fe->buffer.valid = 1;
+    fe->buffer.dirty = 1;
+    return 0;
+}
+
+/**
+ * \brief Clear the file from position up to end, or to the end of the block position is in.
+ *
+ * Used when the end of the file moves past bytes that must read back as zeros (a write past the
+ * end, ftruncate) but the end of the last block may still hold whatever was there before.
+ * Blocks after it are holes, or cleared when they are allocated.  The exception is blocks
+ * preallocated past the end by ext2_fallocate(), when the handle has some of those every
+ * allocated block up to end is cleared.
+ **/
+static int ext2_zero_tail(struct file_ent *fe, uint64_t position, uint64_t end) {
+    uint32_t block_size = ext2_block_size(fe->context);
+    uint32_t block, amount, span;
+    uint64_t next;
+    
+    while((position < end) && ((position % block_size) || (fe->flags & EXT2_FLAG_PREALLOC))) {
+        block = ext2_map_run(fe, position / block_size, NULL, &span);
+        if(ext2_nb_deferred(fe->context)) {
+            return -1;
+        }
+        if(block == (uint32_t)-1) {
+            break;
+        }
+        next = position - position % block_size + (uint64_t)span * block_size;
+        while(block && (position < end) && (position < next)) {
+            amount = sizeof(fe->buffer.buffer) - position % sizeof(fe->buffer.buffer);
+            if(amount > end - position) {
+                amount = end - position;
+            }
+            if(ext2_select_sector(fe, block, position)) {
+                return -1;
+            }
+            memset(&fe->buffer.buffer[position % sizeof(fe->buffer.buffer)], 0, amount);
+            fe->buffer.dirty = 1;
+            position += amount;
+        }
+        position = next;
+    }
+    return 0;
+}
+
+int is_power(int x, int ofy) {
+    while((x % ofy ) == 0) {
+        x /= ofy;
+    }
+    return x == 1;
+}
+
+/**
+ * callable file access routines
+ */
+
+int ext2_mount(blockno_t part_start, blockno_t volume_size, 
+               uint8_t filesystem_hint __attribute__((__unused__)), /* don't trust partition table */
+               struct ext2context **context) {
+    uint8_t buf[512];
+    uint32_t i;
+    int n;
+    struct block_group_descriptor bg;
+    (*context) = (struct ext2context *)malloc(sizeof(struct ext2context));
+    (*context)->part_start = part_start;
+    block_read(part_start+2, buf);
+    memcpy(&(*context)->superblock, buf, sizeof(struct superblock));
+    
+    if((*context)->superblock.s_magic != EXT2_SUPER_MAGIC) {
+        free((*context));
+        return -1;
+    }
+    if(((*context)->superblock.s_blocks_count << (*context)->superblock.s_log_block_size) >
+        volume_size
+    ) {
+        free((*context));
+        return -1;
+    }
+        
+    if((*context)->superblock.s_log_block_size == 0) {
+        (*context)->superblock_block = 1;
+    } else {
+        (*context)->superblock_block = 0;
+    }
+  
+    if(((*context)->superblock.s_rev_level == 1) && 
+        ((*context)->superblock.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        (*context)->sparse = 1;
+    } else {
+        (*context)->sparse = 0;
+    }
+  
+    (*context)->read_only = block_get_device_read_only();
+    // units only help if whole filesystem blocks line up with them
+    i = ext2_block_size((*context)) / block_get_block_size();
+    (*context)->au_blocks = block_get_au_size() / i;
+    if(((*context)->au_blocks < 2) || (block_get_au_size() % i) || (part_start % i)) {
+        (*context)->au_blocks = 0;
+    }
+    (*context)->au_next = 0;
+    memset((*context)->writes, 0, sizeof((*context)->writes));
+    (*context)->open_files = NULL;
+    (*context)->num_blockgroups = ((*context)->superblock.s_blocks_count /
+                                   (*context)->superblock.s_blocks_per_group);
+    if((*context)->superblock.s_blocks_count % (*context)->superblock.s_blocks_per_group) {
+        (*context)->num_blockgroups++;
+    }
+    
+    if((*context)->sparse) {
+        (*context)->num_superblocks = 0;
+        for(i=0;i<(*context)->num_blockgroups;i++) {
+            if((i == 0) || (i == 1) || is_power(3, i) || is_power(5, i) || is_power(7, i)) {
+                (*context)->num_superblocks++;
+            }
+        }
+        (*context)->superblock_blocks = (uint32_t *)malloc(sizeof(uint32_t) * (*context)->num_superblocks);
+        n = 0;
+        for(i=0;i<(*context)->num_blockgroups;i++) {
+            if((i == 0) || (i == 1) || is_power(3, i) || is_power(5, i) || is_power(7, i)) {
+                (*context)->superblock_blocks[n++] = i * (*context)->superblock.s_blocks_per_group + (*context)->superblock_block;
+            }
+        }
+    } else {
+        (*context)->num_superblocks = (*context)->num_blockgroups;
+        (*context)->superblock_blocks = (uint32_t *)malloc(sizeof(uint32_t) * (*context)->num_superblocks);
+        for(i=0;i<(*context)->num_superblocks;i++) {
+            (*context)->superblock_blocks[i] = i * (*context)->superblock.s_blocks_per_group + (*context)->superblock_block;
+        }
+    }
+    
+//     printf("\nSuperblocks at\n  ");
+//     for(i=0;i<(*context)->num_superblocks;i++) {
+//         printf("%" PRIu32 " ", (*context)->superblock_blocks[i]);
+//     }
+//     printf("\n");
+
+#ifdef EMBEXT_BG_CACHE
+    (*context)->bg_cache = (struct ext2_bg_cache_entry *)malloc(sizeof(struct ext2_bg_cache_entry) *
+                                                                (*context)->num_blockgroups);
+    for(i=0;i<(*context)->num_blockgroups;i++) {
+        if((i % (block_get_block_size() / sizeof(struct block_group_descriptor))) == 0) {
+            block_read(((((*context)->superblock_block + 1) << ((*context)->superblock.s_log_block_size + 1)) +
+                        i / (block_get_block_size() / sizeof(struct block_group_descriptor))) + part_start, buf);
+        }
+        memcpy(&(*context)->bg_cache[i].bg,
+               &buf[sizeof(struct block_group_descriptor) * (i % (block_get_block_size() / sizeof(struct block_group_descriptor)))],
+               sizeof(struct block_group_descriptor));
+        (*context)->bg_cache[i].seq = (ext2_seq_t)EXT2_SEQ_INIT;
+    }
+#endif
+#if EXT2_INODE_CACHE_SECTORS > 0
+    memset((*context)->inode_cache, 0, sizeof((*context)->inode_cache));
+    (*context)->inode_cache_data = (uint8_t *)malloc(EXT2_INODE_CACHE_SECTORS * 512);
+    (*context)->inode_cache_next = 0;
+    ext2_lock_init(&(*context)->inode_cache_lock);
+#endif
+#if EXT2_DISCARD_RANGES > 0
+    (*context)->discard_count = 0;
+    ext2_lock_init(&(*context)->discard_lock);
+#endif
+#ifdef EMBEXT_THREADSAFE
+    (*context)->bg_locks = (ext2_lock_t *)malloc(sizeof(ext2_lock_t) * (*context)->num_blockgroups);
+    for(i=0;i<(*context)->num_blockgroups;i++) {
+        ext2_lock_init(&(*context)->bg_locks[i]);
+    }
+    ext2_lock_init(&(*context)->sb_lock);
+    ext2_lock_init(&(*context)->orphan_lock);
+    ext2_lock_init(&(*context)->open_lock);
+    for(i=0;i<EXT2_INODE_LOCKS;i++) {
+        ext2_lock_init(&(*context)->inode_slots[i].lock);
+        (*context)->inode_slots[i].seq = (ext2_seq_t)EXT2_SEQ_INIT;
+    }
+#endif
+
+#ifdef EMBEXT_NONBLOCK
+    (*context)->nb_slots = (struct ext2_nb_slot *)malloc(sizeof(struct ext2_nb_slot) * EXT2_NB_SLOTS);
+    memset((*context)->nb_slots, 0, sizeof(struct ext2_nb_slot) * EXT2_NB_SLOTS);
+    (*context)->nb_clock = 0;
+    (*context)->nb_start = 0;
+    (*context)->nb_mode = EXT2_NB_OFF;
+    (*context)->nb_deferred = 0;
+    (*context)->nb_error = 0;
+#endif
+
+    (*context)->superblock.s_mtime = time(NULL);
+    (*context)->superblock.s_mnt_count++;
+    if((*context)->superblock.s_state == EXT2_ERROR_FS) {
+        printf("Not properly unmounted, should run e2fsck\n");
+        /* the superblock's free counts are only written now and then, the group descriptors
+         * are kept up to date so count again from those */
+        (*context)->superblock.s_free_blocks_count = 0;
+        (*context)->superblock.s_free_inodes_count = 0;
+        for(i=0;i<(*context)->num_blockgroups;i++) {
+            ext2_get_bg_descriptor((*context), &bg, i);
+            (*context)->superblock.s_free_blocks_count += bg.bg_free_blocks_count;
+            (*context)->superblock.s_free_inodes_count += bg.bg_free_inodes_count;
+        }
+    } else if((*context)->superblock.s_mnt_count > (*context)->superblock.s_max_mnt_count) {
+        printf("Routine maintenance, should run e2fsck\n");
+    }
+    (*context)->superblock.s_state = EXT2_ERROR_FS;
+    
+    /* mount count and the fact that the filesystem is currently mounted should be written to
+     * disk immediately. */
+    ext2_flush_superblock((*context));
+    return 0;
+}
+
+int ext2_umount(struct ext2context *context) {
+    (void)ext2_discard_flush(context);
+    context->superblock.s_state = EXT2_VALID_FS;
+    ext2_flush_superblock(context);
+    
+#ifdef EMBEXT_NONBLOCK
+    int n;
+    for(n=0;n<EXT2_NB_SLOTS;n++) {
+        ext2_nb_complete(context, &context->nb_slots[n], 1);
+    }
+    free(context->nb_slots);
+#endif
+    block_sync();
+
+#ifdef EMBEXT_THREADSAFE
+    uint32_t i;
+    for(i=0;i<context->num_blockgroups;i++) {
+        ext2_lock_destroy(&context->bg_locks[i]);
+    }
+    free(context->bg_locks);
+    ext2_lock_destroy(&context->sb_lock);
+    ext2_lock_destroy(&context->orphan_lock);
+    ext2_lock_destroy(&context->open_lock);
+    for(i=0;i<EXT2_INODE_LOCKS;i++) {
+        ext2_lock_destroy(&context->inode_slots[i].lock);
+    }
+#endif
+#ifdef EMBEXT_BG_CACHE
+    free(context->bg_cache);
+#endif
+#if EXT2_DISCARD_RANGES > 0
+    ext2_lock_destroy(&context->discard_lock);
+#endif
+#if EXT2_INODE_CACHE_SECTORS > 0
+    ext2_lock_destroy(&context->inode_cache_lock);
+    free(context->inode_cache_data);
+#endif
+    free(context->superblock_blocks);
+    free(context);
+    
+    return 0;
+}
+
+/**
+ * \brief Add a handle ext2_open() is about to return to the volume's list of open handles.
+ **/
+static void *ext2_track_open(struct file_ent *fe) {
+    ext2_lock(ext2_open_lock(fe->context));
+    fe->next_open = fe->context->open_files;
+    fe->context->open_files = fe;
+    ext2_unlock(ext2_open_lock(fe->context));
+    return fe;
+}
+
+/**
+ * \brief Count the handles open on an inode, leaving out except.
+ **/
+static int ext2_open_count(struct ext2context *context, uint32_t inode_number, struct file_ent *except) {
+    struct file_ent *fe;
+    int n = 0;
+    
+    ext2_lock(ext2_open_lock(context));
+    for(fe=context->open_files;fe;fe=fe->next_open) {
+        if((fe != except) && (fe->inode_number == inode_number)) {
+            n++;
+        }
+    }
+    ext2_unlock(ext2_open_lock(context));
+    return n;
+}
+
+void *ext2_open(struct ext2context *context, const char *name, int flags, int mode, 
+                           int *rerrno) {
+    int i, ino, internal_call = mode & 01000;
+    mode = mode & 0777;
+    char *local_path = NULL, *local_name = NULL;
+    struct file_ent *fe = (struct file_ent *)malloc(sizeof(struct file_ent));
+    if(fe == NULL) {
+        (*rerrno) = ENOMEM;
+        return NULL;
+    }
+    memset(fe, 0, sizeof(struct file_ent));
+    fe->magic = EMBEXT_MAGIC;
+    fe->context = context;
+    ino = ext2_lookup_path(fe, name, rerrno);
+    i = ext2_open_inode(fe, ino);
+    if(ext2_nb_deferred(context)) {
+        /* non-blocking open, the lookup is repeated once the sectors it needs have arrived */
+        fe->magic = 0;
+        free(fe);
+        (*rerrno) = EINPROGRESS;
+        return NULL;
+    }
+    /* everything past the lookup completes in one go */
+    ext2_nb_commit(context);
+    if((flags & O_RDWR)) {
+        fe->flags |= (EXT2_FLAG_READ | EXT2_FLAG_WRITE);
+    } else {
+        if((flags & O_WRONLY) == 0) {
+            fe->flags |= EXT2_FLAG_READ;
+        } else {
+            fe->flags |= EXT2_FLAG_WRITE;
+        }
+    }
+  
+    if(flags & O_APPEND) {
+        fe->flags |= EXT2_FLAG_APPEND;
+    }
+    if((i == -1) && ((*rerrno) == ENOENT)) {
+        /* file doesn't exist */
+        if((flags & (O_CREAT)) == 0) {
+            /* tried to open a non-existent file with no create */
+            fe->magic = 0;
+            free(fe);
+            (*rerrno) = ENOENT;
+            return NULL;
+        } else {
+            /* opening a new file for writing */
+            /* only create files in directories that aren't read only */
+            if(fe->context->read_only) {
+                fe->magic = 0;
+                free(fe);
+                (*rerrno) = EROFS;
+                return NULL;
+            }
+            if(ext2_allocate_inode(fe)) {
+                fe->magic = 0;
+                *rerrno = fe->rerrno;
+                free(fe);
+                return NULL;
+            }
+            for(i=strlen(name)-1;i>-1;i--) {
+                if(name[i] == '/') {
+                    printf("Found last separator in\n%s\nat %d\n", name, i);
+                    local_path = (char *)malloc(i+1);
+                    local_name = (char *)malloc(strlen(name) - i);
+                    strncpy(local_path, name, i);
+                    local_path[i] = 0;
+                    strncpy(local_name, &name[i+1], strlen(name) - i);
+                    break;
+                }
+            }
+            if(local_path == NULL) {
+                *rerrno = ENOENT;
+                fe->magic = 0;
+                free(fe);
+                return NULL;
+            }
+            if(ext2_append_to_directory(fe->context, local_path, fe->inode_number,
+                                        local_name, EXT2_FT_REG_FILE, rerrno)) {
+                free(local_path);
+                free(local_name);
+                fe->magic = 0;
+                free(fe);
+                return NULL;
+            }
+            /* finished with these so free before they get forgotten */
+            free(local_path);
+            free(local_name);
+            /* allocated an inode in the bitmap and group/superblock counts */
+            /* now need to write the fields in the new inode */
+            fe->inode.i_mode = mode | EXT2_S_IFREG;
+            fe->inode.i_uid = getuid();
+            fe->inode.i_gid = getgid();
+            fe->inode.i_size = 0;
+            fe->inode.i_atime = time(NULL);
+            fe->inode.i_ctime = time(NULL);
+            fe->inode.i_mtime = time(NULL);
+            fe->inode.i_dtime = 0;
+            fe->inode.i_links_count = 1;
+            fe->inode.i_blocks = 0;
+            fe->inode.i_flags = 0;
+            fe->inode.i_osd1 = 0;
+            memset(fe->inode.i_block, 0, sizeof(fe->inode.i_block));
+            fe->map_block = 0;
+            fe->inode.i_generation = 0;
+            fe->inode.i_file_acl = 0;
+            fe->inode.i_dir_acl = 0;
+            fe->inode.i_faddr = 0;
+            memset(fe->inode.i_osd2, 0, sizeof(fe->inode.i_osd2));
+            
+            ext2_print_inode(fe);
+            
+            fe->cursor = 0;
+            
+            fe->flags |= EXT2_FLAG_FS_DIRTY;
+            ext2_flush_inode(fe);
+            return ext2_track_open(fe);
+        }
+    } else if(i == 0) {
+        /* file does exist */
+        if((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+            /* tried to force creation of an existing file */
+            free(fe);
+            (*rerrno) = EEXIST;
+            return NULL;
+        } else {
+            if((flags & (O_WRONLY | O_RDWR)) == 0) {
+                /* read existing file */
+                return ext2_track_open(fe);
+            } else {
+                /* file opened for write access, check permissions */
+                if(fe->context->read_only) {
+                    /* requested write on read only filesystem */
+                    free(fe);
+                    (*rerrno) = EROFS;
+                    return NULL;
+                }
+                // TODO read only permissions
+//         if(file_num[fd].attributes & FAT_ATT_RO) {
+//           /* The file is read-only refuse permission */
+//           free(fe);
+//           (*rerrno) = EACCES;
+//           return NULL;
+//         }
+                if((fe->inode.i_mode & EXT2_S_IFDIR) && (!internal_call)) {
+                    /* Tried to open a directory for writing */
+                    free(fe);
+                    (*rerrno) = EISDIR;
+                    return NULL;
+                }
+                if(flags & O_TRUNC) {
+                    /* Need to truncate the file to zero length */
+                    ext2_truncate_file(fe);
+                    fe->cursor = 0;
+                }
+                return ext2_track_open(fe);
+            }
+        }
+    } else {
+        free(fe);
+        return NULL;
+    }
+}
+
+int ext2_close(void *vfe, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    struct file_ent **prev;
+    int error = 0;
+    if(fe == NULL) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(fe->magic != EMBEXT_MAGIC) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(fe->buffer.dirty) {
+        if(ext2_store_buffer(fe)) {
+            *rerrno = fe->rerrno;
+            return -1;
+        }
+    }
+#if EXT2_STREAM_BUFFERS > 0
+    if(fe->stream) {
+        // the data is gone either way, the handle is still closed but the caller is told
+        error = ext2_stream_stop(fe);
+    }
+#endif
+    if((fe->flags & EXT2_FLAG_PREALLOC) &&
+        (ext2_free_from(fe, (fe->inode.i_size + ext2_block_size(fe->context) - 1) / ext2_block_size(fe->context)) < 0)) {
+        // blocks left past the end of the file, fsck will find them
+        error = fe->rerrno ? fe->rerrno : EIO;
+    }
+    if(fe->flags & (EXT2_FLAG_FS_DIRTY | EXT2_FLAG_TIME_DIRTY)) {
+        if(ext2_flush_inode(fe)) {
+            *rerrno = fe->rerrno;
+            return -1;
+        }
+    }
+    if(fe->flags & EXT2_FLAG_LOCKED) {
+        if(fe->flags & EXT2_FLAG_REWRITE) {
+            ext2_seq_write_end(ext2_inode_seq(fe->context, fe->inode_number));
+        }
+        ext2_unlock(ext2_inode_lock(fe->context, fe->inode_number));
+    }
+    if(fe->dirent) {
+        free(fe->dirent);
+    }
+#if EXT2_FILE_READAHEAD > 0
+    if(fe->readahead) {
+        free(fe->readahead);
+    }
+#endif
+    ext2_lock(ext2_open_lock(fe->context));
+    for(prev=&fe->context->open_files;*prev && (*prev != fe);prev=&(*prev)->next_open);
+    if(*prev) {
+        *prev = fe->next_open;
+    }
+    ext2_unlock(ext2_open_lock(fe->context));
+    ext2_print_inode(fe);
+    fe->magic = 0;
+    free(fe);
+    if(error) {
+        *rerrno = error;
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef EMBEXT_NONBLOCK
+static void ext2_nb_begin(struct ext2context *context) {
+    context->nb_start = context->nb_clock + 1;
+    context->nb_mode = EXT2_NB_TRY;
+    context->nb_deferred = 0;
+}
+
+static int ext2_nb_end(struct ext2context *context) {
+    int deferred = context->nb_deferred;
+    context->nb_mode = EXT2_NB_OFF;
+    context->nb_deferred = 0;
+    return deferred;
+}
+
+/**
+ * \brief Non-blocking ext2_open().
+ *
+ * Fails with EINPROGRESS instead of waiting for a sector the path lookup needs, the transfer is
+ * queued and the call should be repeated with the same arguments once block_poll() has made
+ * progress.  Creating or truncating a file, once the lookup has succeeded, is carried out in one
+ * go and may wait for the device; the writes involved are queued rather than waited for.
+ **/
+void *ext2_open_nb(struct ext2context *context, const char *name, int flags, int mode, int *rerrno) {
+    void *fe;
+    ext2_nb_begin(context);
+    fe = ext2_open(context, name, flags, mode, rerrno);
+    ext2_nb_end(context);
+    return fe;
+}
+
+/**
+ * \brief Non-blocking ext2_read().
+ *
+ * Copies what it can without waiting.  If the next sector isn't at hand its transfer is queued and
+ * the call returns the bytes copied so far, or fails with EINPROGRESS if there were none.
+ **/
+int ext2_read_nb(void *vfe, void *buffer, size_t count, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    int r;
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    ext2_nb_begin(fe->context);
+    r = ext2_read(fe, buffer, count, rerrno);
+    ext2_nb_end(fe->context);
+    return r;
+}
+
+/**
+ * \brief Non-blocking ext2_write().
+ *
+ * As ext2_read_nb(), a sector that has to be read before it can be modified (including the
+ * bitmap scan for a new block) is queued and the call returns early.  Written sectors are
+ * queued and not waited for.  Once a new block has been chosen the allocation is completed
+ * before returning, which may wait on the descriptor table.
+ **/
+int ext2_write_nb(void *vfe, const void *buffer, size_t count, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    int r;
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    ext2_nb_begin(fe->context);
+    r = ext2_write(fe, buffer, count, rerrno);
+    ext2_nb_end(fe->context);
+    return r;
+}
+
+/**
+ * \brief Non-blocking ext2_close().
+ *
+ * Queues the write back of the inode and the last sector, then fails with EINPROGRESS until
+ * every queued write on the volume has completed.  The handle stays valid until the call
+ * succeeds.  A queued write that failed is reported here as EIO.
+ **/
+int ext2_close_nb(void *vfe, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    struct ext2context *context;
+    int i, busy;
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    context = fe->context;
+    ext2_nb_begin(context);
+    if(ext2_flush_inode(fe) == 0) {
+        if(fe->buffer.dirty) {
+            ext2_store_buffer(fe);
+        }
+    }
+    if(ext2_nb_end(context)) {
+        *rerrno = EINPROGRESS;
+        return -1;
+    }
+    block_poll();
+    busy = 0;
+    for(i=0;i<EXT2_NB_SLOTS;i++) {
+        ext2_nb_complete(context, &context->nb_slots[i], 0);
+        if(context->nb_slots[i].state == EXT2_NB_WRITING) {
+            busy = 1;
+        }
+    }
+    if(busy) {
+        *rerrno = EINPROGRESS;
+        return -1;
+    }
+    if(context->nb_error) {
+        *rerrno = context->nb_error;
+        context->nb_error = 0;
+        ext2_close(fe, &i);
+        return -1;
+    }
+    return ext2_close(fe, rerrno);
+}
+#endif
+
+int ext2_read(void *vfe, void *buffer, size_t count, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    uint32_t i=0;
+    uint32_t amount_to_copy;
+    uint8_t *bt = (uint8_t *)buffer;
+    int hole = 0;
+    /* make sure this is an open file and it can be read */  
+    if(fe == NULL) {
+        (*rerrno) = EBADF;
+        return -1;
+    }
+    if(fe->magic != EMBEXT_MAGIC) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    /* copy some bytes to the buffer requested */
+    while(i < count) {
+        if(fe->cursor >= fe->inode.i_size) {
+            break;   /* end of file */
+        }
+        /* check the right part of the right block is in the buffer (might not be e.g. after a seek */
+        if(ext2_prefetch_select(fe) && ((hole = ext2_select_buffer(fe, 0)) < 0)) {
+            if(ext2_nb_deferred(fe->context)) {
+                break;      /* non-blocking call, the sector is on its way */
+            }
+            *rerrno = EIO;
+            return -1;
+        }
+        amount_to_copy = ((count - i) > ext2_buffer_space(fe)) ?
+                                    ext2_buffer_space(fe) : (count - i);
+        amount_to_copy = (amount_to_copy > (fe->inode.i_size - fe->cursor)) ?
+                                    (fe->inode.i_size - fe->cursor) : amount_to_copy;
+        if(hole > 0) {
+            /* nothing allocated here, reads as zeros */
+            memset(&bt[i], 0, amount_to_copy);
+            hole = 0;
+        } else {
+            ext2_read_buffer(&bt[i], &fe->buffer, fe->cursor % ext2_block_size(fe->context), amount_to_copy);
+        }
+        fe->cursor += amount_to_copy;
+        i += amount_to_copy;
+    }
+    if(i > 0) {
+        ext2_update_atime(fe);
+    } else if(ext2_nb_deferred(fe->context)) {
+        *rerrno = EINPROGRESS;
+        return -1;
+    }
+    return i;
+}
+
+/**
+ * \brief Read from a file without copying the data.
+ *
+ * Gives a read only view of up to count bytes from the cursor and moves the cursor past them.
+ * When the block driver keeps the volume in memory (see block_get_ptr()) the view points
+ * straight at the volume and covers as much of the request as is contiguous on it.  Otherwise
+ * the sector is read into the handle's buffer as ext2_read() would and the view covers at most
+ * the rest of that sector.  Either way the view is only valid until the next call on the handle
+ * or the next write to the file, so call again for the rest of a longer request.
+ *
+ * \param vfe An open file.
+ * \param ptr Set to the start of the data.
+ * \param count The most bytes wanted.
+ * \param rerrno Set to the error code on failure.
+ * \returns the number of bytes at *ptr, 0 at the end of the file or -1 on error.
+ **/
+int ext2_read_ptr(void *vfe, const void **ptr, size_t count, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    uint32_t block_size, index, block, next, lba_block, sectors;
+    uint64_t avail;
+    const uint8_t *p;
+    
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(fe->cursor >= fe->inode.i_size) {
+        return 0;
+    }
+    if(count > (uint64_t)(fe->inode.i_size - fe->cursor)) {
+        count = fe->inode.i_size - fe->cursor;
+    }
+    block_size = ext2_block_size(fe->context);
+    index = fe->cursor / block_size;
+    block = ext2_map_block(fe, index, NULL);
+    if(block == (uint32_t)-1) {
+        *rerrno = EIO;
+        return -1;
+    }
+    if(block == 0) {
+        // a hole, the view is of a cleared buffer
+        if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+            *rerrno = EIO;
+            return -1;
+        }
+        memset(fe->buffer.buffer, 0, sizeof(fe->buffer.buffer));
+        fe->buffer.valid = 0;
+        if(count > ext2_buffer_space(fe)) {
+            count = ext2_buffer_space(fe);
+        }
+        *ptr = &fe->buffer.buffer[fe->cursor % sizeof(fe->buffer.buffer)];
+        fe->cursor += count;
+        ext2_update_atime(fe);
+        return count;
+    }
+    lba_block = block * (block_size / sizeof(fe->buffer.buffer)) + (fe->cursor % block_size) / sizeof(fe->buffer.buffer);
+    // take in the following blocks for as long as they follow on the volume
+    avail = block_size - fe->cursor % block_size;
+    while(avail < count) {
+        next = ext2_map_block(fe, ++index, NULL);
+        if(next != block + 1) {
+            break;
+        }
+        block = next;
+        avail += block_size;
+    }
+    if(avail > count) {
+        avail = count;
+    }
+    sectors = (fe->cursor % sizeof(fe->buffer.buffer) + avail + sizeof(fe->buffer.buffer) - 1) / sizeof(fe->buffer.buffer);
+    if((p = ext2_sector_ptr(fe, lba_block, sectors)) != NULL) {
+        *ptr = &p[fe->cursor % sizeof(fe->buffer.buffer)];
+    } else {
+        if(ext2_select_buffer(fe, 0)) {
+            *rerrno = EIO;
+            return -1;
+        }
+        if(avail > ext2_buffer_space(fe)) {
+            avail = ext2_buffer_space(fe);
+        }
+        *ptr = &fe->buffer.buffer[fe->cursor % sizeof(fe->buffer.buffer)];
+    }
+    fe->cursor += avail;
+    ext2_update_atime(fe);
+    return avail;
+}
+
+/**
+ * \brief Find where the data of a file lives on the volume.
+ *
+ * Describes the blocks holding bytes offset to offset + len - 1 of the file as runs that are
+ * contiguous both in the file and on the volume, so an application can move the data itself,
+ * e.g. with DMA straight from the card.  Unallocated ranges are reported as holes.  The runs
+ * are whole filesystem blocks, the first may start before offset and the last ends at the end
+ * of the file if that is reached, in which case it is also flagged #EXT2_EXTENT_LAST.  If the
+ * array fills up first call again from the end of the last run.
+ *
+ * \param vfe An open file.
+ * \param offset Where to start in the file.
+ * \param len How many bytes to describe, the rest of the file if that is less.
+ * \param extents Array to fill in.
+ * \param n Size of the extents array.
+ * \param rerrno Set to the error code on failure.
+ * \returns the number of runs filled in, 0 if offset is at or past the end of the file, -1 on error.
+ **/
+int ext2_fiemap(void *vfe, uint64_t offset, uint64_t len, struct ext2_extent *extents, int n,
+                int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    struct buffer_object *map;
+    struct ext2_extent *e = NULL;
+    uint32_t block_size, sectors_per_block, index, last, block, span;
+    uint64_t end;
+    int count = 0;
+    
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(n <= 0) {
+        *rerrno = EINVAL;
+        return -1;
+    }
+    if((len == 0) || (offset >= fe->inode.i_size)) {
+        return 0;
+    }
+    end = ((offset + len < offset) || (offset + len > fe->inode.i_size)) ? fe->inode.i_size : offset + len;
+    block_size = ext2_block_size(fe->context);
+    sectors_per_block = block_size / block_get_block_size();
+    index = offset / block_size;
+    last = (end - 1) / block_size;
+    // private map buffers so the handle's buffer is left alone, one per level of indirection
+    if((map = (struct buffer_object *)malloc(sizeof(struct buffer_object) * 3)) != NULL) {
+        map[0].valid = map[1].valid = map[2].valid = 0;
+    }
+    
+    while(index <= last) {
+        block = ext2_map_run(fe, index, map, &span);
+        if(block == (uint32_t)-1) {
+            break;
+        }
+        if(span > last - index + 1) {
+            span = last - index + 1;
+        }
+        if(e && (block == 0) && (e->flags & EXT2_EXTENT_HOLE)) {
+            e->length += (uint64_t)span * block_size;
+        } else if(e && block && !(e->flags & EXT2_EXTENT_HOLE) &&
+                  (e->physical + e->length / block_get_block_size() == (uint64_t)block * sectors_per_block + fe->context->part_start)) {
+            e->length += block_size;
+        } else if(count < n) {
+            e = &extents[count++];
+            e->logical = (uint64_t)index * block_size;
+            e->physical = block ? (uint64_t)block * sectors_per_block + fe->context->part_start : 0;
+            e->length = (uint64_t)span * block_size;
+            e->flags = block ? 0 : EXT2_EXTENT_HOLE;
+        } else {
+            break;
+        }
+        index += span;
+    }
+    if(e && (e->logical + e->length >= fe->inode.i_size)) {
+        e->length = fe->inode.i_size - e->logical;
+        e->flags |= EXT2_EXTENT_LAST;
+    }
+    free(map);
+    return count;
+}
+
+int ext2_write(void *vfe, const void *buffer, size_t count, 
+               int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    uint32_t i=0;
+    uint32_t amount_to_copy;
+    uint8_t *bt = (uint8_t *)buffer;
+    if(fe == NULL) {
+        (*rerrno) = EBADF;
+        return -1;
+    }
+    if(fe->magic != EMBEXT_MAGIC) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(!(fe->flags & EXT2_FLAG_WRITE)) {
+        (*rerrno) = EBADF;
+        return -1;
+    }
+    if(fe->flags & EXT2_FLAG_APPEND) {
+        if(ext2_lseek(fe, 0, SEEK_END, rerrno) == -1) {
+            return -1;
+        }
+    }
+    // the readahead window and map sectors may be about to go stale
+    ext2_prefetch_drop(fe, 0);
+    if((fe->cursor > fe->inode.i_size) && (count > 0) && ext2_zero_tail(fe, fe->inode.i_size, fe->cursor)) {
+        if(ext2_nb_deferred(fe->context)) {
+            *rerrno = EINPROGRESS;
+            return -1;
+        }
+        *rerrno = EIO;
+        return -1;
+    }
+    while(i < count) {
+        /* each sector written is a point where a non-blocking call can stop */
+        ext2_nb_checkpoint(fe->context);
+        /* make sure the right buffer is loaded, blocks skipped over are left as holes */
+        if(ext2_select_buffer(fe, 1)) {
+            if(ext2_nb_deferred(fe->context)) {
+                break;
+            }
+            *rerrno = EIO;
+            return -1;
+        }
+        
+        amount_to_copy = ((count - i) > ext2_buffer_space(fe)) ?
+                                ext2_buffer_space(fe) : (count - i);
+        ext2_write_buffer(&fe->buffer, &bt[i], fe->cursor % ext2_block_size(fe->context), amount_to_copy);
+        fe->cursor += amount_to_copy;
+        i += amount_to_copy;
+        if(fe->cursor > fe->inode.i_size) {
+            fe->inode.i_size = fe->cursor;
+            fe->flags |= EXT2_FLAG_FS_DIRTY;
+        }
+#if EXT2_STREAM_BUFFERS > 0
+        if(fe->stream && !ext2_nb_active(fe->context) && ((fe->cursor % sizeof(fe->buffer.buffer)) == 0) &&
+            ext2_stream_store(fe)) {
+            *rerrno = fe->rerrno;
+            return -1;
+        }
+#endif
+    }
+    if(i > 0) {
+        ext2_update_mtime(fe);
+    } else if(ext2_nb_deferred(fe->context)) {
+        *rerrno = EINPROGRESS;
+        return -1;
+    }
+    return i;
+}
+
+/**
+ * \brief Write out what an open file holds that isn't on the volume yet.
+ *
+ * The handle's buffered sector and any streamed writes go to the block driver, followed by the
+ * inode if the length or blocks of the file changed, then block_sync() is called.  Changed
+ * timestamps alone aren't written until the file is closed, so rewriting data in place costs
+ * only the data sectors.
+ *
+ * \param vfe The open file.
+ * \param rerrno Set to the error code on failure.
+ * \returns 0 on success, -1 on error.
+ **/
+int ext2_fdatasync(void *vfe, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+        *rerrno = EIO;
+        return -1;
+    }
+    ext2_prefetch_drop(fe, 1);
+    if((fe->flags & EXT2_FLAG_FS_DIRTY) && ext2_flush_inode(fe)) {
+        *rerrno = fe->rerrno;
+        return -1;
+    }
+    if(ext2_discard_flush(fe->context) || block_sync()) {
+        *rerrno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief The number of blocks the block map of a file can address.
+ **/
+static uint64_t ext2_max_blocks(uint32_t block_size) {
+    uint64_t entries = block_size / 4;
+    return 12 + entries + entries * entries + entries * entries * entries;
+}
+
+/**
+ * \brief Set the length of an open file.
+ *
+ * Shrinking frees the blocks wholly past the new end, including indirect blocks left empty, and
+ * clears the rest of the new last block so it reads back as zeros if the file grows again.
+ * Growing allocates nothing, the new part of the file is a hole.  The cursor is not moved.
+ *
+ * \param vfe A handle open for writing, directories are only opened so internally.
+ * \param length The new length in bytes.
+ * \param rerrno Set to the error code on failure.
+ * \returns 0 on success, -1 on error.
+ **/
+int ext2_ftruncate(void *vfe, int64_t length, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    uint32_t block_size;
+    
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(!(fe->flags & EXT2_FLAG_WRITE) || (length < 0)) {
+        *rerrno = EINVAL;
+        return -1;
+    }
+    block_size = ext2_block_size(fe->context);
+    if((uint64_t)length / block_size > ext2_max_blocks(block_size)) {
+        *rerrno = EFBIG;
+        return -1;
+    }
+    ext2_prefetch_drop(fe, 1);
+    if((uint64_t)length < fe->inode.i_size) {
+        if(ext2_zero_tail(fe, length, fe->inode.i_size)) {
+            *rerrno = EIO;
+            return -1;
+        }
+        fe->inode.i_size = length;
+        if(ext2_free_from(fe, (length + block_size - 1) / block_size)) {
+            *rerrno = EIO;
+            return -1;
+        }
+    } else if((uint64_t)length > fe->inode.i_size) {
+        if(ext2_zero_tail(fe, fe->inode.i_size, length)) {
+            *rerrno = EIO;
+            return -1;
+        }
+    } else {
+        return 0;
+    }
+    fe->inode.i_size = length;
+    fe->flags |= EXT2_FLAG_FS_DIRTY;
+    ext2_update_mtime(fe);
+    return 0;
+}
+
+/**
+ * \brief Allocate the blocks for part of an open file in advance.
+ *
+ * Every hole between offset and offset + len gets a block, taken as long consecutive runs so
+ * the file is contiguous on the volume and writes into the range allocate nothing.  ext2 has no
+ * way to mark blocks unwritten, so new blocks inside the file are cleared and the file grows to
+ * cover the range.  With #EXT2_FALLOC_KEEP_SIZE the length is left alone and blocks past the
+ * end aren't written at all, they read as zeros until written as the end of the file moves over
+ * them.  Blocks still past the end when the handle is closed are freed again.
+ *
+ * \param vfe A handle open for writing.
+ * \param offset Start of the range in bytes.
+ * \param len Length of the range in bytes.
+ * \param flags 0 or #EXT2_FALLOC_KEEP_SIZE.
+ * \param rerrno Set to the error code on failure.
+ * \returns 0 on success, -1 on error.
+ **/
+int ext2_fallocate(void *vfe, int64_t offset, int64_t len, int flags, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    struct ext2_free_batch batch;
+    uint32_t block_size, sectors_per_block, index, last, count, span, start, got, i;
+    uint64_t size, position;
+    int set;
+    
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(!(fe->flags & EXT2_FLAG_WRITE) || (offset < 0) || (len <= 0) || (flags & ~EXT2_FALLOC_KEEP_SIZE)) {
+        *rerrno = EINVAL;
+        return -1;
+    }
+    block_size = ext2_block_size(fe->context);
+    sectors_per_block = block_size / sizeof(fe->buffer.buffer);
+    if((uint64_t)(offset + len - 1) / block_size >= ext2_max_blocks(block_size)) {
+        *rerrno = EFBIG;
+        return -1;
+    }
+    ext2_prefetch_drop(fe, 0);
+    size = fe->inode.i_size;
+    if(!(flags & EXT2_FALLOC_KEEP_SIZE) && ((uint64_t)(offset + len) > size)) {
+        // the old last block becomes part of the file, what the new blocks hold is cleared below
+        if(ext2_zero_tail(fe, size, offset + len)) {
+            *rerrno = EIO;
+            return -1;
+        }
+        size = offset + len;
+    }
+    
+    last = (offset + len - 1) / block_size;
+    for(index=offset / block_size;index<=last;) {
+        if(ext2_map_run(fe, index, NULL, &span)) {
+            index++;
+            continue;
+        }
+        // span covers a whole missing indirect block at once
+        for(count=span;(index + count <= last) && (ext2_map_run(fe, index + count, NULL, &span) == 0);count+=span);
+        if(index + count > last + 1) {
+            count = last + 1 - index;
+        }
+        // carry on from the block before if there is one
+        start = index ? ext2_map_block(fe, index - 1, NULL) : 0;
+        start = ext2_allocate_run(fe, start ? start + 1 : 0, count, &got);
+        if(start == 0) {
+            *rerrno = fe->rerrno;
+            return -1;
+        }
+        for(i=0;i<got;i+=set) {
+            if((set = ext2_set_blocks(fe, index + i, start + i, got - i)) < 0) {
+                // hand back the part of the run that didn't make it into the map
+                ext2_free_begin(&batch, 0);
+                for(;i<got;i++) {
+                    ext2_free_block(fe->context, &batch, start + i);
+                }
+                ext2_free_flush(fe->context, &batch);
+                *rerrno = fe->rerrno ? fe->rerrno : EIO;
+                return -1;
+            }
+            fe->inode.i_blocks += set * (block_size / 512);
+        }
+        fe->flags |= EXT2_FLAG_FS_DIRTY;
+        
+        // whatever the blocks last held must not show through inside the file
+        if(fe->buffer.dirty && ext2_store_buffer(fe)) {
+            *rerrno = EIO;
+            return -1;
+        }
+        fe->buffer.valid = 0;
+        position = (uint64_t)index * block_size;
+        if(size > position) {
+            count = (size - position + sizeof(fe->buffer.buffer) - 1) / sizeof(fe->buffer.buffer);
+            if(count > got * sectors_per_block) {
+                count = got * sectors_per_block;
+            }
+            if(ext2_block_zero(fe->context, start * sectors_per_block + fe->context->part_start, count)) {
+                *rerrno = EIO;
+                return -1;
+            }
+        }
+        index += got;
+    }
+    
+    if((uint64_t)last >= (size + block_size - 1) / block_size) {
+        fe->flags |= EXT2_FLAG_PREALLOC;
+    }
+    if(size != fe->inode.i_size) {
+        fe->inode.i_size = size;
+        ext2_update_mtime(fe);
+    }
+    return 0;
+}
+
+/**
+ * \brief Clear count sectors of the open file from lba_block (on the partition) on the device.
+ **/
+static int ext2_zero_sectors(struct file_ent *fe, uint32_t lba_block, uint32_t count) {
+    if(fe->buffer.valid && (fe->buffer.lba_block >= lba_block) && (fe->buffer.lba_block < lba_block + count)) {
+        // the device has the newer contents now
+        fe->buffer.valid = 0;
+        fe->buffer.dirty = 0;
+    }
+    if(ext2_block_zero(fe->context, lba_block + fe->context->part_start, count)) {
+        fe->rerrno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Make part of an open file read back as zeros.
+ *
+ * Whole sectors are cleared on the device with block_write_zeroes(), one request per physically
+ * contiguous run, so nothing is copied through the handle's buffer.  Only partial sectors at the
+ * ends of the range are read and cleared.  Holes are then allocated and the file grown to cover
+ * the range as ext2_fallocate() does, so writing into the range later allocates nothing.
+ *
+ * \param vfe A handle open for writing.
+ * \param offset Start of the range in bytes.
+ * \param len Length of the range in bytes.
+ * \param rerrno Set to the error code on failure.
+ * \returns 0 on success, -1 on error.
+ **/
+int ext2_zero_range(void *vfe, int64_t offset, int64_t len, int *rerrno) {
     struct file_ent *fe = (struct file_ent *)vfe;
-    if(fe == NULL) {
+    uint32_t block_size, sectors_per_block, block, span, lba_block;
+    uint32_t run_start = 0, run_count = 0;
+    uint64_t position, end, amount;
+    
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
         *rerrno = EBADF;
         return -1;
     }
-    if(fe->magic != EMBEXT_MAGIC) {
-        *rerrno = EBADF;
+    if(!(fe->flags & EXT2_FLAG_WRITE) || (offset < 0) || (len <= 0)) {
+        *rerrno = EINVAL;
         return -1;
     }
-    if(fe->buffer.dirty) {
-        if(ext2_store_buffer(fe)) {
-            *rerrno = fe->rerrno;
-            return -1;
-        }
+    block_size = ext2_block_size(fe->context);
+    sectors_per_block = block_size / sizeof(fe->buffer.buffer);
+    if((uint64_t)(offset + len - 1) / block_size >= ext2_max_blocks(block_size)) {
+        *rerrno = EFBIG;
+        return -1;
     }
-    if(fe->flags & EXT2_FLAG_FS_DIRTY) {
-        if(ext2_flush_inode(fe)) {
+    // streamed writes into the range must land before it is cleared, not after
+    ext2_prefetch_drop(fe, 1);
+    end = offset + len;
+    for(position=offset;position<end;position+=amount) {
+        amount = sizeof(fe->buffer.buffer) - position % sizeof(fe->buffer.buffer);
+        if(amount > end - position) {
+            amount = end - position;
+        }
+        block = ext2_map_run(fe, position / block_size, NULL, &span);
+        if(block == 0) {
+            // a hole already reads as zeros, skip the whole of it
+            amount = ((uint64_t)position / block_size + span) * block_size - position;
+            if(amount > end - position) {
+                amount = end - position;
+            }
+            continue;
+        }
+        if(amount < sizeof(fe->buffer.buffer)) {
+            if(ext2_select_sector(fe, block, position)) {
+                *rerrno = EIO;
+                return -1;
+            }
+            memset(&fe->buffer.buffer[position % sizeof(fe->buffer.buffer)], 0, amount);
+            fe->buffer.dirty = 1;
+            continue;
+        }
+        lba_block = block * sectors_per_block + (position % block_size) / sizeof(fe->buffer.buffer);
+        if(run_count && (lba_block == run_start + run_count)) {
+            run_count++;
+            continue;
+        }
+        if(run_count && ext2_zero_sectors(fe, run_start, run_count)) {
             *rerrno = fe->rerrno;
             return -1;
         }
+        run_start = lba_block;
+        run_count = 1;
     }
-    ext2_print_inode(fe);
-    fe->magic = 0;
-    free(fe);
+    if(run_count && ext2_zero_sectors(fe, run_start, run_count)) {
+        *rerrno = fe->rerrno;
+        return -1;
+    }
+    if(ext2_fallocate(fe, offset, len, 0, rerrno)) {
+        return -1;
+    }
+    ext2_update_mtime(fe);
     return 0;
 }
 
-int ext2_read(void *vfe, void *buffer, size_t count, int *rerrno) {
-    struct file_ent *fe = (struct file_ent *)vfe;
-    uint32_t i=0;
-    uint32_t amount_to_copy;
-    uint8_t *bt = (uint8_t *)buffer;
-    /* make sure this is an open file and it can be read */  
-    if(fe == NULL) {
-        (*rerrno) = EBADF;
+/**
+ * \brief Remove a name for a file.
+ *
+ * The directory entry goes straight away.  When it was the last link the inode is put on the
+ * orphan list in the superblock (s_last_orphan, chained through i_dtime) rather than having its
+ * blocks freed here, so deleting a large file doesn't hold up the caller.  Call ext2_reclaim()
+ * from an idle loop or a background thread to give the space back.  The orphan list is kept on
+ * the disk so reclaiming carries on after the next mount if power is lost.  The last name of a
+ * file can't be removed while it is open, as its blocks would be given to other files under the
+ * open handles.
+ *
+ * \param context The mounted volume.
+ * \param name Path of the file, directories can't be unlinked.
+ * \param rerrno Set to the error code on failure, EBUSY if the file is open.
+ * \returns 0 on success, -1 on error.
+ **/
+int ext2_unlink(struct ext2context *context, const char *name, int *rerrno) {
+    struct file_ent *fe;
+    int r = 0;
+    
+    if(context->read_only) {
+        *rerrno = EROFS;
         return -1;
     }
-    if(fe->magic != EMBEXT_MAGIC) {
-        *rerrno = EBADF;
+    if((fe = (struct file_ent *)ext2_open(context, name, O_RDONLY, 0, rerrno)) == NULL) {
         return -1;
     }
-    /* copy some bytes to the buffer requested */
-    while(i < count) {
-        if(fe->cursor >= fe->inode.i_size) {
-            break;   /* end of file */
-        }
-        /* check the right part of the right block is in the buffer (might not be e.g. after a seek */
-        if(ext2_select_buffer(fe)) {
-            *rerrno = EIO;
-            return -1;
+    if(fe->inode.i_mode & EXT2_S_IFDIR) {
+        ext2_close(fe, rerrno);
+        *rerrno = EISDIR;
+        return -1;
+    }
+    if((fe->inode.i_links_count <= 1) && ext2_open_count(context, fe->inode_number, fe)) {
+        // reclaiming would free blocks the other handles still read and write
+        ext2_close(fe, rerrno);
+        *rerrno = EBUSY;
+        return -1;
+    }
+    if(ext2_delete_from_directory(context, (char *)name, rerrno)) {
+        ext2_close(fe, &r);
+        return -1;
+    }
+    if(ext2_lock_inode(fe, 0)) {
+        ext2_close(fe, &r);
+        *rerrno = EIO;
+        return -1;
+    }
+    fe->inode.i_links_count--;
+    fe->inode.i_ctime = time(NULL);
+    fe->flags |= EXT2_FLAG_FS_DIRTY;
+    if(fe->inode.i_links_count == 0) {
+        // the entry is already gone, if power fails before the superblock is written the inode
+        // is only lost to e2fsck rather than reachable with its blocks half freed
+        ext2_lock(ext2_orphan_lock(context));
+        fe->inode.i_dtime = context->superblock.s_last_orphan;
+        r = ext2_flush_inode(fe);
+        if(r == 0) {
+            ext2_lock(ext2_sb_lock(context));
+            context->superblock.s_last_orphan = fe->inode_number;
+            ext2_flush_superblock(context);
+            ext2_unlock(ext2_sb_lock(context));
         }
-        amount_to_copy = ((count - i) > ext2_buffer_space(fe)) ?
-                                    ext2_buffer_space(fe) : (count - i);
-        amount_to_copy = (amount_to_copy > (fe->inode.i_size - fe->cursor)) ?
-                                    (fe->inode.i_size - fe->cursor) : amount_to_copy;
-        ext2_read_buffer(&bt[i], &fe->buffer, fe->cursor % ext2_block_size(fe->context), amount_to_copy);
-        fe->cursor += amount_to_copy;
-        i += amount_to_copy;
+        ext2_unlock(ext2_orphan_lock(context));
     }
-    if(i > 0) {
-        ext2_update_atime(fe);
+    if(r || ext2_close(fe, rerrno)) {
+        *rerrno = EIO;
+        return -1;
     }
-    return i;
+    return 0;
 }
 
-int ext2_write(void *vfe, const void *buffer, size_t count, 
-               int *rerrno) {
-    struct file_ent *fe = (struct file_ent *)vfe;
-    uint32_t i=0;
-    uint32_t amount_to_copy;
-    uint8_t *bt = (uint8_t *)buffer;
-    if(fe == NULL) {
-        (*rerrno) = EBADF;
+/**
+ * \brief Give back the space of unlinked files, a little at a time.
+ *
+ * Each call frees up to about budget blocks from the end of the first file on the orphan list
+ * (more on the first call for a file if blocks were reserved past its end).  The shorter map and
+ * inode are written before the blocks are freed, so a step cut short by a power failure is just
+ * finished by the next one.  When a file has no blocks left it is taken off the list and then
+ * its inode is freed.
+ *
+ * \param context The mounted volume.
+ * \param budget Roughly how many blocks to free in this step.
+ * \param rerrno Set to the error code on failure, EBUSY while the first file on the list is open.
+ * \returns 1 if there is more to do, 0 once the orphan list is empty, -1 on error.
+ **/
+int ext2_reclaim(struct ext2context *context, uint32_t budget, int *rerrno) {
+    struct file_ent *fe;
+    uint32_t block_size = ext2_block_size(context);
+    uint32_t end, first;
+    int r = 0;
+    
+    if(budget == 0) {
+        *rerrno = EINVAL;
         return -1;
     }
-    if(fe->magic != EMBEXT_MAGIC) {
-        *rerrno = EBADF;
+    ext2_lock(ext2_orphan_lock(context));
+    if(context->superblock.s_last_orphan == 0) {
+        ext2_unlock(ext2_orphan_lock(context));
+        return 0;
+    }
+    if((fe = (struct file_ent *)malloc(sizeof(struct file_ent))) == NULL) {
+        ext2_unlock(ext2_orphan_lock(context));
+        *rerrno = ENOMEM;
         return -1;
     }
-    if(!(fe->flags & EXT2_FLAG_WRITE)) {
-        (*rerrno) = EBADF;
+    memset(fe, 0, sizeof(struct file_ent));
+    fe->magic = EMBEXT_MAGIC;
+    fe->context = context;
+    if(ext2_open_count(context, context->superblock.s_last_orphan, NULL)) {
+        // still open through a handle that looked it up before it was unlinked
+        fe->magic = 0;
+        free(fe);
+        ext2_unlock(ext2_orphan_lock(context));
+        *rerrno = EBUSY;
         return -1;
     }
-    if(fe->flags & EXT2_FLAG_APPEND) {
-        if(ext2_lseek(fe, 0, SEEK_END, rerrno) == -1) {
-            return -1;
-        }
+    if(ext2_open_inode(fe, context->superblock.s_last_orphan) || ext2_lock_inode(fe, 0)) {
+        fe->magic = 0;
+        free(fe);
+        ext2_unlock(ext2_orphan_lock(context));
+        *rerrno = EIO;
+        return -1;
     }
-    while(i < count) {
-        /* make sure the right buffer is loaded */
-        if(ext2_select_buffer(fe)) {
-            *rerrno = EIO;
-            return -1;
+    fe->flags |= EXT2_FLAG_WRITE;
+    
+    if(fe->inode.i_links_count == 0) {
+        end = (fe->inode.i_size + block_size - 1) / block_size;
+        first = (end > budget) ? end - budget : 0;
+        fe->inode.i_size = (uint64_t)first * block_size;
+        // blocks found free already were freed by a step cut short by a power failure
+        if(ext2_free_from(fe, first) < 0) {
+            r = -1;
         }
-        
-        amount_to_copy = ((count - i) > ext2_buffer_space(fe)) ?
-                                ext2_buffer_space(fe) : (count - i);
-        ext2_write_buffer(&fe->buffer, &bt[i], fe->cursor % ext2_block_size(fe->context), amount_to_copy);
-        fe->cursor += amount_to_copy;
-        i += amount_to_copy;
-        if(fe->cursor > fe->inode.i_size) {
-            fe->inode.i_size = fe->cursor;
-            fe->flags |= EXT2_FLAG_FS_DIRTY;
+    } else {
+        first = 0;      // linked again somewhere, just drop it from the list
+    }
+    if((r == 0) && (first == 0)) {
+        // off the list before the inode is freed, a power cut in between only loses it to e2fsck
+        // rather than leaving the list naming an inode that may have been handed out again
+        ext2_lock(ext2_sb_lock(context));
+        context->superblock.s_last_orphan = fe->inode.i_dtime;
+        ext2_flush_superblock(context);
+        ext2_unlock(ext2_sb_lock(context));
+        fe->inode.i_dtime = (fe->inode.i_links_count == 0) ? time(NULL) : 0;
+        fe->flags |= EXT2_FLAG_FS_DIRTY;
+        r = ext2_flush_inode(fe);
+        if((r == 0) && (fe->inode.i_links_count == 0) && (ext2_free_inode(context, fe->inode_number, 0) < 0)) {
+            r = -1;
         }
     }
-    if(i > 0) {
-        ext2_update_mtime(fe);
+    if(ext2_close(fe, rerrno) || r) {
+        ext2_unlock(ext2_orphan_lock(context));
+        *rerrno = EIO;
+        return -1;
     }
-    return i;
+    r = context->superblock.s_last_orphan ? 1 : 0;
+    ext2_unlock(ext2_orphan_lock(context));
+    return r;
+}
+
+/**
+ * \brief Discard every run of free blocks on the volume, e.g. from an idle loop or at boot.
+ *
+ * Catches blocks freed while discard was left out of the build or before a power cut lost the
+ * ranges waiting in memory.  Each block group is locked while its bitmap is scanned and its runs
+ * discarded, so files in other groups can still be allocated and written in the meantime.
+ *
+ * \param context The mounted volume.
+ * \param min_blocks Shortest run worth discarding, shorter ones are left alone.
+ * \param rerrno Set to the error code on failure.
+ * \returns the number of blocks discarded, -1 on error.
+ **/
+int ext2_fstrim(struct ext2context *context, uint32_t min_blocks, int *rerrno) {
+    struct block_group_descriptor bg;
+    uint8_t buf[512];
+    uint32_t sectors_per_block = ext2_block_size(context) / block_get_block_size();
+    uint32_t sector_bits = block_get_block_size() * 8;
+    uint32_t group, bits, bit, first, run, step;
+    int total = 0;
+    
+    if(context->read_only) {
+        *rerrno = EROFS;
+        return -1;
+    }
+    if(ext2_discard_flush(context)) {
+        *rerrno = EIO;
+        return -1;
+    }
+    if(min_blocks == 0) {
+        min_blocks = 1;
+    }
+    for(group=0;group<context->num_blockgroups;group++) {
+        first = context->superblock.s_blocks_per_group * group + context->superblock.s_first_data_block;
+        bits = context->superblock.s_blocks_count - first;
+        if(bits > context->superblock.s_blocks_per_group) {
+            bits = context->superblock.s_blocks_per_group;
+        }
+        ext2_lock(ext2_bg_lock(context, group));
+        ext2_get_bg_descriptor(context, &bg, group);
+        for(bit=0,run=0;bit <= bits;bit+=step) {
+            step = 1;
+            if(bit < bits) {
+                if((bit % sector_bits == 0) &&
+                    ext2_block_read(context, bg.bg_block_bitmap * sectors_per_block + bit / sector_bits + context->part_start, buf)) {
+                    ext2_unlock(ext2_bg_lock(context, group));
+                    *rerrno = EIO;
+                    return -1;
+                }
+                if((bit % 8 == 0) && (bit + 8 <= bits) && (buf[(bit / 8) % block_get_block_size()] == 0)) {
+                    run += (step = 8);
+                    continue;
+                }
+                if(!(buf[(bit / 8) % block_get_block_size()] & (1 << (bit % 8)))) {
+                    run++;
+                    continue;
+                }
+            }
+            // a used block or the end of the group finishes the run
+            if(run >= min_blocks) {
+                if(ext2_block_discard(context, (first + bit - run) * sectors_per_block + context->part_start,
+                                      run * sectors_per_block)) {
+                    ext2_unlock(ext2_bg_lock(context, group));
+                    *rerrno = EIO;
+                    return -1;
+                }
+                total += run;
+            }
+            run = 0;
+        }
+        ext2_unlock(ext2_bg_lock(context, group));
+    }
+    return total;
 }
 
 int ext2_fstat(void *vfe, struct stat *st, 
@@ -1155,24 +4342,13 @@ int ext2_fstat(void *vfe, struct stat *st,
         *rerrno = EBADF;
         return -1;
     }
-    st->st_dev = 0;
-    st->st_ino = fe->inode_number;
-    st->st_mode = fe->inode.i_mode;
-    st->st_nlink = fe->inode.i_links_count;   /* number of hard links to the file */
-    st->st_uid = fe->inode.i_uid;
-    st->st_gid = fe->inode.i_gid;
-    st->st_rdev = 0;
-    st->st_size = fe->inode.i_size;
-    st->st_atime = fe->inode.i_atime;
-    st->st_mtime = fe->inode.i_mtime;
-    st->st_ctime = fe->inode.i_ctime;
-    st->st_blksize = ext2_block_size(fe->context);
-    st->st_blocks = fe->inode.i_blocks;
+    ext2_stat_inode(fe->context, fe->inode_number, &fe->inode, st);
     return 0; 
 }
 
 int ext2_lseek(void *vfe, int offset, int whence, int *rerrno) {
     struct file_ent *fe = (struct file_ent *)vfe;
+    uint32_t block_size, index, block, span;
     
     if(fe == NULL) {
         *rerrno = EBADF;
@@ -1212,6 +4388,30 @@ int ext2_lseek(void *vfe, int offset, int whence, int *rerrno) {
             return -1;
         }
         fe->cursor = fe->inode.i_size + offset;
+    } else if((whence == SEEK_DATA) || (whence == SEEK_HOLE)) {
+        if((offset < 0) || ((uint64_t)offset >= fe->inode.i_size)) {
+            /* there is no data (and only the implicit hole at the end) past the end of the file */
+            *rerrno = ENXIO;
+            return -1;
+        }
+        block_size = ext2_block_size(fe->context);
+        index = offset / block_size;
+        while((uint64_t)index * block_size < fe->inode.i_size) {
+            block = ext2_map_run(fe, index, NULL, &span);
+            if((block == (uint32_t)-1) || ((block != 0) == (whence == SEEK_DATA))) {
+                break;
+            }
+            index += span;
+        }
+        if((uint64_t)index * block_size >= fe->inode.i_size) {
+            if(whence == SEEK_DATA) {
+                *rerrno = ENXIO;
+                return -1;
+            }
+            fe->cursor = fe->inode.i_size;
+        } else {
+            fe->cursor = ((uint64_t)index * block_size > (uint64_t)offset) ? (uint64_t)index * block_size : (uint64_t)offset;
+        }
     } else {
         /* shall fail with EINVAL if the whence argument is not valid */
         *rerrno = EINVAL;
@@ -1300,33 +4500,217 @@ int ext2_isatty(void *vfe, int *rerrno) {
     return 0;
 }
 
+/**
+ * \brief Read the next entry from an open directory into caller owned storage.
+ *
+ * See ext2_next_dirent() for how entries are returned.  Files created together get consecutive
+ * inodes, so when consecutive entries name consecutive inodes of one block group the caller is
+ * probably about to open or stat each in turn and the inode table sectors that follow are read
+ * ahead into the inode cache.  A run is only read ahead once, not once per entry.
+ *
+ * \param vfe An open handle on a directory.
+ * \param entry Storage for the entry read.
+ * \param result Set to entry when an entry was read or NULL at the end of the directory.
+ * \param rerrno Set to the error code on failure.
+ * \returns 0 on success (including end of directory), -1 on error.
+ **/
+int ext2_readdir_r(void *vfe, struct dirent *entry, struct dirent **result, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+#if EXT2_INODE_CACHE_SECTORS > 0
+    uint32_t ino;
+#endif
+    
+    *result = NULL;
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(ext2_next_dirent(fe, entry, result, rerrno)) {
+        return -1;
+    }
+#if EXT2_INODE_CACHE_SECTORS > 0
+    if(*result != NULL) {
+        ino = (uint32_t)entry->d_ino;
+        if((ino == fe->ra_last_ino + 1) && ((ino < fe->ra_start_ino) || (ino >= fe->ra_end_ino)) &&
+            ((ino - 1) / fe->context->superblock.s_inodes_per_group ==
+             (fe->ra_last_ino - 1) / fe->context->superblock.s_inodes_per_group)) {
+            fe->ra_start_ino = ino;
+            fe->ra_end_ino = ino + ext2_inode_readahead(fe->context, ino);
+        }
+        fe->ra_last_ino = ino;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * \brief Read the next entry from an open directory.
+ *
+ * The returned entry is stored in the handle and is overwritten by the next call on the same
+ * handle, other handles are unaffected.  Use ext2_readdir_r() to supply the storage instead.
+ *
+ * \returns a pointer to the entry or NULL at the end of the directory or on error.
+ **/
 struct dirent *ext2_readdir(void *vfe, int *rerrno) {
     struct file_ent *fe = (struct file_ent *)vfe;
-    uint16_t rec_len;
-    uint8_t name_len;
-    uint8_t file_type;
-    static struct dirent de;
-  
-    if(ext2_read(fe, &de.d_ino, 4, rerrno) < 4) {
+    struct dirent *de;
+    
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
         return NULL;
     }
-    if(ext2_read(fe, &rec_len, 2, rerrno) < 2) {
-        return NULL;
+    if(fe->dirent == NULL) {
+        /* only directory handles pay for the entry storage */
+        if((fe->dirent = (struct dirent *)malloc(sizeof(struct dirent))) == NULL) {
+            *rerrno = ENOMEM;
+            return NULL;
+        }
     }
-    if(ext2_read(fe, &name_len, 1, rerrno) < 1) {
+    if(ext2_readdir_r(fe, fe->dirent, &de, rerrno)) {
         return NULL;
     }
-    if(ext2_read(fe, &file_type, 1, rerrno) < 1) {
-        return NULL;
+    return de;
+}
+
+/**
+ * \brief Get a cookie for the current position in a directory.
+ *
+ * The cookie is the byte offset of the next record, so passing it to ext2_seekdir() resumes the
+ * listing directly in the right directory block without rescanning from the start.
+ *
+ * \returns the position cookie or -1 on error.
+ **/
+long ext2_telldir(void *vfe, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
     }
-  
-    if(de.d_ino > 0) {
-        ext2_read(fe, de.d_name, name_len, rerrno);
-        de.d_name[name_len] = 0;
-  
-        ext2_lseek(fe, rec_len - 8 - name_len, SEEK_CUR, rerrno);
-        return &de;
-    } else {
-        return NULL;
+    return fe->cursor;
+}
+
+/**
+ * \brief Move to a position in a directory previously returned by ext2_telldir().
+ *
+ * \returns 0 on success, -1 if the cookie cannot be a record position in this directory.
+ **/
+int ext2_seekdir(void *vfe, long loc, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(!(fe->inode.i_mode & EXT2_S_IFDIR)) {
+        *rerrno = ENOTDIR;
+        return -1;
+    }
+    if((loc < 0) || (loc % 4) || (loc > (long)fe->inode.i_size)) {
+        *rerrno = EINVAL;
+        return -1;
+    }
+    fe->cursor = loc;
+    return 0;
+}
+
+static int ext2_compare_dirent_stat_ino(const void *a, const void *b) {
+    const struct ext2_dirent_stat *x = *(const struct ext2_dirent_stat * const *)a;
+    const struct ext2_dirent_stat *y = *(const struct ext2_dirent_stat * const *)b;
+    if(x->de.d_ino < y->de.d_ino) {
+        return -1;
+    }
+    return x->de.d_ino > y->de.d_ino;
+}
+
+/**
+ * \brief Read directory entries together with the attributes of the inodes they name.
+ *
+ * Reads entries from the current position up to the end of the current directory block, or
+ * until count entries have been read, and fills in a struct stat for each.  Rather than opening
+ * each entry the inode numbers are sorted and each inode table sector is read once for all the
+ * entries it holds, so a listing costs about one read per directory block plus one per distinct
+ * inode table sector.
+ *
+ * \param vfe An open handle on a directory.
+ * \param entries Array of at least count entries to fill.
+ * \param count Maximum number of entries to return.
+ * \param rerrno Set to the error code on failure.
+ * \returns the number of entries filled, 0 at the end of the directory or -1 on error.
+ **/
+int ext2_getdents_stat(void *vfe, struct ext2_dirent_stat *entries, int count, int *rerrno) {
+    struct file_ent *fe = (struct file_ent *)vfe;
+    struct ext2_dirent_stat **order;
+    struct dirent *de;
+    struct block_group_descriptor bg;
+    uint8_t buf[512];
+    uint32_t block_end, lba_block, offset;
+    uint32_t loaded_lba = 0, loaded_group = 0;
+    int n = 0, i, have_sector = 0, have_group = 0;
+    
+    if((fe == NULL) || (fe->magic != EMBEXT_MAGIC)) {
+        *rerrno = EBADF;
+        return -1;
+    }
+    if(count <= 0) {
+        *rerrno = EINVAL;
+        return -1;
+    }
+    
+    // only take what is left of the directory block the cursor is in
+    block_end = (fe->cursor / ext2_block_size(fe->context) + 1) * ext2_block_size(fe->context);
+    while((n < count) && (fe->cursor < block_end)) {
+        if(ext2_next_dirent(fe, &entries[n].de, &de, rerrno)) {
+            return -1;
+        }
+        if(de == NULL) {
+            break;
+        }
+        n++;
+    }
+    if(n == 0) {
+        return 0;
+    }
+    
+    if((order = (struct ext2_dirent_stat **)malloc(sizeof(struct ext2_dirent_stat *) * n)) == NULL) {
+        *rerrno = ENOMEM;
+        return -1;
+    }
+    for(i=0;i<n;i++) {
+        order[i] = &entries[i];
+    }
+    qsort(order, n, sizeof(struct ext2_dirent_stat *), ext2_compare_dirent_stat_ino);
+    
+    for(i=0;i<n;i++) {
+        struct inode in;
+        uint32_t ino = order[i]->de.d_ino;
+        uint32_t group = (ino - 1) / fe->context->superblock.s_inodes_per_group;
+        
+        if((ino == 0) || (ino > fe->context->superblock.s_inodes_count)) {
+            free(order);
+            *rerrno = EIO;
+            return -1;
+        }
+        if(!have_group || (group != loaded_group)) {
+            if(ext2_get_bg_descriptor(fe->context, &bg, group)) {
+                free(order);
+                *rerrno = EIO;
+                return -1;
+            }
+            loaded_group = group;
+            have_group = 1;
+        }
+        ext2_inode_position(fe->context, &bg, ino, &lba_block, &offset);
+        if(!have_sector || (lba_block != loaded_lba)) {
+            if(ext2_read_inode_sector(fe->context, ino, lba_block, buf)) {
+                free(order);
+                *rerrno = EIO;
+                return -1;
+            }
+            loaded_lba = lba_block;
+            have_sector = 1;
+        }
+        memcpy(&in, &buf[offset], sizeof(struct inode));
+        ext2_stat_inode(fe->context, ino, &in, &order[i]->st);
     }
+    free(order);
+    return n;
 }
@@ -1,6 +1,10 @@
 #ifndef EMBEXT2_H
 #define EMBEXT2_H 1
 
+#include <sys/stat.h>
+#include "dirent.h"
+#include "embext_lock.h"
+
 #define MAX_PATH_LEN 1024
 #define MAX_PATH_LEVELS 100
 
@@ -23,14 +27,125 @@
 #define EXT2_FLAG_APPEND 8
 #define EXT2_FLAG_DIRTY 16
 #define EXT2_FLAG_FS_DIRTY 32
+#define EXT2_FLAG_LOCKED 64
+#define EXT2_FLAG_PREALLOC 128
+#define EXT2_FLAG_TIME_DIRTY 256
+#define EXT2_FLAG_REWRITE 512
 
 #define EXT2_S_IFREG 0x8000
 #define EXT2_S_IFDIR 0x4000
 
+#define EXT2_FEATURE_INCOMPAT_FILETYPE      0x0002
+
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
 #define EXT2_FEATURE_RO_COMPAT_BTREE_DIR    0x0004
 
+/**
+ * Keep a copy of the block group descriptor table in RAM for the life of the mount.  This costs 32
+ * bytes per block group but removes a sector read from every inode lookup and allocation.  It is
+ * required (and turned on automatically) for the lock free read path in threadsafe builds.
+ **/
+#if defined(EMBEXT_THREADSAFE) && !defined(EMBEXT_BG_CACHE)
+#define EMBEXT_BG_CACHE 1
+#endif
+
+/**
+ * Number of inode table sectors cached per mounted context (512 bytes each), 0 (the default)
+ * leaves the cache out.  Directory scans that meet consecutive inode numbers fetch
+ * #EXT2_INODE_READAHEAD sectors of the inode table in one multi-block read so the opens and stats
+ * that follow are served from memory.  Worth turning on where there is RAM to spare.
+ **/
+#ifndef EXT2_INODE_CACHE_SECTORS
+#define EXT2_INODE_CACHE_SECTORS 0
+#endif
+#ifndef EXT2_INODE_READAHEAD
+#define EXT2_INODE_READAHEAD EXT2_INODE_CACHE_SECTORS
+#endif
+
+/**
+ * Largest readahead window of an open file in sectors, 0 (the default) leaves file readahead out.
+ * A handle that reads sequentially gets a window buffer of this many sectors (allocated on first
+ * use, 512 bytes each) which is filled with multi-block reads, starting at two sectors and
+ * doubling on each refill while the access stays sequential.  A seek elsewhere shrinks it back to
+ * two sectors.
+ **/
+#ifndef EXT2_FILE_READAHEAD
+#define EXT2_FILE_READAHEAD 0
+#endif
+
+/**
+ * Number of sector buffers (512 bytes each) a handle gets when streaming is turned on with
+ * ext2_set_stream(), 0 leaves streaming out.  At least two are needed for the device to work
+ * on one sector while the application works on another.
+ **/
+#ifndef EXT2_STREAM_BUFFERS
+#define EXT2_STREAM_BUFFERS 2
+#endif
+
+/**
+ * Number of freed block ranges a mounted context remembers for block_discard(), 0 leaves discard
+ * out.  Blocks freed next to a range already waiting are merged into it.  The ranges are passed to
+ * the block driver at ext2_fdatasync() and ext2_umount(), or all at once when the list fills.
+ * ext2_fstrim() discards every free run on the volume regardless of this setting.
+ **/
+#ifndef EXT2_DISCARD_RANGES
+#define EXT2_DISCARD_RANGES 8
+#endif
+
+/**
+ * Files are treated as large once they pass this many bytes.  When the block driver reports an
+ * allocation unit with block_get_au_size(), a large file that can't carry on in the block after
+ * its last one moves to the start of the next empty unit.  Small files and block maps fill the
+ * gaps in units already in use, so large files write whole units in order.
+ **/
+#ifndef EXT2_AU_LARGE_FILE
+#define EXT2_AU_LARGE_FILE 65536
+#endif
+
+/**
+ * Number of write counters per mounted context.  Every write to the volume moves the counter for
+ * its sector number modulo this, and a handle re-reads the sector in its buffer once that counter
+ * has moved.  More counters mean fewer needless re-reads while other handles are writing.
+ **/
+#ifndef EXT2_WRITE_COUNTERS
+#define EXT2_WRITE_COUNTERS 8
+#endif
+
+/**
+ * Build with EMBEXT_NONBLOCK defined to get ext2_open_nb(), ext2_read_nb(), ext2_write_nb() and
+ * ext2_close_nb() for superloop firmware without an RTOS.  Each mounted context then keeps
+ * #EXT2_NB_SLOTS sectors (512 bytes each) for transfers in flight through block_submit().  This
+ * only pays off with a block driver that has a real request queue.  Non-blocking calls rely on
+ * there being one caller at a time, so this can't be combined with EMBEXT_THREADSAFE.
+ **/
+#ifdef EMBEXT_NONBLOCK
+#ifdef EMBEXT_THREADSAFE
+#error "EMBEXT_NONBLOCK can't be combined with EMBEXT_THREADSAFE"
+#endif
+#ifndef EXT2_NB_SLOTS
+#define EXT2_NB_SLOTS 4
+#endif
+#include "block.h"
+
+struct ext2_nb_slot {
+    struct block_request req;
+    uint32_t used;
+    uint8_t state;
+    uint8_t data[512];
+};
+#endif
+
+// directory entry file_type values, only valid with EXT2_FEATURE_INCOMPAT_FILETYPE
+#define EXT2_FT_UNKNOWN         0
+#define EXT2_FT_REG_FILE        1
+#define EXT2_FT_DIR             2
+#define EXT2_FT_CHRDEV          3
+#define EXT2_FT_BLKDEV          4
+#define EXT2_FT_FIFO            5
+#define EXT2_FT_SOCK            6
+#define EXT2_FT_SYMLINK         7
+
 #define EXT2_ALLOCATED          1
 #define EXT2_DEALLOCATED        0
 
@@ -118,16 +233,85 @@ struct inode {
     uint8_t i_osd2[12];
 } __attribute__((__packed__));
 
+struct ext2_bg_cache_entry {
+    struct block_group_descriptor bg;
+    ext2_seq_t seq;
+};
+
+struct ext2_inode_cache_entry {
+    uint32_t lba_block;
+    uint32_t valid;
+    ext2_seq_t seq;
+};
+
+struct ext2_inode_slot {
+    ext2_lock_t lock;
+    ext2_seq_t seq;
+};
+
+struct ext2_discard_range {
+    uint32_t start;             // first block (filesystem blocks)
+    uint32_t count;
+};
+
+struct file_ent;
+
+/**
+ * \brief State for one mounted ext2 volume.
+ *
+ * The context holds no shared scratch space, every helper that needs a sector buffer uses its own
+ * so one context can be used from several threads when built with EMBEXT_THREADSAFE.  Bitmap and
+ * descriptor updates for a block group are serialised by that group's lock, the free counts in
+ * the in-memory superblock by sb_lock, and writes of inode table sectors by the inode slot locks.
+ * orphan_lock is held by ext2_reclaim() for a whole step and is always taken before any other.
+ * open_lock covers the list of open handles, nothing else is taken while it is held.
+ * discard_lock covers the list of freed ranges and is always taken last.
+ * Readers never take these locks, they validate what they copied against the sequence counter of
+ * the cached descriptor or inode slot and retry if a writer was active.  A single open file
+ * handle must still only be used by one thread at a time.
+ **/
 struct ext2context {
     blockno_t part_start;
     struct superblock superblock;
     uint32_t sparse;
-    uint8_t sysbuf[512];
     uint32_t superblock_block;
     uint32_t read_only;
     uint32_t num_blockgroups;
     uint32_t num_superblocks;
     uint32_t *superblock_blocks;
+    uint32_t au_blocks;         // device allocation unit in filesystem blocks, 0 if not used
+    uint32_t au_next;           // allocation unit to look for an empty one from
+    uint32_t writes[EXT2_WRITE_COUNTERS];   // sectors written, by sector number
+    struct file_ent *open_files;            // handles returned by ext2_open() and not closed yet
+#ifdef EMBEXT_BG_CACHE
+    struct ext2_bg_cache_entry *bg_cache;
+#endif
+#if EXT2_INODE_CACHE_SECTORS > 0
+    struct ext2_inode_cache_entry inode_cache[EXT2_INODE_CACHE_SECTORS];
+    uint8_t *inode_cache_data;
+    uint32_t inode_cache_next;
+    ext2_lock_t inode_cache_lock;
+#endif
+#ifdef EMBEXT_THREADSAFE
+    ext2_lock_t *bg_locks;
+    ext2_lock_t sb_lock;
+    ext2_lock_t orphan_lock;
+    ext2_lock_t open_lock;
+    struct ext2_inode_slot inode_slots[EXT2_INODE_LOCKS];
+#endif
+#if EXT2_DISCARD_RANGES > 0
+    struct ext2_discard_range discard[EXT2_DISCARD_RANGES];
+    uint32_t discard_count;
+    ext2_lock_t discard_lock;
+#endif
+#ifdef EMBEXT_NONBLOCK
+    struct ext2_nb_slot *nb_slots;
+    uint32_t nb_clock;
+    uint32_t nb_start;
+    uint8_t nb_mode;
+    uint8_t nb_deferred;
+    int nb_error;
+#endif
 };
 
 int ext2_mount(blockno_t part_start, blockno_t volume_size, uint8_t filesystem_hint, struct ext2context **context);
@@ -139,16 +323,85 @@ int ext2_close(void *vfe, int *rerrno);
 
 int ext2_read(void *vfe, void *buffer, size_t count, int *rerrno);
 
+int ext2_read_ptr(void *vfe, const void **ptr, size_t count, int *rerrno);
+
+#define EXT2_EXTENT_HOLE    1       // no blocks allocated, reads as zeros
+#define EXT2_EXTENT_LAST    2       // the run reaches the end of the file
+
+/**
+ * One run of a file as reported by ext2_fiemap(), all sizes in bytes except physical which is
+ * the first block on the device (in units of the block driver's #BLOCK_SIZE).
+ **/
+struct ext2_extent {
+    uint64_t logical;
+    uint64_t physical;
+    uint64_t length;
+    uint32_t flags;
+};
+
+int ext2_fiemap(void *vfe, uint64_t offset, uint64_t len, struct ext2_extent *extents, int n,
+                int *rerrno);
+
 int ext2_write(void *vfe, const void *buffer, size_t count, int *rerrno);
 
+int ext2_ftruncate(void *vfe, int64_t length, int *rerrno);
+
+int ext2_fdatasync(void *vfe, int *rerrno);
+
+#define EXT2_FALLOC_KEEP_SIZE   1       // allocate without changing the length of the file
+
+int ext2_fallocate(void *vfe, int64_t offset, int64_t len, int flags, int *rerrno);
+
+int ext2_zero_range(void *vfe, int64_t offset, int64_t len, int *rerrno);
+
+int ext2_unlink(struct ext2context *context, const char *name, int *rerrno);
+
+int ext2_reclaim(struct ext2context *context, uint32_t budget, int *rerrno);
+
+int ext2_fstrim(struct ext2context *context, uint32_t min_blocks, int *rerrno);
+
 int ext2_isatty(void *vfe, int *rerrno);
 
 int ext2_fstat(void *vfe, struct stat *st, int *rerrno);
 
+#ifndef SEEK_DATA
+#define SEEK_DATA   3       // first offset from the one given that isn't in a hole
+#define SEEK_HOLE   4       // first offset from the one given in a hole or at the end of the file
+#endif
+
 int ext2_lseek(void *vfe, int ptr, int dir, int *rerrno);
 
 struct dirent *ext2_readdir(void *vfe, int *rerrno);
 
+int ext2_readdir_r(void *vfe, struct dirent *entry, struct dirent **result, int *rerrno);
+
+long ext2_telldir(void *vfe, int *rerrno);
+
+int ext2_seekdir(void *vfe, long loc, int *rerrno);
+
+struct ext2_dirent_stat {
+    struct dirent de;
+    struct stat st;
+};
+
+int ext2_getdents_stat(void *vfe, struct ext2_dirent_stat *entries, int count, int *rerrno);
+
+int ext2_lock_inode(void *vfe, int rewrite);
+
+#if EXT2_STREAM_BUFFERS > 0
+int ext2_set_stream(void *vfe, int enable, int *rerrno);
+#endif
+
+#ifdef EMBEXT_NONBLOCK
+void *ext2_open_nb(struct ext2context *context, const char *name, int flags, int mode, int *rerrno);
+
+int ext2_read_nb(void *vfe, void *buffer, size_t count, int *rerrno);
+
+int ext2_write_nb(void *vfe, const void *buffer, size_t count, int *rerrno);
+
+int ext2_close_nb(void *vfe, int *rerrno);
+#endif
+
 #ifdef EMBEXT_DEBUG
 void ext2_print_inode(void *vfe);
 void ext2_print_bg1_bitmap(struct ext2context *context);
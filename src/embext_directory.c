@@ -10,13 +10,15 @@
 #include "embext.h"
 #include "embext_directory.h"
 
+/* space a record needs for a name of the given length */
+#define EXT2_DIRENT_LEN(name_len) ((((name_len) + 3) / 4) * 4 + 8)
+
 int ext2_append_to_directory(struct ext2context *context, char *directory, uint32_t inode, 
-                             char *filename, int *rerrno) {
-    int file_length, last_block, i, this_offset;
+                             char *filename, uint8_t file_type, int *rerrno) {
+    int file_length, i, this_offset;
     int minimum_new_entry_len, minimum_old_entry_len;
     int block_size = ext2_block_size(context);
-    char buffer[128];
-    struct ext2_dir_header dir_header;
+    struct ext2_dir_header dir_header, new_header;
     struct file_ent *fe = ext2_open(context, directory, O_RDWR, 01777, rerrno);
 
     printf("\next2_append_to_directory(%p, %s, %u, %s, %p)\n", context, directory,
@@ -24,64 +26,72 @@ int ext2_append_to_directory(struct ext2context *context, char *directory, uint3
     if(fe == NULL) {
         return -1;
     }
-    file_length = ext2_lseek(fe, 0, SEEK_END, rerrno);
-    if(file_length % block_size != 0) {
-        *rerrno = ENOENT;
-        ext2_close(fe, rerrno);
-        return -1;
+    /* without the filetype feature the byte is the top half of a 16 bit name length */
+    if(!(context->superblock.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE)) {
+        file_type = EXT2_FT_UNKNOWN;
     }
-    last_block = file_length - block_size;
-    if(last_block < 0) {
+    /* concurrent creates in the same directory must not both claim the last entry */
+    if(ext2_lock_inode(fe, 0)) {
         *rerrno = EIO;
-        ext2_close(fe, rerrno);
+        ext2_close(fe, &i);
         return -1;
     }
-    this_offset = 0;
-    memset(&dir_header, 0, sizeof(dir_header));
-    do {
-        this_offset += dir_header.rec_len;
-        if(ext2_lseek(fe, last_block + this_offset, SEEK_SET, rerrno) != last_block + this_offset) {
+    file_length = ext2_lseek(fe, 0, SEEK_END, rerrno);
+    if((file_length % block_size != 0) || (file_length < block_size)) {
+        *rerrno = (file_length % block_size) ? ENOENT : EIO;
+        ext2_close(fe, &i);
+        return -1;
+    }
+    minimum_new_entry_len = EXT2_DIRENT_LEN(strlen(filename));
+    
+    /* take the first record with room to spare, left by a deleted entry or at the end of a block */
+    for(this_offset=0;this_offset<file_length;this_offset+=dir_header.rec_len) {
+        if((ext2_lseek(fe, this_offset, SEEK_SET, rerrno) != this_offset) ||
+            (ext2_read(fe, &dir_header, sizeof(dir_header), rerrno) != sizeof(dir_header))) {
             ext2_close(fe, &i);
             return -1;
         }
-        if(ext2_read(fe, &dir_header, sizeof(dir_header), rerrno) != sizeof(dir_header)) {
+        if((dir_header.rec_len < sizeof(dir_header)) || (dir_header.rec_len % 4)) {
+            *rerrno = EIO;
             ext2_close(fe, &i);
             return -1;
         }
-    } while(this_offset + dir_header.rec_len < block_size);
-
-    minimum_old_entry_len = ((dir_header.name_len / 4) + (dir_header.name_len % 4 ? 1 : 0)) * 4 + 8;
-    minimum_new_entry_len = ((strlen(filename) / 4) + (strlen(filename) % 4 ? 1 : 0)) * 4 + 8;
+        minimum_old_entry_len = dir_header.inode ? EXT2_DIRENT_LEN(dir_header.name_len) : 0;
+        if(dir_header.rec_len - minimum_old_entry_len >= minimum_new_entry_len) {
+            break;
+        }
+    }
     
-    if(dir_header.rec_len - minimum_old_entry_len > minimum_new_entry_len) {
-        printf("\nLast record length = %d, name_len = %d, appending in block\n",
+    if(this_offset < file_length) {
+        printf("\nRecord length = %d, name_len = %d, adding to block\n",
                dir_header.rec_len, dir_header.name_len);
-        /* there is room in the existing block to add another entry so shrink the old one and add
-         * the new one */
-        dir_header.rec_len = minimum_old_entry_len;
-        ext2_lseek(fe, this_offset + last_block, SEEK_SET, rerrno);
-        ext2_write(fe, &dir_header, sizeof(dir_header), rerrno);
-        this_offset += dir_header.rec_len;
-        ext2_lseek(fe, this_offset + last_block, SEEK_SET, rerrno);
-        dir_header.rec_len = block_size - this_offset;
-        dir_header.name_len = strlen(filename);
-        dir_header.file_type = 0;
-        dir_header.inode = inode;
-        ext2_write(fe, &dir_header, sizeof(dir_header), rerrno);
+        /* the new entry goes after what the old one needs.  A lookup running alongside sees
+         * each sector as it is written, so the name goes before the header and the new entry
+         * before the shrunk record that leads to it */
+        new_header.rec_len = dir_header.rec_len - minimum_old_entry_len;
+        new_header.name_len = strlen(filename);
+        new_header.file_type = file_type;
+        new_header.inode = inode;
+        ext2_lseek(fe, this_offset + minimum_old_entry_len + sizeof(new_header), SEEK_SET, rerrno);
         ext2_write(fe, filename, strlen(filename), rerrno);
+        ext2_lseek(fe, this_offset + minimum_old_entry_len, SEEK_SET, rerrno);
+        ext2_write(fe, &new_header, sizeof(new_header), rerrno);
+        if(minimum_old_entry_len) {
+            dir_header.rec_len = minimum_old_entry_len;
+            ext2_lseek(fe, this_offset, SEEK_SET, rerrno);
+            ext2_write(fe, &dir_header, sizeof(dir_header), rerrno);
+        }
     } else {
-        printf("\nLast record length = %d, name_len = %d, creating new block\n",
-               dir_header.rec_len, dir_header.name_len);
-        /* there is not enough room in this block to append another entry, add a whole new block. */
-        ext2_lseek(fe, 0, SEEK_END, rerrno);
-        memset(&buffer, 0, sizeof(buffer));
-        for(i=0;i<(int)(block_size / sizeof(buffer));i++) {
-            ext2_write(fe, &buffer, sizeof(buffer), rerrno);
+        printf("\nNo room for %d bytes, creating new block\n", minimum_new_entry_len);
+        /* there is not enough room in any block to add another entry, add a whole new block. */
+        if(ext2_zero_range(fe, file_length, block_size, rerrno)) {
+            ext2_close(fe, &i);
+            return -1;
         }
         ext2_lseek(fe, -block_size, SEEK_END, rerrno);
         dir_header.rec_len = block_size;
         dir_header.name_len = strlen(filename);
-        dir_header.file_type = 0;
+        dir_header.file_type = file_type;
         dir_header.inode = inode;
         ext2_write(fe, &dir_header, sizeof(dir_header), rerrno);
         ext2_write(fe, filename, strlen(filename), rerrno);
@@ -90,6 +100,188 @@ int ext2_append_to_directory(struct ext2context *context, char *directory, uint3
     return 0;
 }
 
+/**
+ * \brief Give back blocks at the end of a directory that hold no entries.
+ *
+ * The first block (with . and ..) always stays.
+ **/
+static int ext2_release_directory_tail(void *fe, int block_size, int *rerrno) {
+    struct ext2_dir_header dir_header;
+    int length = ext2_lseek(fe, 0, SEEK_END, rerrno);
+    
+    while(length > block_size) {
+        if((ext2_lseek(fe, length - block_size, SEEK_SET, rerrno) != length - block_size) ||
+            (ext2_read(fe, &dir_header, sizeof(dir_header), rerrno) != sizeof(dir_header))) {
+            return -1;
+        }
+        if(dir_header.inode || (dir_header.rec_len != block_size)) {
+            break;
+        }
+        if(ext2_ftruncate(fe, length - block_size, rerrno)) {
+            return -1;
+        }
+        length -= block_size;
+    }
+    return 0;
+}
+
+/**
+ * \brief Remove the entry for a path from its directory.
+ *
+ * The entry's space is added to the record before it in the same block, an entry at the start
+ * of a block is marked unused by clearing its inode number instead.  Blocks left empty at the end
+ * of the directory are freed.  Nothing is done to the inode the entry pointed at.
+ *
+ * \param context The mounted volume.
+ * \param filename Full path of the entry.
+ * \param rerrno Set to the error code on failure.
+ * \returns 0 on success, -1 on error.
+ **/
 int ext2_delete_from_directory(struct ext2context *context, char *filename, int *rerrno) {
+    char directory[MAX_PATH_LEN];
+    char name[256];
+    char *last = strrchr(filename, '/');
+    size_t name_len;
+    struct ext2_dir_header dir_header, prev_header;
+    struct file_ent *fe;
+    int directory_length, block_size, pos, prev = -1, i;
 
+    if((last == NULL) || ((size_t)(last - filename) >= sizeof(directory))) {
+        *rerrno = ENOENT;
+        return -1;
+    }
+    name_len = strlen(&last[1]);
+    if((name_len == 0) || (name_len >= sizeof(name))) {
+        *rerrno = ENOENT;
+        return -1;
+    }
+    memcpy(directory, filename, last - filename);
+    directory[last - filename] = 0;
+    if((fe = ext2_open(context, directory, O_RDWR, 01777, rerrno)) == NULL) {
+        return -1;
+    }
+    /* entries must not move under a concurrent create in the same directory */
+    if(ext2_lock_inode(fe, 0)) {
+        *rerrno = EIO;
+        ext2_close(fe, &i);
+        return -1;
+    }
+    block_size = ext2_block_size(context);
+    directory_length = ext2_lseek(fe, 0, SEEK_END, rerrno);
+    *rerrno = ENOENT;
+    for(pos=0;pos<directory_length;prev=pos,prev_header=dir_header,pos+=dir_header.rec_len) {
+        if(pos % block_size == 0) {
+            prev = -1;
+        }
+        if((ext2_lseek(fe, pos, SEEK_SET, &i) != pos) ||
+            (ext2_read(fe, &dir_header, sizeof(dir_header), &i) != sizeof(dir_header)) ||
+            (dir_header.rec_len < sizeof(dir_header)) || (dir_header.rec_len % 4)) {
+            *rerrno = EIO;
+            break;
+        }
+        if(dir_header.inode && (dir_header.name_len == name_len) &&
+            (ext2_read(fe, name, name_len, &i) == (int)name_len) &&
+            (memcmp(name, &last[1], name_len) == 0)) {
+            if(prev < 0) {
+                dir_header.inode = 0;
+            } else {
+                prev_header.rec_len += dir_header.rec_len;
+                dir_header = prev_header;
+                pos = prev;
+            }
+            ext2_lseek(fe, pos, SEEK_SET, &i);
+            if(ext2_write(fe, &dir_header, sizeof(dir_header), &i) != sizeof(dir_header)) {
+                *rerrno = EIO;
+                break;
+            }
+            if(ext2_release_directory_tail(fe, block_size, rerrno)) {
+                break;
+            }
+            return ext2_close(fe, rerrno);
+        }
+    }
+    ext2_close(fe, &i);
+    return -1;
+}
+
+/**
+ * \brief Rewrite a directory with its entries packed densely.
+ *
+ * Entries are moved towards the start in order, space left by deleted entries is squeezed out
+ * and blocks left empty at the end are freed.  Entries never straddle a block, the last entry
+ * in each block takes the rest of it.  The directory is locked while it is rewritten but this
+ * is not safe against power loss, an entry being moved may be lost or appear twice.
+ *
+ * \param context The mounted volume.
+ * \param directory Full path of the directory.
+ * \param rerrno Set to the error code on failure.
+ * \returns 0 on success, -1 on error.
+ **/
+int ext2_compact_directory(struct ext2context *context, const char *directory, int *rerrno) {
+    char entry[sizeof(struct ext2_dir_header) + 256];
+    struct ext2_dir_header dir_header, last_header;
+    struct file_ent *fe;
+    int directory_length, block_size, entry_len, rpos, wpos = 0, last = -1, i;
+
+    if((fe = ext2_open(context, directory, O_RDWR, 01777, rerrno)) == NULL) {
+        return -1;
+    }
+    if(ext2_lock_inode(fe, 1)) {
+        *rerrno = EIO;
+        ext2_close(fe, &i);
+        return -1;
+    }
+    block_size = ext2_block_size(context);
+    directory_length = ext2_lseek(fe, 0, SEEK_END, rerrno);
+    for(rpos=0;rpos<directory_length;rpos+=dir_header.rec_len) {
+        if((ext2_lseek(fe, rpos, SEEK_SET, rerrno) != rpos) ||
+            (ext2_read(fe, &dir_header, sizeof(dir_header), rerrno) != sizeof(dir_header)) ||
+            (dir_header.rec_len < sizeof(dir_header)) || (dir_header.rec_len % 4)) {
+            *rerrno = EIO;
+            ext2_close(fe, &i);
+            return -1;
+        }
+        if(dir_header.inode == 0) {
+            continue;
+        }
+        if(ext2_read(fe, &entry[sizeof(dir_header)], dir_header.name_len, rerrno) !=
+            dir_header.name_len) {
+            *rerrno = EIO;
+            ext2_close(fe, &i);
+            return -1;
+        }
+        entry_len = EXT2_DIRENT_LEN(dir_header.name_len);
+        if(wpos / block_size != (wpos + entry_len - 1) / block_size) {
+            /* no room left in this block, stretch its last entry to the end */
+            last_header.rec_len += block_size - (wpos % block_size);
+            ext2_lseek(fe, last, SEEK_SET, &i);
+            ext2_write(fe, &last_header, sizeof(last_header), &i);
+            wpos += block_size - (wpos % block_size);
+        }
+        last_header = dir_header;
+        last_header.rec_len = entry_len;
+        last = wpos;
+        if((wpos != rpos) || (dir_header.rec_len != entry_len)) {
+            memcpy(entry, &last_header, sizeof(last_header));
+            ext2_lseek(fe, wpos, SEEK_SET, &i);
+            if(ext2_write(fe, entry, sizeof(last_header) + dir_header.name_len, rerrno) !=
+                (int)(sizeof(last_header) + dir_header.name_len)) {
+                ext2_close(fe, &i);
+                return -1;
+            }
+        }
+        wpos += entry_len;
+    }
+    /* the first block always holds . and .., so there is a last entry to pad out */
+    if(last >= 0) {
+        last_header.rec_len += (block_size - (wpos % block_size)) % block_size;
+        ext2_lseek(fe, last, SEEK_SET, &i);
+        ext2_write(fe, &last_header, sizeof(last_header), &i);
+        wpos += (block_size - (wpos % block_size)) % block_size;
+    }
+    if((wpos >= block_size) && (wpos < directory_length) && ext2_ftruncate(fe, wpos, rerrno)) {
+        ext2_close(fe, &i);
+        return -1;
+    }
+    return ext2_close(fe, rerrno);
 }
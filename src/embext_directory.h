@@ -9,7 +9,8 @@ struct ext2_dir_header {
 };
 
 int ext2_append_to_directory(struct ext2context *context, char *directory, uint32_t inode,
-                             char *filename, int *rerrno);
+                             char *filename, uint8_t file_type, int *rerrno);
 int ext2_delete_from_directory(struct ext2context *context, char *filename, int *rerrno);
+int ext2_compact_directory(struct ext2context *context, const char *directory, int *rerrno);
 
 #endif /* ifndef EMBEXT_DIRECTORY_H */
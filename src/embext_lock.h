@@ -0,0 +1,120 @@
+#ifndef EMBEXT_LOCK_H
+#define EMBEXT_LOCK_H 1
+
+/**
+ * \brief Locking primitives used to make a mounted context reentrant.
+ *
+ * When the library is built with EMBEXT_THREADSAFE defined the locks map onto recursive POSIX
+ * mutexes so that several threads (or RTOS tasks with a pthread layer) can share one
+ * ext2context.  Without it every lock operation compiles away to nothing, which keeps the single
+ * threaded microcontroller build exactly as small as before.
+ *
+ * Locks are always taken in the order inode -> block group -> superblock so nested acquisition
+ * cannot deadlock.  The mutexes are recursive because allocation helpers re-enter code paths that
+ * already hold the lock for their own block group.
+ **/
+
+#ifdef EMBEXT_THREADSAFE
+#include <pthread.h>
+#include <sched.h>
+
+typedef pthread_mutex_t ext2_lock_t;
+
+static inline void ext2_lock_init(ext2_lock_t *lock) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+#define ext2_lock_destroy(l) pthread_mutex_destroy(l)
+#define ext2_lock(l)         pthread_mutex_lock(l)
+#define ext2_unlock(l)       pthread_mutex_unlock(l)
+
+/**
+ * \brief Sequence counter allowing readers to run without taking a lock.
+ *
+ * Writers must already hold the mutex protecting the data and bracket their update with
+ * ext2_seq_write_begin() and ext2_seq_write_end().  The write side nests, only the outermost
+ * begin/end pair moves the counter, so a helper that updates data while its caller already has
+ * an update open does not expose a half finished state.  Readers take a snapshot with
+ * ext2_seq_read_begin(), copy the data, then repeat if ext2_seq_read_retry() says a writer got
+ * in the way.  A thread must not start a read on a counter it has open for writing.
+ **/
+typedef struct {
+    uint32_t seq;
+    uint32_t depth;
+} ext2_seq_t;
+
+#define EXT2_SEQ_INIT { 0, 0 }
+
+static inline uint32_t ext2_seq_read_begin(ext2_seq_t *s) {
+    uint32_t v;
+    while((v = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return v;
+}
+
+static inline int ext2_seq_read_retry(ext2_seq_t *s, uint32_t v) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != v;
+}
+
+static inline void ext2_seq_write_begin(ext2_seq_t *s) {
+    if(s->depth++ == 0) {
+        __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+static inline void ext2_seq_write_end(ext2_seq_t *s) {
+    if(--s->depth == 0) {
+        __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * \brief Counter that other threads read without a lock, only ever compared for a change.
+ **/
+#define ext2_counter_inc(c)  __atomic_add_fetch(c, 1, __ATOMIC_RELEASE)
+#define ext2_counter_get(c)  __atomic_load_n(c, __ATOMIC_ACQUIRE)
+
+#else
+
+typedef uint8_t ext2_lock_t;
+
+#define ext2_lock_init(l)    ((void)(l))
+#define ext2_lock_destroy(l) ((void)(l))
+#define ext2_lock(l)         ((void)(l))
+#define ext2_unlock(l)       ((void)(l))
+
+typedef uint8_t ext2_seq_t;
+
+#define EXT2_SEQ_INIT 0
+
+#define ext2_seq_read_begin(s)     ((void)(s), 0u)
+#define ext2_seq_read_retry(s, v)  ((void)(s), (void)(v), 0)
+#define ext2_seq_write_begin(s)    ((void)(s))
+#define ext2_seq_write_end(s)      ((void)(s))
+
+#define ext2_counter_inc(c)  (++(*(c)))
+#define ext2_counter_get(c)  (*(c))
+
+#endif /* ifdef EMBEXT_THREADSAFE */
+
+/**
+ * Number of inode locks per mounted context.  Inodes are hashed onto this table by the inode
+ * table sector that holds them, so two inodes sharing a sector (and therefore a read-modify-write
+ * cycle in ext2_flush_inode()) always share a lock.
+ **/
+#ifndef EXT2_INODE_LOCKS
+#ifdef EMBEXT_THREADSAFE
+#define EXT2_INODE_LOCKS 64
+#else
+#define EXT2_INODE_LOCKS 1
+#endif
+#endif
+
+#endif /* ifndef EMBEXT_LOCK_H */
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2012-2014, Nathan Dumont
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of
+ *    conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of
+ *    conditions and the following disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ * 3. Neither the name of the author nor the names of any contributors may be used to endorse or
+ *    promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * This file is part of the Embext EXT2 compatible filesystem driver.
+ */
+
+/**
+ * \file
+ * \brief Fixed size files that keep the newest data written to them.
+ *
+ * A ring file is allocated in one contiguous run when it is made and never changes length after
+ * that.  Writes go round the data area overwriting the oldest bytes, so once it is made logging
+ * into it allocates nothing and leaves the inode and block map alone, the only writes are the
+ * data sectors and the header sector every #EXT2_RING_SYNC_BYTES.
+ **/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "block.h"
+#include "embext.h"
+#include "embext_ring.h"
+
+#define EXT2_RING_DATA 512      // offset of the data area, the header has the first sector
+
+struct ext2_ring {
+    void *fe;
+    struct ext2_ring_header header;
+    uint32_t unsynced;          // bytes written since the header was last stored
+    uint64_t stored_tail;       // tail in the header on disk, data from there on mustn't be written over
+};
+
+/**
+ * \brief Sync the data then write the header with the given tail, which can be ahead of the ring's.
+ **/
+static int ext2_ring_store(struct ext2_ring *ring, uint64_t tail, int *rerrno) {
+    struct ext2_ring_header header = ring->header;
+
+    header.tail = tail;
+    if(ext2_fdatasync(ring->fe, rerrno) ||
+        (ext2_lseek(ring->fe, 0, SEEK_SET, rerrno) != 0) ||
+        (ext2_write(ring->fe, &header, sizeof(header), rerrno) != sizeof(header)) ||
+        ext2_fdatasync(ring->fe, rerrno)) {
+        return -1;
+    }
+    ring->stored_tail = tail;
+    ring->unsynced = 0;
+    return 0;
+}
+
+/**
+ * \brief Copy between the caller and the data area at a ring position, going round the end.
+ **/
+static int ext2_ring_transfer(struct ext2_ring *ring, uint64_t position, void *buffer, size_t count,
+                              int write, int *rerrno) {
+    uint32_t offset, amount;
+    uint8_t *bt = (uint8_t *)buffer;
+    int r;
+
+    while(count > 0) {
+        offset = position % ring->header.capacity;
+        amount = ring->header.capacity - offset;
+        if(amount > count) {
+            amount = count;
+        }
+        if(ext2_lseek(ring->fe, EXT2_RING_DATA + offset, SEEK_SET, rerrno) != (int)(EXT2_RING_DATA + offset)) {
+            return -1;
+        }
+        r = write ? ext2_write(ring->fe, bt, amount, rerrno) : ext2_read(ring->fe, bt, amount, rerrno);
+        if(r != (int)amount) {
+            if(r >= 0) {
+                *rerrno = EIO;
+            }
+            return -1;
+        }
+        position += amount;
+        bt += amount;
+        count -= amount;
+    }
+    return 0;
+}
+
+/**
+ * \brief Open a ring file, making it if it doesn't exist.
+ *
+ * A new ring file is preallocated in full with ext2_fallocate() and its header written, this is
+ * the only time a ring file allocates anything.  An existing ring keeps the capacity it was made
+ * with and carries on from where its header says.  After a power cut that may leave out up to
+ * #EXT2_RING_SYNC_BYTES of the newest data, and once the ring has filled up to
+ * #EXT2_RING_SYNC_BYTES of the oldest too, as the header's tail is moved on ahead of the writes
+ * that go over it.
+ *
+ * Like an open file a ring must only be used by one thread at a time.
+ *
+ * \param context The mounted volume.
+ * \param name Full path of the ring file.
+ * \param capacity Bytes of data a new ring file keeps.
+ * \param rerrno Set to the error code on failure, EINVAL if the file isn't a ring file.
+ * \returns the ring or NULL on error.
+ **/
+struct ext2_ring *ext2_ring_open(struct ext2context *context, const char *name, uint32_t capacity,
+                                 int *rerrno) {
+    struct ext2_ring *ring;
+    int e;
+
+    if((ring = (struct ext2_ring *)malloc(sizeof(struct ext2_ring))) == NULL) {
+        *rerrno = ENOMEM;
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct ext2_ring));
+    if((ring->fe = ext2_open(context, name, O_RDWR, 0777, rerrno)) != NULL) {
+        if((ext2_read(ring->fe, &ring->header, sizeof(ring->header), rerrno) != sizeof(ring->header)) ||
+            (ring->header.magic != EXT2_RING_MAGIC) || (ring->header.capacity == 0) ||
+            (ring->header.head < ring->header.tail) ||
+            (ring->header.head - ring->header.tail > ring->header.capacity) ||
+            (ext2_lseek(ring->fe, 0, SEEK_END, rerrno) != (int)(EXT2_RING_DATA + ring->header.capacity))) {
+            ext2_close(ring->fe, &e);
+            free(ring);
+            *rerrno = EINVAL;
+            return NULL;
+        }
+        ring->stored_tail = ring->header.tail;
+        return ring;
+    }
+    if((*rerrno != ENOENT) || (capacity == 0) || (capacity > INT32_MAX - EXT2_RING_DATA)) {
+        *rerrno = (*rerrno == ENOENT) ? EINVAL : *rerrno;
+        free(ring);
+        return NULL;
+    }
+    if((ring->fe = ext2_open(context, name, O_RDWR | O_CREAT, 0777, rerrno)) == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->header.magic = EXT2_RING_MAGIC;
+    ring->header.capacity = capacity;
+    if(ext2_fallocate(ring->fe, 0, EXT2_RING_DATA + capacity, 0, rerrno) ||
+        ext2_ring_sync(ring, rerrno)) {
+        ext2_close(ring->fe, &e);
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+/**
+ * \brief Add data to the ring, the oldest data goes if there isn't room.
+ *
+ * \returns count on success, -1 on error.
+ **/
+int ext2_ring_write(struct ext2_ring *ring, const void *buffer, size_t count, int *rerrno) {
+    const uint8_t *bt = (const uint8_t *)buffer;
+    size_t written = count;
+    uint64_t tail;
+
+    if(count > ring->header.capacity) {
+        // only the end of it would survive anyway
+        bt += count - ring->header.capacity;
+        ring->header.head += count - ring->header.capacity;
+        count = ring->header.capacity;
+    }
+    if(ring->header.head + count > ring->stored_tail + ring->header.capacity) {
+        // the header on disk still holds the data about to be written over, after a power cut it
+        // would come back in the wrong order, so move its tail on first, far enough to cover the
+        // next #EXT2_RING_SYNC_BYTES as well
+        tail = ring->header.head + count + EXT2_RING_SYNC_BYTES - ring->header.capacity;
+        tail = (tail > ring->header.head) ? ring->header.head : tail;
+        tail = (tail < ring->header.tail) ? ring->header.tail : tail;
+        if(ext2_ring_store(ring, tail, rerrno)) {
+            return -1;
+        }
+    }
+    if(ext2_ring_transfer(ring, ring->header.head, (void *)bt, count, 1, rerrno)) {
+        return -1;
+    }
+    ring->header.head += count;
+    if(ring->header.head - ring->header.tail > ring->header.capacity) {
+        ring->header.tail = ring->header.head - ring->header.capacity;
+    }
+    ring->unsynced += count;
+    if((ring->unsynced >= EXT2_RING_SYNC_BYTES) && ext2_ring_sync(ring, rerrno)) {
+        return -1;
+    }
+    return (int)written;
+}
+
+/**
+ * \brief Take the oldest data out of the ring.
+ *
+ * \returns the number of bytes read, 0 when the ring is empty, -1 on error.
+ **/
+int ext2_ring_read(struct ext2_ring *ring, void *buffer, size_t count, int *rerrno) {
+    if(count > ring->header.head - ring->header.tail) {
+        count = ring->header.head - ring->header.tail;
+    }
+    if(ext2_ring_transfer(ring, ring->header.tail, buffer, count, 0, rerrno)) {
+        return -1;
+    }
+    ring->header.tail += count;
+    return count;
+}
+
+/**
+ * \brief Store the header so the ring carries on from here after a power cut.
+ *
+ * The data is synced before the header that covers it is written.
+ **/
+int ext2_ring_sync(struct ext2_ring *ring, int *rerrno) {
+    return ext2_ring_store(ring, ring->header.tail, rerrno);
+}
+
+/**
+ * \brief Store the header and close the ring file.
+ **/
+int ext2_ring_close(struct ext2_ring *ring, int *rerrno) {
+    int r = ext2_ring_sync(ring, rerrno);
+    int e;
+
+    if(ext2_close(ring->fe, r ? &e : rerrno)) {
+        r = -1;
+    }
+    free(ring);
+    return r;
+}
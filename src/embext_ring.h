@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2012-2014, Nathan Dumont
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of
+ *    conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of
+ *    conditions and the following disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ * 3. Neither the name of the author nor the names of any contributors may be used to endorse or
+ *    promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * This file is part of the Embext EXT2 compatible filesystem driver.
+ */
+
+#ifndef EMBEXT_RING_H
+#define EMBEXT_RING_H 1
+
+/**
+ * Bytes written to a ring file between updates of its header, a power cut loses at most this
+ * much of the newest data, and once the ring is full as much of the oldest.  ext2_ring_sync()
+ * updates it at any time.
+ **/
+#ifndef EXT2_RING_SYNC_BYTES
+#define EXT2_RING_SYNC_BYTES 8192
+#endif
+
+#define EXT2_RING_MAGIC 0x474e4952      // "RING"
+
+/**
+ * \brief The first sector of a ring file, the data area follows it.
+ *
+ * head and tail count bytes from when the ring was made, so head - tail is the amount held and
+ * the position of either in the data area is it modulo capacity.
+ **/
+struct ext2_ring_header {
+    uint32_t magic;
+    uint32_t capacity;          // bytes in the data area
+    uint64_t head;              // bytes ever written
+    uint64_t tail;              // oldest byte not yet read or written over
+};
+
+struct ext2_ring;
+
+struct ext2_ring *ext2_ring_open(struct ext2context *context, const char *name, uint32_t capacity,
+                                 int *rerrno);
+int ext2_ring_write(struct ext2_ring *ring, const void *buffer, size_t count, int *rerrno);
+int ext2_ring_read(struct ext2_ring *ring, void *buffer, size_t count, int *rerrno);
+int ext2_ring_sync(struct ext2_ring *ring, int *rerrno);
+int ext2_ring_close(struct ext2_ring *ring, int *rerrno);
+
+#endif /* ifndef EMBEXT_RING_H */
@@ -3,28 +3,40 @@
 #include <string.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include "hash.h"
 #include "dirent.h"
 #include "block_pc.h"
 #include "block.h"
 #include "embext.h"
+#include "embext_directory.h"
+#include "embext_ring.h"
 
 int main(int argc __attribute__((__unused__)), char *argv[] __attribute__((__unused__))) {
     int p = 0, r, i;
     int flen;
     int result;
     char buffer[256];
+    char chunk[1000], expect[1000];
+    const void *view;
+    struct ext2_extent ext[2];
+    int flen2, r2;
     struct md_context hash_context;
     uint8_t real_hash[16];
     struct stat st;
+    struct ext2_dirent_stat ds[8];
+    int found, entries;
     struct ext2context *context;
+    struct ext2_ring *ring;
+    struct ext2_ring_header ring_header;
     FILE *fhash;
   
     printf("Running EXT2 tests...\n\n");
     
     /* First pass, start the block driver layer */
     block_pc_set_image_name("testext.img");
+    block_pc_set_au_size(256);
     printf("[%4d] %-60s", p++, "start block device emulation...");
     fflush(stdout);
     result = block_init();
@@ -62,9 +74,11 @@ int main(int argc __attribute__((__unused__)), char *argv[] __attribute__((__unu
         exit(1);
     }
     void *fe2;
-    struct dirent *de;
+    struct dirent *de, *de2;
+    struct dirent entry, entry2;
+    long cookie;
   
-    while((de = ext2_readdir(fe, &result))) {
+    while((ext2_readdir_r(fe, &entry, &de, &result) == 0) && de) {
         snprintf(buffer, sizeof(buffer), "/%s", de->d_name);
         if(!(fe2 = ext2_open(context, buffer, O_RDONLY, 0777, &result))) {
             printf("Opening %s failed. [%d]\n", buffer, result);
@@ -76,16 +90,45 @@ int main(int argc __attribute__((__unused__)), char *argv[] __attribute__((__unu
             exit(1);
         }
         printf("/%s [%d] %d\n", de->d_name, de->d_ino, (int)st.st_size);
+        if((de->d_type != DT_UNKNOWN) && ((de->d_type == DT_DIR) != S_ISDIR(st.st_mode))) {
+            printf("d_type %d of %s doesn't match mode 0%o\n", de->d_type, buffer,
+                   (unsigned int)st.st_mode);
+            exit(1);
+        }
         if((st.st_mode & S_IFDIR) && (strcmp(de->d_name, ".") != 0) &&
             (strcmp(de->d_name, "..") != 0)) {
-            while((de = ext2_readdir(fe2, &result))) {
-                printf("  %s [%d]\n", de->d_name, de->d_ino);
+            while((ext2_readdir_r(fe2, &entry2, &de2, &result) == 0) && de2) {
+                printf("  %s [%d]\n", de2->d_name, de2->d_ino);
             }
         }
         ext2_close(fe2, &result);
     }
     ext2_close(fe, &result);
   
+    /* Resume a directory listing from a telldir() cookie */
+    printf("[%4d] %-60s", p++, "directory seek test");
+    fflush(stdout);
+    fe = ext2_open(context, "/", O_RDONLY, 0777, &result);
+    ext2_readdir(fe, &result);
+    ext2_readdir(fe, &result);
+    cookie = ext2_telldir(fe, &result);
+    de = ext2_readdir(fe, &result);
+    if((cookie < 0) || (de == NULL)) {
+        printf("    fail\n");
+        printf("    Couldn't read a third entry from the root folder\n");
+        exit(1);
+    }
+    strncpy(buffer, de->d_name, sizeof(buffer));
+    while(ext2_readdir(fe, &result));
+    if(ext2_seekdir(fe, cookie, &result) || !(de = ext2_readdir(fe, &result)) ||
+        strcmp(buffer, de->d_name)) {
+        printf("    fail\n");
+        printf("    Entry after seekdir() didn't match \"%s\"\n", buffer);
+        exit(1);
+    }
+    ext2_close(fe, &result);
+    printf("    pass\n");
+  
     /* Read a binary file and do an MD5 sum to check it was read correctly */
     printf("[%4d] %-60s", p++, "read binary file");
     fflush(stdout);
@@ -142,6 +185,114 @@ int main(int argc __attribute__((__unused__)), char *argv[] __attribute__((__unu
         printf("    pass\n");
     }
 
+    /* Read the same file again in large chunks, sequentially then after seeks, against the dump */
+    printf("[%4d] %-60s", p++, "read binary file in large chunks");
+    fflush(stdout);
+    fe = ext2_open(context, "/static/test_image.png", O_RDONLY, 0777, &result);
+    fw = fopen("dump.png", "rb");
+    found = 0;
+    for(i=0;found < flen;i++) {
+        if(i > 8) {
+            /* then jump around the file */
+            found = (i * 7919) % flen;
+            ext2_lseek(fe, found, SEEK_SET, &result);
+            fseek(fw, found, SEEK_SET);
+            if(i > 16) {
+                break;
+            }
+        }
+        r = ext2_read(fe, chunk, sizeof(chunk), &result);
+        if((r <= 0) || (fread(expect, 1, r, fw) != (size_t)r) || memcmp(chunk, expect, r)) {
+            printf("    fail\n");
+            printf("    Data at offset %d didn't match\n", found);
+            exit(1);
+        }
+        found += r;
+    }
+    fclose(fw);
+    ext2_close(fe, &result);
+    printf("    pass\n");
+
+    /* Read it once more through views of the data in place, as a checksum or a send would */
+    printf("[%4d] %-60s", p++, "read binary file without copying");
+    fflush(stdout);
+    fe = ext2_open(context, "/static/test_image.png", O_RDONLY, 0777, &result);
+    fw = fopen("dump.png", "rb");
+    found = 0;
+    while((r = ext2_read_ptr(fe, &view, sizeof(chunk), &result)) > 0) {
+        if((fread(expect, 1, r, fw) != (size_t)r) || memcmp(view, expect, r)) {
+            break;
+        }
+        found += r;
+    }
+    fclose(fw);
+    ext2_close(fe, &result);
+    if((r != 0) || (found != flen)) {
+        printf("    fail\n");
+        printf("    Data at offset %d didn't match\n", found);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* Fetch the file straight from the device using the extent map, as a DMA engine would */
+    printf("[%4d] %-60s", p++, "read binary file through its extent map");
+    fflush(stdout);
+    fe = ext2_open(context, "/static/test_image.png", O_RDONLY, 0777, &result);
+    fw = fopen("dump.png", "rb");
+    found = 0;
+    while((r = ext2_fiemap(fe, found, flen, ext, sizeof(ext) / sizeof(ext[0]), &result)) > 0) {
+        for(i=0;(i<r) && (found >= 0);i++) {
+            for(flen2=0;(flen2 < (int)ext[i].length) && (found >= 0);flen2+=BLOCK_SIZE) {
+                r2 = (ext[i].length - flen2 < BLOCK_SIZE) ? ext[i].length - flen2 : BLOCK_SIZE;
+                if((ext[i].flags & EXT2_EXTENT_HOLE) || block_read(ext[i].physical + flen2 / BLOCK_SIZE, chunk) ||
+                    (fread(expect, 1, r2, fw) != (size_t)r2) || memcmp(chunk, expect, r2)) {
+                    found = -1;
+                }
+            }
+            if(found >= 0) {
+                found += ext[i].length;
+            }
+        }
+        if((found < 0) || (ext[r - 1].flags & EXT2_EXTENT_LAST)) {
+            break;
+        }
+    }
+    fclose(fw);
+    ext2_close(fe, &result);
+    if(found != flen) {
+        printf("    fail\n");
+        printf("    Extent map didn't match the file, got to %d\n", found);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* List a directory with attributes in one call and check them against the file just read */
+    printf("[%4d] %-60s", p++, "bulk directory listing");
+    fflush(stdout);
+    fe = ext2_open(context, "/static", O_RDONLY, 0777, &result);
+    found = 0;
+    while((r = ext2_getdents_stat(fe, ds, sizeof(ds) / sizeof(ds[0]), &result)) > 0) {
+        for(i=0;i<r;i++) {
+            if(strcmp(ds[i].de.d_name, "test_image.png") == 0) {
+                found = 1;
+                if(((int)ds[i].st.st_size != flen) || !S_ISREG(ds[i].st.st_mode) ||
+                    ((int)ds[i].st.st_ino != ds[i].de.d_ino)) {
+                    printf("    fail\n");
+                    printf("    Attributes wrong, size %d mode 0%o\n", (int)ds[i].st.st_size,
+                           (unsigned int)ds[i].st.st_mode);
+                    exit(1);
+                }
+            }
+        }
+    }
+    ext2_close(fe, &result);
+    if((r < 0) || !found) {
+        printf("    fail\n");
+        printf("    test_image.png not listed, errno = %d\n", result);
+        exit(1);
+    }
+    printf("    pass\n");
+
     /* test appending to a file */
     printf("[%4d] %-60s", p++, "append test");
     fflush(stdout);
@@ -194,10 +345,527 @@ int main(int argc __attribute__((__unused__)), char *argv[] __attribute__((__unu
     ext2_fstat(fe, &st, &result);
     ext2_close(fe, &result);
     
+    /* the new entry must carry its type if the volume records types in directory entries */
+    printf("[%4d] %-60s", p++, "new entry file type");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs", O_RDONLY, 0777, &result);
+    while((de = ext2_readdir(fe, &result)) && strcmp(de->d_name, "new_test.txt"));
+    if((de == NULL) || (de->d_type != ((context->superblock.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) ?
+                                       DT_REG : DT_UNKNOWN))) {
+        printf("    fail\n");
+        printf("    new_test.txt %s\n", de ? "has the wrong d_type" : "not found");
+        exit(1);
+    }
+    ext2_close(fe, &result);
+    printf("    pass\n");
+    
+    /* a listing in progress sees an entry added to the directory through another handle */
+    printf("[%4d] %-60s", p++, "entry added while a directory is listed");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs", O_RDONLY, 0777, &result);
+    de = ext2_readdir(fe, &result);
+    fe2 = ext2_open(context, "/logs/listed.txt", O_WRONLY | O_CREAT, 0777, &result);
+    ext2_close(fe2, &result);
+    while((de = ext2_readdir(fe, &result)) && strcmp(de->d_name, "listed.txt"));
+    ext2_close(fe, &result);
+    if((de == NULL) || ext2_unlink(context, "/logs/listed.txt", &result)) {
+        printf("    fail\n");
+        printf("    listed.txt not listed, errno = %d\n", result);
+        exit(1);
+    }
+    while(ext2_reclaim(context, 64, &result) > 0);
+    printf("    pass\n");
+    
     printf("new file inode = %d\n", (int)st.st_ino);
     printf("new file size = %d\n", (int)st.st_size);
     ext2_print_inode(fe);
     
+    /* an overwrite in the middle of a file is seen by reads through the same handle and kept */
+    printf("[%4d] %-60s", p++, "overwrite mid-file and read back through the same handle");
+    fflush(stdout);
+    memset(chunk, 'o', sizeof(chunk));
+    fe = ext2_open(context, "/logs/overwrite.bin", O_RDWR | O_CREAT, 0777, &result);
+    for(i=0;(fe != NULL) && (i<8);i++) {
+        ext2_write(fe, chunk, sizeof(chunk), &result);
+    }
+    ext2_close(fe, &result);
+    fe = ext2_open(context, "/logs/overwrite.bin", O_RDWR, 0777, &result);
+    memset(chunk, 'N', 113);
+    r2 = (fe == NULL) || (ext2_lseek(fe, 600, SEEK_SET, &result) != 600) ||
+         (ext2_write(fe, chunk, 113, &result) != 113);
+    for(found=0;!r2 && (found<2);found+=!r2) {
+        // once through the handle that wrote it, then again from the volume
+        if(found && (ext2_close(fe, &result) ||
+                     ((fe = ext2_open(context, "/logs/overwrite.bin", O_RDONLY, 0777, &result)) == NULL))) {
+            r2 = 1;
+            break;
+        }
+        ext2_lseek(fe, 0, SEEK_SET, &result);
+        for(flen=0;!r2 && ((r = ext2_read(fe, expect, sizeof(expect), &result)) > 0);flen+=r) {
+            for(i=0;!r2 && (i<r);i++) {
+                r2 = expect[i] != (((flen + i >= 600) && (flen + i < 713)) ? 'N' : 'o');
+            }
+        }
+        r2 = r2 || (flen != 8000);
+    }
+    if(r2 || ext2_close(fe, &result) || ext2_unlink(context, "/logs/overwrite.bin", &result)) {
+        printf("    fail\n");
+        printf("    Read back %s the wrong data, errno = %d\n", found ? "from the volume" : "through the handle",
+               result);
+        exit(1);
+    }
+    while(ext2_reclaim(context, 64, &result) > 0);
+    printf("    pass\n");
+
+#if EXT2_STREAM_BUFFERS > 0
+    /* a streamed handle writes and reads with transfers in flight, the data must come back */
+    printf("[%4d] %-60s", p++, "streamed write and read back");
+    fflush(stdout);
+    for(i=0;i<(int)sizeof(chunk);i++) {
+        chunk[i] = 'A' + i % 23;
+    }
+    fe = ext2_open(context, "/logs/stream.txt", O_WRONLY | O_CREAT, 0777, &result);
+    if((fe == NULL) || ext2_set_stream(fe, 1, &result)) {
+        printf("    fail\n");
+        printf("    Open for streaming failed, errno=%d (%s)\n", result, strerror(result));
+        exit(1);
+    }
+    for(flen=0;flen<(int)sizeof(chunk);flen+=r) {
+        if((r = ext2_write(fe, &chunk[flen], 100, &result)) <= 0) {
+            break;
+        }
+    }
+    r = ext2_close(fe, &result);
+    fe = ext2_open(context, "/logs/stream.txt", O_RDONLY, 0777, &result);
+    if((flen != (int)sizeof(chunk)) || r || (fe == NULL) || ext2_set_stream(fe, 1, &result)) {
+        printf("    fail\n");
+        printf("    Wrote %d bytes, errno=%d (%s)\n", flen, result, strerror(result));
+        exit(1);
+    }
+    for(flen=0;(r = ext2_read(fe, expect, 100, &result)) > 0;flen+=r) {
+        if(memcmp(expect, &chunk[flen], r)) {
+            break;
+        }
+    }
+    ext2_close(fe, &result);
+    if((r != 0) || (flen != (int)sizeof(chunk))) {
+        printf("    fail\n");
+        printf("    Read back %d bytes, errno = %d\n", flen, result);
+        exit(1);
+    }
+    printf("    pass\n");
+    
+    /* reading back through the streamed handle that wrote the data must see the writes */
+    printf("[%4d] %-60s", p++, "streamed write and read back through the same handle");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs/stream2.txt", O_RDWR | O_CREAT, 0777, &result);
+    r2 = (fe == NULL) || ext2_set_stream(fe, 1, &result) || (ext2_write(fe, chunk, 325, &result) != 325) ||
+         (ext2_lseek(fe, 0, SEEK_SET, &result) != 0) || (ext2_read(fe, expect, sizeof(expect), &result) != 325) ||
+         memcmp(expect, chunk, 325) || (ext2_lseek(fe, 0, SEEK_SET, &result) != 0) ||
+         (ext2_write(fe, "Z", 1, &result) != 1) || ext2_close(fe, &result);
+    chunk[0] = 'Z';
+    fe = r2 ? NULL : ext2_open(context, "/logs/stream2.txt", O_RDONLY, 0777, &result);
+    if((fe == NULL) || (ext2_read(fe, expect, sizeof(expect), &result) != 325) || memcmp(expect, chunk, 325) ||
+        ext2_close(fe, &result) || ext2_unlink(context, "/logs/stream2.txt", &result)) {
+        printf("    fail\n");
+        printf("    Read back the wrong data %s, errno = %d\n", r2 ? "through the handle" : "from the volume", result);
+        exit(1);
+    }
+    while(ext2_reclaim(context, 64, &result) > 0);
+    printf("    pass\n");
+#endif
+
+    /* writing past the end leaves a hole that reads back as zeros and seeks can find */
+    printf("[%4d] %-60s", p++, "sparse write, read back and seek");
+    fflush(stdout);
+    for(i=0;i<(int)sizeof(chunk);i++) {
+        chunk[i] = 'a' + i % 19;
+    }
+    fe = ext2_open(context, "/logs/sparse.bin", O_RDWR | O_CREAT, 0777, &result);
+    if((fe == NULL) || (ext2_write(fe, chunk, sizeof(chunk), &result) != (int)sizeof(chunk)) ||
+        (ext2_lseek(fe, 40000, SEEK_SET, &result) != 40000) ||
+        (ext2_write(fe, chunk, sizeof(chunk), &result) != (int)sizeof(chunk))) {
+        printf("    fail\n");
+        printf("    Write failed, errno=%d (%s)\n", result, strerror(result));
+        exit(1);
+    }
+    ext2_lseek(fe, 0, SEEK_SET, &result);
+    for(flen=0;(r = ext2_read(fe, expect, sizeof(expect), &result)) > 0;flen+=r) {
+        for(i=0;i<r;i++) {
+            if(expect[i] != (((flen + i < 1000) || (flen + i >= 40000)) ? chunk[(flen + i) % 1000] : 0)) {
+                break;
+            }
+        }
+        if(i < r) {
+            break;
+        }
+    }
+    found = ext2_lseek(fe, 0, SEEK_HOLE, &result);
+    r2 = ext2_lseek(fe, found, SEEK_DATA, &result);
+    flen2 = ext2_lseek(fe, 40500, SEEK_HOLE, &result);
+    ext2_close(fe, &result);
+    if((r != 0) || (flen != 41000) || (found < 1000) || (found >= 40000) || (r2 <= found) || (r2 > 40000) ||
+        (flen2 != 41000)) {
+        printf("    fail\n");
+        printf("    Read %d bytes, hole at %d, data at %d, end hole at %d\n", flen, found, r2, flen2);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* truncating on open must give every block back, from the indirect ones down */
+    printf("[%4d] %-60s", p++, "truncate on open");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs/sparse.bin", O_RDWR | O_TRUNC, 0777, &result);
+    if((fe == NULL) || ext2_fstat(fe, &st, &result) || (st.st_size != 0) || (st.st_blocks != 0) ||
+        (ext2_write(fe, chunk, 100, &result) != 100) || ext2_fstat(fe, &st, &result) || (st.st_size != 100)) {
+        printf("    fail\n");
+        printf("    Truncate failed, errno=%d (%s)\n", result, strerror(result));
+        exit(1);
+    }
+    ext2_close(fe, &result);
+    printf("    pass\n");
+
+    /* shrinking gives back the blocks past the new end, growing again shows zeros there */
+    printf("[%4d] %-60s", p++, "ftruncate shrink and grow");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs/sparse.bin", O_RDWR | O_TRUNC, 0777, &result);
+    for(flen=0;(flen < 300000) && (ext2_write(fe, chunk, sizeof(chunk), &result) == (int)sizeof(chunk));flen+=sizeof(chunk));
+    ext2_fstat(fe, &st, &result);
+    r2 = st.st_blocks;
+    if((flen != 300000) || ext2_ftruncate(fe, 150500, &result) || ext2_fstat(fe, &st, &result) ||
+        (st.st_size != 150500) || (st.st_blocks >= r2) || ext2_ftruncate(fe, 200000, &result)) {
+        printf("    fail\n");
+        printf("    Truncate failed, errno=%d (%s)\n", result, strerror(result));
+        exit(1);
+    }
+    ext2_lseek(fe, 0, SEEK_SET, &result);
+    for(flen=0;(r = ext2_read(fe, expect, sizeof(expect), &result)) > 0;flen+=r) {
+        for(i=0;i<r;i++) {
+            if(expect[i] != ((flen + i < 150500) ? chunk[(flen + i) % 1000] : 0)) {
+                break;
+            }
+        }
+        if(i < r) {
+            break;
+        }
+    }
+    ext2_close(fe, &result);
+    if((r != 0) || (flen != 200000)) {
+        printf("    fail\n");
+        printf("    Read back %d bytes, errno = %d\n", flen, result);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* small appends past the direct blocks, the tail mapping must follow a truncate */
+    printf("[%4d] %-60s", p++, "small appends around a truncate");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs/sparse.bin", O_WRONLY | O_APPEND, 0777, &result);
+    for(i=0;i<2000;i++) {
+        ext2_write(fe, "Hello World!\n", 13, &result);
+    }
+    r2 = ext2_ftruncate(fe, 190000, &result);
+    for(i=0;i<4000;i++) {
+        ext2_write(fe, "Hello World!\n", 13, &result);
+    }
+    ext2_close(fe, &result);
+    fe = ext2_open(context, "/logs/sparse.bin", O_RDONLY, 0777, &result);
+    ext2_lseek(fe, 190000, SEEK_SET, &result);
+    for(flen=0;(r = ext2_read(fe, expect, 13, &result)) == 13;flen+=r) {
+        if(memcmp(expect, "Hello World!\n", 13)) {
+            break;
+        }
+    }
+    ext2_close(fe, &result);
+    if((r2 != 0) || (r != 0) || (flen != 52000)) {
+        printf("    fail\n");
+        printf("    Read back %d appended bytes, errno = %d\n", flen, result);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* unlinking is immediate, the space comes back over several reclaim steps */
+    printf("[%4d] %-60s", p++, "unlink and reclaim in steps");
+    fflush(stdout);
+    found = context->superblock.s_free_blocks_count;
+    r2 = context->superblock.s_free_inodes_count;
+    fe = ext2_open(context, "/logs/gone.bin", O_WRONLY | O_CREAT, 0777, &result);
+    for(flen=0;(flen < 300000) && (ext2_write(fe, chunk, sizeof(chunk), &result) == (int)sizeof(chunk));flen+=sizeof(chunk));
+    // not while it is open, the handle would go on writing to blocks given to other files
+    if((ext2_unlink(context, "/logs/gone.bin", &result) != -1) || (result != EBUSY) || ext2_close(fe, &result) ||
+        ext2_unlink(context, "/logs/gone.bin", &result) ||
+        (ext2_open(context, "/logs/gone.bin", O_RDONLY, 0777, &result) != NULL) || (result != ENOENT)) {
+        printf("    fail\n");
+        printf("    Unlink failed, errno=%d (%s)\n", result, strerror(result));
+        exit(1);
+    }
+    // a budget of half the file's blocks has to take more than one step whatever the block size
+    for(i=0;(r = ext2_reclaim(context, flen / ext2_block_size(context) / 2, &result)) > 0;i++);
+    if((r != 0) || (i < 2) || (context->superblock.s_last_orphan != 0) ||
+        ((int)context->superblock.s_free_blocks_count != found) ||
+        ((int)context->superblock.s_free_inodes_count != r2)) {
+        printf("    fail\n");
+        printf("    Reclaim took %d steps, %d blocks free (%d before), errno=%d\n", i,
+               (int)context->superblock.s_free_blocks_count, found, result);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* preallocated blocks are used by the writes that follow, the unused tail goes at close */
+    printf("[%4d] %-60s", p++, "fallocate then stream into the preallocated blocks");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs/prealloc.bin", O_RDWR | O_CREAT, 0777, &result);
+    r = ext2_fallocate(fe, 0, 200000, EXT2_FALLOC_KEEP_SIZE, &result);
+    found = context->superblock.s_free_blocks_count;
+    for(i=0;i<(int)sizeof(chunk);i++) {
+        chunk[i] = 'A' + i % 26;
+    }
+    for(flen=0;(r == 0) && (flen < 150000);flen+=sizeof(chunk)) {
+        ext2_write(fe, chunk, sizeof(chunk), &result);
+    }
+    r2 = ((int)context->superblock.s_free_blocks_count == found) &&
+         (ext2_fiemap(fe, 0, flen, ext, sizeof(ext) / sizeof(ext[0]), &result) == 1);
+    flen2 = ext2_fallocate(fe, flen, 4000, 0, &result);
+    ext2_lseek(fe, flen, SEEK_SET, &result);
+    memset(expect, 1, sizeof(expect));
+    r2 = r2 && (flen2 == 0) && (ext2_read(fe, expect, sizeof(expect), &result) == (int)sizeof(expect));
+    for(i=0;r2 && (i<(int)sizeof(expect));i++) {
+        r2 = (expect[i] == 0);
+    }
+    ext2_close(fe, &result);
+    if((r != 0) || !r2 || ((int)context->superblock.s_free_blocks_count <= found)) {
+        printf("    fail\n");
+        printf("    Preallocated %d, %d free after writing (%d before), errno=%d\n", r,
+               (int)context->superblock.s_free_blocks_count, found, result);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* a large file is put at the start of an empty allocation unit, a small one stays out of it */
+    printf("[%4d] %-60s", p++, "large files start at an empty allocation unit");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs/au.bin", O_RDWR | O_CREAT, 0777, &result);
+    r2 = !fe || ext2_fallocate(fe, 0, 300000, 0, &result) ||
+         (ext2_fiemap(fe, 0, 300000, ext, 1, &result) != 1) || ext2_close(fe, &result);
+    flen = ext[0].physical;
+    flen2 = ext[0].length / BLOCK_SIZE;
+    fe = ext2_open(context, "/logs/small.bin", O_RDWR | O_CREAT, 0777, &result);
+    r2 = r2 || !fe || (ext2_write(fe, chunk, sizeof(chunk), &result) != (int)sizeof(chunk)) ||
+         (ext2_fiemap(fe, 0, sizeof(chunk), ext, 1, &result) != 1) || ext2_close(fe, &result);
+    if(r2 || (flen % 256) || (flen2 < 256) ||
+        (((int)ext[0].physical >= flen) && ((int)ext[0].physical < flen + flen2)) ||
+        ext2_unlink(context, "/logs/au.bin", &result) || ext2_unlink(context, "/logs/small.bin", &result)) {
+        printf("    fail\n");
+        printf("    Large file at sector %d (%d long), small file at %d, errno = %d\n", flen, flen2,
+               (int)ext[0].physical, result);
+        exit(1);
+    }
+    while(ext2_reclaim(context, 64, &result) > 0);
+    printf("    pass\n");
+
+    /* a ring file keeps the newest data without allocating anything once it is made */
+    printf("[%4d] %-60s", p++, "ring file keeps the newest records");
+    fflush(stdout);
+    ring = ext2_ring_open(context, "/logs/ring.bin", 10000, &result);
+    found = context->superblock.s_free_blocks_count;
+    for(i=0;ring && (i<25);i++) {
+        memset(chunk, 'a' + i, sizeof(chunk));
+        if(ext2_ring_write(ring, chunk, sizeof(chunk), &result) != (int)sizeof(chunk)) {
+            break;
+        }
+    }
+    // the header on disk never still holds data that has been written over
+    fe = ext2_open(context, "/logs/ring.bin", O_RDONLY, 0777, &result);
+    r2 = (fe != NULL) && (ext2_read(fe, &ring_header, sizeof(ring_header), &result) == sizeof(ring_header)) &&
+         (ring_header.tail + ring_header.capacity >= 25000) && !ext2_close(fe, &result);
+    r2 = r2 && ((int)context->superblock.s_free_blocks_count == found) && ring && !ext2_ring_close(ring, &result);
+    ring = ext2_ring_open(context, "/logs/ring.bin", 0, &result);
+    for(flen=0;ring && r2 && ((r = ext2_ring_read(ring, expect, sizeof(expect), &result)) > 0);flen+=r) {
+        for(i=0;(i<r) && (expect[i] == 'a' + 15 + (flen + i) / 1000);i++);
+        r2 = (i == r);
+    }
+    if(!ring || !r2 || (r != 0) || (flen != 10000) || ext2_ring_close(ring, &result)) {
+        printf("    fail\n");
+        printf("    Read back %d bytes from the ring, errno = %d\n", flen, result);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* zeroing part way through a file and past its end */
+    printf("[%4d] %-60s", p++, "zero a range inside and past the end of a file");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs/zero.bin", O_RDWR | O_CREAT, 0777, &result);
+    memset(chunk, 'z', sizeof(chunk));
+    for(i=0;fe && (i<8);i++) {
+        ext2_write(fe, chunk, sizeof(chunk), &result);
+    }
+    r2 = ext2_zero_range(fe, 100, 5000, &result) || ext2_zero_range(fe, 7900, 3000, &result);
+    flen = ext2_lseek(fe, 0, SEEK_END, &result);
+    ext2_lseek(fe, 0, SEEK_SET, &result);
+    for(found=0;(r2 == 0) && ((r = ext2_read(fe, expect, sizeof(expect), &result)) > 0);found+=r) {
+        for(i=0;i<r;i++) {
+            if(expect[i] != ((((found + i) >= 100) && ((found + i) < 5100)) || ((found + i) >= 7900) ? 0 : 'z')) {
+                r2 = 1;
+            }
+        }
+    }
+    if(!fe || r2 || (flen != 10900) || (found != 10900) || ext2_close(fe, &result) ||
+        ext2_unlink(context, "/logs/zero.bin", &result)) {
+        printf("    fail\n");
+        printf("    Length %d, read %d bytes, errno = %d\n", flen, found, result);
+        exit(1);
+    }
+    while(ext2_reclaim(context, 64, &result) > 0);
+    printf("    pass\n");
+
+    /* freed blocks reach block_discard() at sync, unless they have been used again by then */
+    printf("[%4d] %-60s", p++, "freed blocks are discarded, reused ones keep their data");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs/trim.bin", O_RDWR | O_CREAT, 0777, &result);
+    memset(chunk, 'q', sizeof(chunk));
+    r2 = !fe || ext2_fallocate(fe, 0, 40000, 0, &result);
+    for(i=0;!r2 && (i<40);i++) {
+        r2 = ext2_write(fe, chunk, sizeof(chunk), &result) != (int)sizeof(chunk);
+    }
+    r2 = r2 || (ext2_fiemap(fe, 0, 40000, ext, 1, &result) != 1) || ext2_close(fe, &result) ||
+         ext2_unlink(context, "/logs/trim.bin", &result);
+    while(ext2_reclaim(context, 64, &result) > 0);
+    fe = ext2_open(context, "/logs/trim2.bin", O_RDWR | O_CREAT, 0777, &result);
+    memset(chunk, 'r', sizeof(chunk));
+    for(i=0;!r2 && fe && (i<20);i++) {
+        r2 = ext2_write(fe, chunk, sizeof(chunk), &result) != (int)sizeof(chunk);
+    }
+    r2 = r2 || !fe || ext2_fdatasync(fe, &result);
+#if EXT2_DISCARD_RANGES == 0
+    r2 = r2 || (ext2_fstrim(context, 1, &result) < 0);
+#endif
+    for(flen=0;!r2 && (flen < (int)(ext[0].length / BLOCK_SIZE));flen++) {
+        // each old sector has been discarded (block_pc clears it) or holds the new file
+        block_read(ext[0].physical + flen, expect);
+        for(i=0;(i<BLOCK_SIZE) && (expect[i] == 'r');i++);
+        for(;(i<BLOCK_SIZE) && (expect[i] == 0);i++);
+        r2 = (i != BLOCK_SIZE);
+    }
+    ext2_lseek(fe, 0, SEEK_SET, &result);
+    for(found=0;!r2 && ((r = ext2_read(fe, expect, sizeof(expect), &result)) > 0);found+=r) {
+        r2 = memcmp(expect, chunk, r) != 0;
+    }
+    if(r2 || (found != 20000) || ext2_close(fe, &result) || ext2_unlink(context, "/logs/trim2.bin", &result) ||
+        (ext2_reclaim(context, 64, &result) < 0) || (ext2_fstrim(context, 1, &result) <= 0)) {
+        printf("    fail\n");
+        printf("    Sector %d of the old file, read %d bytes, errno = %d\n", flen, found, result);
+        exit(1);
+    }
+    printf("    pass\n");
+
+    /* removed entries give their space back, the directory shrinks again and can be packed */
+    printf("[%4d] %-60s", p++, "directory entry removal and compaction");
+    fflush(stdout);
+    fe = ext2_open(context, "/logs", O_RDONLY, 0777, &result);
+    flen = ext2_lseek(fe, 0, SEEK_END, &result);
+    ext2_close(fe, &result);
+    // each entry takes 56 bytes, fill three blocks so that half of them still spans more than one
+    entries = 3 * ext2_block_size(context) / 56;
+    for(i=0;i<entries;i++) {
+        sprintf(buffer, "/logs/a_rather_long_name_for_a_directory_entry_%03d", i);
+        if((fe = ext2_open(context, buffer, O_WRONLY | O_CREAT, 0777, &result)) == NULL) {
+            break;
+        }
+        ext2_close(fe, &result);
+    }
+    for(r=0;r<entries;r+=2) {
+        sprintf(buffer, "/logs/a_rather_long_name_for_a_directory_entry_%03d", r);
+        ext2_unlink(context, buffer, &result);
+    }
+    fe = ext2_open(context, "/logs", O_RDONLY, 0777, &result);
+    flen2 = ext2_lseek(fe, 0, SEEK_END, &result);
+    ext2_close(fe, &result);
+    r2 = ext2_compact_directory(context, "/logs", &result);
+    fe = ext2_open(context, "/logs", O_RDONLY, 0777, &result);
+    found = ext2_lseek(fe, 0, SEEK_END, &result);
+    ext2_close(fe, &result);
+    for(r=0;(r2 == 0) && (r<entries);r++) {
+        sprintf(buffer, "/logs/a_rather_long_name_for_a_directory_entry_%03d", r);
+        fe = ext2_open(context, buffer, O_RDONLY, 0777, &result);
+        if((fe != NULL) == ((r % 2) == 0)) {
+            break;
+        }
+        if(fe) {
+            ext2_close(fe, &result);
+            ext2_unlink(context, buffer, &result);
+        }
+    }
+    while(ext2_reclaim(context, 64, &result) > 0);
+    fe = ext2_open(context, "/logs", O_RDONLY, 0777, &result);
+    if((i != entries) || (r != entries) || (found >= flen2) ||
+        (ext2_lseek(fe, 0, SEEK_END, &result) != flen)) {
+        printf("    fail\n");
+        printf("    Created %d, checked %d, directory %d -> %d -> %d -> %d bytes\n", i, r, flen,
+               flen2, found, (int)ext2_lseek(fe, 0, SEEK_END, &result));
+        exit(1);
+    }
+    ext2_close(fe, &result);
+    printf("    pass\n");
+
+#ifdef EMBEXT_NONBLOCK
+    /* non-blocking calls must give up rather than wait for the device, yet get there when polled */
+    printf("[%4d] %-60s", p++, "non-blocking write and read back");
+    fflush(stdout);
+    found = 0;
+    for(i=0;i<(int)sizeof(chunk);i++) {
+        chunk[i] = 'a' + i % 26;
+    }
+    while(!(fe = ext2_open_nb(context, "/logs/nb_test.txt", O_WRONLY | O_CREAT, 0777, &result)) &&
+          (result == EINPROGRESS)) {
+        block_poll();
+        found++;
+    }
+    flen = 0;
+    while(fe && (flen < (int)sizeof(chunk))) {
+        if((r = ext2_write_nb(fe, &chunk[flen],
+                                (sizeof(chunk) - flen < 250) ? sizeof(chunk) - flen : 250, &result)) > 0) {
+            flen += r;
+        } else if(result == EINPROGRESS) {
+            block_poll();
+            found++;
+        } else {
+            break;
+        }
+    }
+    while(fe && ext2_close_nb(fe, &result) && (result == EINPROGRESS)) {
+        block_poll();
+        found++;
+    }
+    while(!(fe = ext2_open_nb(context, "/logs/nb_test.txt", O_RDONLY, 0777, &result)) &&
+          (result == EINPROGRESS)) {
+        block_poll();
+        found++;
+    }
+    flen = 0;
+    while(fe) {
+        if((r = ext2_read_nb(fe, expect, sizeof(expect), &result)) > 0) {
+            if(memcmp(expect, &chunk[flen], r)) {
+                break;
+            }
+            flen += r;
+        } else if((r < 0) && (result == EINPROGRESS)) {
+            block_poll();
+            found++;
+        } else {
+            break;
+        }
+    }
+    while(fe && ext2_close_nb(fe, &result) && (result == EINPROGRESS)) {
+        block_poll();
+    }
+    if((flen != (int)sizeof(chunk)) || (found == 0)) {
+        printf("    fail\n");
+        printf("    Read back %d bytes, %d calls in progress, errno = %d\n", flen, found, result);
+        exit(1);
+    }
+    printf("    pass\n");
+#endif
+
     /* unmount the volume */
     printf("[%4d] %-60s", p++, "unmount volume");
     fflush(stdout);